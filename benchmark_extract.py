@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+
+# Runs all extraction strategies on the same input, sweeping the selectivity, and writes JSON.
+# Usually called through the build: cmake --build build --target benchmark
+# Or directly: ./benchmark_extract.py --build-dir build --input germany.osm.pbf --output benchmark.json
+#
+# "Cold" evicts the input (and its .blockidx and .nodelocs sidecars) from the page cache before every run, like
+# cachedel does.
+# This only drops clean pages that nobody has mapped, but that's exactly what the input is between runs.
+# "Warm" does one unmeasured run first, so everything that fits is cached.
+# ways_node_store builds the .nodelocs store on its first run if it's missing; run build_node_location_store
+# beforehand to keep that out of the measurements.
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+import time
+
+STRATEGIES = [
+    # (name, executable, selects)
+    ("ways_linear_scan", "extract_some_ways_linear_scan", "ways"),
+    ("ways_random_access", "extract_some_ways_random_access", "ways"),
+    ("ways_planned", "extract_some_ways", "ways"),
+    ("ways_node_store", "extract_some_ways_node_store", "ways"),
+    ("relations_random_access", "extract_some_relations_random_access", "relations"),
+    ("relations_random_access_cached", "extract_some_relations_random_access_cached", "relations"),
+]
+DEFAULT_INPUT = "/scratch/osm/germany-latest_20231101.osm.pbf"
+# Primes, from "a lot" to "a handful" of selected objects on a country extract.
+DEFAULT_MODULOS = [1_009, 10_007, 100_003, 1_000_003]
+SIDECAR_SUFFIX = ".blockidx"  # Same as BLOCK_INDEX_SIDECAR_SUFFIX in pbf_block_index.hpp
+NODE_LOCATION_STORE_SUFFIX = ".nodelocs"  # Same as NODE_LOCATION_STORE_SUFFIX in node_location_store.hpp
+STATS_PREFIX = "# BENCHMARK "  # See ExtractCounters::print in extract_benchmark.hpp
+SIDECAR_MARKER = "(index loaded from sidecar)"
+
+
+def evict_from_page_cache(filename):
+    if not os.path.exists(filename):
+        return
+    fd = os.open(filename, os.O_RDONLY)
+    try:
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    finally:
+        os.close(fd)
+
+
+def run_once(executable, input_filename, modulo):
+    env = dict(os.environ)
+    # Otherwise osmium evicts the input itself while reading, and "warm" would be meaningless.
+    env["OSMIUM_CLEAN_PAGE_CACHE_AFTER_READ"] = "no"
+    with tempfile.TemporaryFile(mode="w+") as output:
+        start = time.monotonic()
+        proc = subprocess.Popen([executable, input_filename, str(modulo)], stdout=output, stderr=subprocess.STDOUT, env=env)
+        _, status, rusage = os.wait4(proc.pid, 0)
+        wall = time.monotonic() - start
+        # Popen doesn't know that we already reaped the child.
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        output.seek(0)
+        lines = output.read().splitlines()
+
+    result = dict(
+        exit_code=proc.returncode,
+        wall_s=wall,
+        user_s=rusage.ru_utime,
+        sys_s=rusage.ru_stime,
+        max_rss_kib=rusage.ru_maxrss,
+        blocks_decoded=None,
+        bytes_read=None,
+        objects_found=0,
+        index_from_sidecar=None,
+    )
+    for line in lines:
+        if line.startswith(STATS_PREFIX):
+            result.update(json.loads(line[len(STATS_PREFIX):]))
+        elif line.startswith("#"):
+            if "File has" in line:
+                result["index_from_sidecar"] = SIDECAR_MARKER in line
+        elif line:
+            result["objects_found"] += 1
+    if proc.returncode != 0:
+        print(f"{executable} failed with exit code {proc.returncode}, last output:", file=sys.stderr)
+        print("\n".join(lines[-10:]), file=sys.stderr)
+    return result
+
+
+def run_all(args):
+    runs = []
+    strategies = [s for s in STRATEGIES if not args.strategy or s[0] in args.strategy]
+    for name, executable_name, selects in strategies:
+        executable = os.path.join(args.build_dir, executable_name)
+        if not os.path.exists(executable):
+            print(f"Skipping {name}, {executable} doesn't exist. Build it first?", file=sys.stderr)
+            continue
+        for modulo in args.modulo:
+            for cache in args.cache:
+                if cache == "warm":
+                    print(f"# Warming up {name} modulo {modulo} …", file=sys.stderr)
+                    run_once(executable, args.input, modulo)
+                for repetition in range(args.repeat):
+                    if cache == "cold":
+                        evict_from_page_cache(args.input)
+                        evict_from_page_cache(args.input + SIDECAR_SUFFIX)
+                        evict_from_page_cache(args.input + NODE_LOCATION_STORE_SUFFIX)
+                    print(f"# Running {name} modulo {modulo}, {cache} cache, run {repetition + 1}/{args.repeat} …", file=sys.stderr)
+                    result = run_once(executable, args.input, modulo)
+                    result.update(strategy=name, selects=selects, modulo=modulo, cache=cache, repetition=repetition)
+                    print(f"#   {result['wall_s']:.3f} s wall, {result['user_s']:.3f} s user, {result['sys_s']:.3f} s sys, "
+                          f"{result['max_rss_kib']} KiB max RSS, {result['blocks_decoded']} blocks", file=sys.stderr)
+                    runs.append(result)
+    return runs
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark the extract_some_* tools against each other.")
+    parser.add_argument("--build-dir", default="build", help="Where the executables are")
+    parser.add_argument("--input", default=DEFAULT_INPUT, help="PBF file that all strategies run on")
+    parser.add_argument("--modulo", type=int, nargs="+", default=DEFAULT_MODULOS, help="Selectivity sweep: every n-th ID is selected")
+    parser.add_argument("--cache", choices=["cold", "warm"], nargs="+", default=["cold", "warm"])
+    parser.add_argument("--repeat", type=int, default=3, help="Measured runs per configuration")
+    parser.add_argument("--strategy", nargs="+", choices=[s[0] for s in STRATEGIES], help="Only run these (default: all)")
+    parser.add_argument("--output", help="JSON file to write (default: stdout)")
+    args = parser.parse_args()
+
+    report = dict(
+        started=datetime.datetime.now().isoformat(timespec="seconds"),
+        host=platform.node(),
+        cpus=os.cpu_count(),
+        input=os.path.abspath(args.input),
+        input_bytes=os.path.getsize(args.input),
+        runs=run_all(args),
+    )
+    if args.output:
+        with open(args.output, "w") as fp:
+            json.dump(report, fp, indent=1)
+        print(f"# Wrote {len(report['runs'])} runs to {args.output}", file=sys.stderr)
+    else:
+        json.dump(report, sys.stdout, indent=1)
+        print()
+    if any(run["exit_code"] != 0 for run in report["runs"]):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <osmium/memory/buffer.hpp>
+
+static const size_t DEFAULT_BLOCK_CACHE_SHARDS = 64;
+// A decoded planet block is typically a few MiB, so this holds roughly a thousand of them.
+static const size_t DEFAULT_BLOCK_CACHE_BUDGET_BYTES = size_t{4} << 30;
+
+struct BlockCacheStats {
+    std::atomic<size_t> hits {0};
+    std::atomic<size_t> misses {0};
+    std::atomic<size_t> evictions {0};
+    // Compressed bytes read from the file, and the size of the decoded buffers.
+    std::atomic<size_t> bytes_read {0};
+    std::atomic<size_t> bytes_decoded {0};
+    std::atomic<uint64_t> read_ns {0};
+    std::atomic<uint64_t> decompress_ns {0};
+
+    void print() const {
+        size_t lookups = hits + misses;
+        printf("# Block cache: %lu hits, %lu misses (%.1f %% hit rate), %lu evictions\n",
+            hits.load(), misses.load(), lookups ? hits * 100.0 / lookups : 0.0, evictions.load());
+        printf("# Block cache: read %lu bytes in %.3f s, decoded %lu bytes in %.3f s\n",
+            bytes_read.load(), read_ns / 1e9, bytes_decoded.load(), decompress_ns / 1e9);
+    }
+};
+
+// Thread-safe cache of decoded blocks. Blocks are spread over independently locked shards,
+// and decoding happens outside of any lock, so independent lookups decode in parallel.
+// If two threads want the same missing block at the same time, only one of them decodes it.
+// Each shard gets an equal part of the byte budget and evicts with the CLOCK algorithm.
+// Evicted blocks stay alive for as long as someone still holds a BlockPtr to them.
+class ShardedBlockCache {
+public:
+    using BlockPtr = std::shared_ptr<osmium::memory::Buffer const>;
+
+    explicit ShardedBlockCache(size_t budget_bytes = DEFAULT_BLOCK_CACHE_BUDGET_BYTES, size_t num_shards = DEFAULT_BLOCK_CACHE_SHARDS)
+        : m_shards(num_shards)
+        , m_shard_budget_bytes(budget_bytes / num_shards)
+    {
+    }
+    ShardedBlockCache(const ShardedBlockCache&) = delete;
+    ShardedBlockCache(ShardedBlockCache&&) = delete;
+    ShardedBlockCache& operator=(const ShardedBlockCache&) = delete;
+    ShardedBlockCache& operator=(ShardedBlockCache&&) = delete;
+
+    // Returns the cached block, or nullptr if it is not (yet) cached. Never decodes anything.
+    BlockPtr find(size_t block_index) {
+        std::shared_future<BlockPtr> pending;
+        {
+            Shard& shard = shard_for(block_index);
+            std::lock_guard<std::mutex> lock {shard.mutex};
+            auto it = shard.entries.find(block_index);
+            if (it == shard.entries.end()) {
+                return nullptr;
+            }
+            it->second.referenced = true;
+            pending = it->second.block;
+        }
+        m_stats.hits += 1;
+        return pending.get();
+    }
+
+    // Returns the cached block, calling decode() to create it if necessary.
+    BlockPtr get_or_decode(size_t block_index, std::function<osmium::memory::Buffer()> const& decode) {
+        std::promise<BlockPtr> promise;
+        std::shared_future<BlockPtr> pending;
+        Shard& shard = shard_for(block_index);
+        {
+            std::lock_guard<std::mutex> lock {shard.mutex};
+            auto it = shard.entries.find(block_index);
+            if (it != shard.entries.end()) {
+                it->second.referenced = true;
+                pending = it->second.block;
+            } else {
+                shard.entries.emplace(block_index, Entry{promise.get_future().share()});
+            }
+        }
+        if (pending.valid()) {
+            // Either cached, or someone else is already decoding it.
+            m_stats.hits += 1;
+            return pending.get();
+        }
+        m_stats.misses += 1;
+        BlockPtr block;
+        try {
+            block = std::make_shared<osmium::memory::Buffer const>(decode());
+        } catch (...) {
+            // Don't leave a broken entry behind; waiting threads get the same exception.
+            promise.set_exception(std::current_exception());
+            std::lock_guard<std::mutex> lock {shard.mutex};
+            shard.entries.erase(block_index);
+            throw;
+        }
+        promise.set_value(block);
+        {
+            std::lock_guard<std::mutex> lock {shard.mutex};
+            Entry& entry = shard.entries.at(block_index);
+            entry.bytes = block->capacity();
+            entry.referenced = true;
+            shard.used_bytes += entry.bytes;
+            shard.clock.push_back(block_index);
+            evict_over_budget(shard, block_index);
+        }
+        return block;
+    }
+
+    BlockCacheStats& stats() {
+        return m_stats;
+    }
+
+    size_t size() {
+        size_t total = 0;
+        for (Shard& shard : m_shards) {
+            std::lock_guard<std::mutex> lock {shard.mutex};
+            total += shard.entries.size();
+        }
+        return total;
+    }
+
+    size_t used_bytes() {
+        size_t total = 0;
+        for (Shard& shard : m_shards) {
+            std::lock_guard<std::mutex> lock {shard.mutex};
+            total += shard.used_bytes;
+        }
+        return total;
+    }
+
+private:
+    struct Entry {
+        std::shared_future<BlockPtr> block;
+        // Zero while the block is still being decoded. Those entries are not in the clock yet.
+        size_t bytes {0};
+        bool referenced {false};
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<size_t, Entry> entries;
+        // The decoded entries, in clock order.
+        std::vector<size_t> clock;
+        size_t hand {0};
+        size_t used_bytes {0};
+    };
+
+    Shard& shard_for(size_t block_index) {
+        // Neighbouring blocks are often wanted at the same time, so make sure they end up in different shards.
+        return m_shards[block_index % m_shards.size()];
+    }
+
+    // Must be called with the shard's mutex held. Never evicts the block that was just inserted,
+    // so a single block that exceeds the whole budget still works (it's just evicted next time).
+    void evict_over_budget(Shard& shard, size_t keep_block_index) {
+        // Two full rounds are enough: The first one clears all reference bits.
+        size_t steps_left = 2 * shard.clock.size();
+        while (shard.used_bytes > m_shard_budget_bytes && shard.clock.size() > 1 && steps_left-- > 0) {
+            if (shard.hand >= shard.clock.size()) {
+                shard.hand = 0;
+            }
+            size_t candidate = shard.clock[shard.hand];
+            Entry& entry = shard.entries.at(candidate);
+            if (entry.referenced || candidate == keep_block_index) {
+                entry.referenced = false;
+                shard.hand += 1;
+                continue;
+            }
+            shard.used_bytes -= entry.bytes;
+            shard.entries.erase(candidate);
+            shard.clock[shard.hand] = shard.clock.back();
+            shard.clock.pop_back();
+            m_stats.evictions += 1;
+        }
+    }
+
+    std::vector<Shard> m_shards;
+    size_t m_shard_budget_bytes;
+    BlockCacheStats m_stats;
+};
+
+// Measures the wall time of a scope into one of the nanosecond counters.
+class ScopedNanoTimer {
+public:
+    explicit ScopedNanoTimer(std::atomic<uint64_t>& counter)
+        : m_counter(counter)
+        , m_start(std::chrono::steady_clock::now())
+    {
+    }
+    ScopedNanoTimer(const ScopedNanoTimer&) = delete;
+    ScopedNanoTimer(ScopedNanoTimer&&) = delete;
+    ScopedNanoTimer& operator=(const ScopedNanoTimer&) = delete;
+    ScopedNanoTimer& operator=(ScopedNanoTimer&&) = delete;
+
+    ~ScopedNanoTimer() {
+        m_counter += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    std::atomic<uint64_t>& m_counter;
+    std::chrono::steady_clock::time_point m_start;
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "pbf_block_index.hpp"
+
+// Rough numbers for an NVMe SSD and a current CPU. Run the benchmark target and adjust them if the planner
+// picks the slower engine on your machine; only their ratios matter.
+static const double SEQUENTIAL_READ_BYTES_PER_SECOND = 2e9;
+static const double RANDOM_READ_SECONDS = 150e-6;
+// Compressed bytes per second and thread. Building osmium objects is much slower than just digging out
+// a few locations.
+static const double FULL_DECODE_BYTES_PER_SECOND = 60e6;
+static const double DECOMPRESS_BYTES_PER_SECOND = 250e6;
+// Coalesced reads are held in memory by one worker each, so don't let them grow without bound.
+static const uint64_t MAX_COALESCED_READ_BYTES = uint64_t{64} << 20;
+
+// One sequential read that covers the blocks [first_block, last_block], of which only needed_blocks get decoded.
+struct BlockRead {
+    size_t first_block;
+    size_t last_block;
+    std::vector<size_t> needed_blocks;
+};
+
+struct CostEstimate {
+    size_t reads {0};
+    size_t blocks_decoded {0};
+    uint64_t bytes_read {0};
+    double io_seconds {0};
+    double cpu_seconds {0};
+
+    // Reading and decoding overlap, so whichever is slower dominates.
+    double seconds() const {
+        return std::max(io_seconds, cpu_seconds);
+    }
+
+    void print(const char* name) const {
+        printf("# Plan %-7s: %8lu reads, %8lu blocks decoded, %12lu bytes read, io %8.2f s, cpu %8.2f s => %8.2f s\n",
+            name, reads, blocks_decoded, bytes_read, io_seconds, cpu_seconds, seconds());
+    }
+};
+
+// Decides how to fetch a set of blocks, and what that would cost compared to just scanning through them.
+class BlockReadPlanner {
+public:
+    BlockReadPlanner(PbfBlockIndex const& index, size_t num_threads)
+        : m_index(index)
+        , m_num_threads(num_threads ? num_threads : std::max(1U, std::thread::hardware_concurrency()))
+    {
+    }
+
+    // needed_blocks must be sorted and distinct. Without coalescing, every block is its own read. With coalescing,
+    // neighbouring blocks are merged into one read whenever reading through the gap is cheaper than another seek,
+    // so dense regions are effectively scanned and sparse ones are looked up.
+    std::vector<BlockRead> plan(std::vector<size_t> const& needed_blocks, bool coalesce) const {
+        std::vector<BlockRead> reads;
+        for (size_t block_index : needed_blocks) {
+            if (coalesce && !reads.empty()) {
+                BlockRead& current = reads.back();
+                BlockMeta const& previous = m_index.block(current.last_block);
+                BlockMeta const& next = m_index.block(block_index);
+                uint64_t gap_bytes = next.file_offset - (previous.file_offset + previous.datasize);
+                uint64_t extended_bytes = next.file_offset + next.datasize - m_index.block(current.first_block).file_offset;
+                if (gap_bytes / SEQUENTIAL_READ_BYTES_PER_SECOND < RANDOM_READ_SECONDS && extended_bytes <= MAX_COALESCED_READ_BYTES) {
+                    current.last_block = block_index;
+                    current.needed_blocks.push_back(block_index);
+                    continue;
+                }
+            }
+            reads.push_back(BlockRead{block_index, block_index, {block_index}});
+        }
+        return reads;
+    }
+
+    CostEstimate estimate(std::vector<BlockRead> const& reads) const {
+        CostEstimate cost;
+        uint64_t decoded_bytes = 0;
+        for (BlockRead const& read : reads) {
+            cost.reads += 1;
+            cost.bytes_read += range_bytes(read.first_block, read.last_block);
+            for (size_t block_index : read.needed_blocks) {
+                cost.blocks_decoded += 1;
+                decoded_bytes += m_index.block(block_index).datasize;
+            }
+        }
+        cost.io_seconds = cost.reads * RANDOM_READ_SECONDS + cost.bytes_read / SEQUENTIAL_READ_BYTES_PER_SECOND;
+        cost.cpu_seconds = decoded_bytes / DECOMPRESS_BYTES_PER_SECOND / m_num_threads;
+        return cost;
+    }
+
+    // What apply_blocks_counted() over the given blocks (sorted and distinct) costs: It reads each of them on its own,
+    // in file order, and builds osmium objects for all of them. A block that directly follows the previous one
+    // doesn't need another seek.
+    CostEstimate estimate_block_scan(std::vector<size_t> const& blocks) const {
+        CostEstimate cost;
+        double cpu_seconds_single = 0;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            BlockMeta const& meta = m_index.block(blocks[i]);
+            if (i == 0 || blocks[i] != blocks[i - 1] + 1) {
+                cost.reads += 1;
+            }
+            cost.bytes_read += meta.datasize;
+            cost.blocks_decoded += 1;
+            cpu_seconds_single += meta.datasize / FULL_DECODE_BYTES_PER_SECOND;
+        }
+        cost.io_seconds = cost.reads * RANDOM_READ_SECONDS + cost.bytes_read / SEQUENTIAL_READ_BYTES_PER_SECOND;
+        cost.cpu_seconds = cpu_seconds_single / m_num_threads;
+        return cost;
+    }
+
+    size_t num_threads() const {
+        return m_num_threads;
+    }
+
+private:
+    uint64_t range_bytes(size_t first_block, size_t last_block) const {
+        BlockMeta const& last = m_index.block(last_block);
+        return last.file_offset + last.datasize - m_index.block(first_block).file_offset;
+    }
+
+    PbfBlockIndex const& m_index;
+    size_t m_num_threads;
+};
@@ -0,0 +1,26 @@
+#include <cstdio>
+
+#include <osmium/io/pbf_input.hpp>
+
+#include "node_location_store.hpp"
+#include "pbf_block_index.hpp"
+
+// Builds (or just checks) the node location store next to a PBF file, so that the tools that
+// use it don't have to pay for the node pass themselves. Run once per snapshot:
+//     ./build_node_location_store [INPUT_FILENAME]
+
+static const char* const INPUT_FILENAME = "/scratch/osm/planet-231002.osm.pbf";
+
+int main(int argc, char** argv) {
+    if (argc > 2) {
+        printf("Usage: %s [INPUT_FILENAME]\n", argv[0]);
+        return 1;
+    }
+    const char* input_filename = argc > 1 ? argv[1] : INPUT_FILENAME;
+    printf("# Running on %s …\n", input_filename);
+    PbfBlockIndex index {input_filename};
+    printf("# File has %lu blocks%s.\n", index.size(), index.loaded_from_sidecar() ? " (index loaded from sidecar)" : "");
+    NodeLocationStore store {index};
+    printf("# Store has %lu node locations in %lu bytes%s.\n", store.node_count(), store.file_size(), store.loaded_existing() ? " (was already up to date)" : "");
+    return 0;
+}
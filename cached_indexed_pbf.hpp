@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/node.hpp>
+
+#include "block_cache.hpp"
+#include "pbf_block_index.hpp"
+
+struct ObjectRequest {
+    osmium::item_type type;
+    osmium::object_id_type id;
+};
+
+// Random access to individual objects, keeping every decoded block around.
+// This is the counterpart to osmium::io::CachedRandomAccessPbf, but sits on top of the
+// PbfBlockIndex, so it never has to scan the file or bisect by decoding blocks.
+// All lookups may be called concurrently from any number of threads.
+class CachedIndexedPbf {
+public:
+    explicit CachedIndexedPbf(PbfBlockIndex const& index, size_t cache_budget_bytes = DEFAULT_BLOCK_CACHE_BUDGET_BYTES)
+        : m_index(index)
+        , m_cache(cache_budget_bytes)
+    {
+    }
+    CachedIndexedPbf(const CachedIndexedPbf&) = delete;
+    CachedIndexedPbf(CachedIndexedPbf&&) = delete;
+    CachedIndexedPbf& operator=(const CachedIndexedPbf&) = delete;
+    CachedIndexedPbf& operator=(CachedIndexedPbf&&) = delete;
+
+    // Calls the callback with the object, if it exists. Otherwise, the callback is not called at all.
+    template <typename TCallback>
+    void visit_object(osmium::item_type type, osmium::object_id_type id, TCallback&& callback) {
+        size_t block_index = m_index.find_block(type, id);
+        if (block_index == m_index.size()) {
+            return;
+        }
+        ShardedBlockCache::BlockPtr block = get_block(block_index);
+        osmium::memory::Buffer const& buffer = *block;
+        for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+            if (object_key_less(type, id, it->type(), it->id())) {
+                // Objects are sorted, so we're already behind where the needle would have been.
+                return;
+            }
+            if (it->type() == type && it->id() == id) {
+                callback(static_cast<osmium::OSMObject const&>(*it));
+                return;
+            }
+        }
+    }
+
+    template <typename TCallback>
+    void visit_node(osmium::object_id_type id, TCallback&& callback) {
+        visit_object(osmium::item_type::node, id, [&callback](osmium::OSMObject const& object){
+            callback(static_cast<osmium::Node const&>(object));
+        });
+    }
+
+    // Resolves many objects at once: Requests are grouped by block, and the blocks are visited in file order,
+    // so each block is decoded at most once and the reads are mostly sequential. Afterwards, the callback is
+    // called as callback(request_index, object) in request order, but only for the objects that exist.
+    // Blocks that are not in the cache yet are not added to it, so a huge batch doesn't evict everything else.
+    // Objects in cached blocks are handed out right from the cached buffers, which stay pinned until the end.
+    // Objects in blocks that were decoded just for this batch are copied, so that those blocks can go right away.
+    template <typename TCallback>
+    void visit_objects(std::vector<ObjectRequest> const& requests, TCallback&& callback) {
+        std::vector<std::pair<size_t, size_t>> block_and_request;
+        block_and_request.reserve(requests.size());
+        for (size_t request_index = 0; request_index < requests.size(); ++request_index) {
+            ObjectRequest const& request = requests[request_index];
+            size_t block_index = m_index.find_block(request.type, request.id);
+            if (block_index != m_index.size()) {
+                block_and_request.emplace_back(block_index, request_index);
+            }
+        }
+        std::sort(block_and_request.begin(), block_and_request.end(), [&requests](auto const& lhs, auto const& rhs){
+            if (lhs.first != rhs.first) {
+                return lhs.first < rhs.first;
+            }
+            return object_key_less(requests[lhs.second].type, requests[lhs.second].id, requests[rhs.second].type, requests[rhs.second].id);
+        });
+
+        static const size_t NOT_FOUND = static_cast<size_t>(-1);
+        // Keeps the cached blocks alive even if they get evicted in the meantime.
+        std::vector<ShardedBlockCache::BlockPtr> pinned;
+        std::vector<osmium::OSMObject const*> found_in_cache(requests.size(), nullptr);
+        // Offsets, because the buffer may move when it grows.
+        std::vector<size_t> copied_offsets(requests.size(), NOT_FOUND);
+        osmium::memory::Buffer copied {1024 * 1024};
+        auto group_begin = block_and_request.begin();
+        while (group_begin != block_and_request.end()) {
+            size_t block_index = group_begin->first;
+            auto group_end = std::find_if(group_begin, block_and_request.end(), [block_index](auto const& entry){
+                return entry.first != block_index;
+            });
+            osmium::memory::Buffer decoded;
+            ShardedBlockCache::BlockPtr cached = m_cache.find(block_index);
+            if (!cached) {
+                m_cache.stats().misses += 1;
+                decoded = decode_block(block_index);
+            }
+            osmium::memory::Buffer const& buffer = cached ? *cached : decoded;
+            bool pin = false;
+            // Both the block and the group are sorted, so merge them.
+            auto it = buffer.begin<osmium::OSMObject>();
+            for (auto entry = group_begin; entry != group_end; ++entry) {
+                ObjectRequest const& request = requests[entry->second];
+                while (it != buffer.end<osmium::OSMObject>() && object_key_less(it->type(), it->id(), request.type, request.id)) {
+                    ++it;
+                }
+                if (it == buffer.end<osmium::OSMObject>()) {
+                    break;
+                }
+                if (it->type() == request.type && it->id() == request.id) {
+                    if (cached) {
+                        found_in_cache[entry->second] = &*it;
+                        pin = true;
+                    } else {
+                        copied_offsets[entry->second] = copied.committed();
+                        copied.add_item(*it);
+                        copied.commit();
+                    }
+                }
+            }
+            if (pin) {
+                pinned.push_back(std::move(cached));
+            }
+            group_begin = group_end;
+        }
+
+        for (size_t request_index = 0; request_index < requests.size(); ++request_index) {
+            if (found_in_cache[request_index]) {
+                callback(request_index, *found_in_cache[request_index]);
+            } else if (copied_offsets[request_index] != NOT_FOUND) {
+                callback(request_index, static_cast<osmium::OSMObject const&>(copied.get<osmium::OSMObject>(copied_offsets[request_index])));
+            }
+        }
+    }
+
+    size_t decoded_blocks() const {
+        return m_decoded_blocks;
+    }
+
+    BlockCacheStats const& stats() {
+        return m_cache.stats();
+    }
+
+    void print_stats() {
+        printf("# Decoded %lu blocks, cache holds %lu blocks in %lu bytes\n", decoded_blocks(), m_cache.size(), m_cache.used_bytes());
+        printf("# %lu lookups were answered by the Bloom filters alone\n", m_index.bloom_rejections());
+        m_cache.stats().print();
+    }
+
+private:
+    osmium::memory::Buffer decode_block(size_t block_index) {
+        BlockCacheStats& stats = m_cache.stats();
+        m_decoded_blocks += 1;
+        std::string blob;
+        {
+            ScopedNanoTimer timer {stats.read_ns};
+            blob = m_index.read_blob(block_index);
+        }
+        stats.bytes_read += blob.size();
+        osmium::memory::Buffer buffer;
+        {
+            ScopedNanoTimer timer {stats.decompress_ns};
+            buffer = PbfBlockIndex::decode_blob(blob, osmium::osm_entity_bits::all, osmium::io::read_meta::no);
+        }
+        stats.bytes_decoded += buffer.capacity();
+        return buffer;
+    }
+
+    ShardedBlockCache::BlockPtr get_block(size_t block_index) {
+        return m_cache.get_or_decode(block_index, [this, block_index](){
+            return decode_block(block_index);
+        });
+    }
+
+    PbfBlockIndex const& m_index;
+    ShardedBlockCache m_cache;
+    std::atomic<size_t> m_decoded_blocks {0};
+};
@@ -1,25 +1,79 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
-#include <map>
-#include <set>
+#include <filesystem>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
-#include <boost/range/adaptor/reversed.hpp>
-
 #include <osmium/io/pbf_input.hpp>
 #include <osmium/handler.hpp>
 #include <osmium/visitor.hpp>
 #include <osmium/relations/relations_manager.hpp>
+#include <protozero/pbf_builder.hpp>
+#include <protozero/varint.hpp>
 
+#include "extract_benchmark.hpp"
+#include "flat_id_store.hpp"
+#include "line_simplification.hpp"
+#include "node_location_store.hpp"
+#include "output_buffer.hpp"
+#include "parallel_for.hpp"
+#include "pbf_block_index.hpp"
+#include "polygon_clipping.hpp"
 #include "relation_list.hpp"
+#include "selection.hpp"
+
+// Read relations, then their ways, then their nodes straight from the full extract, in three passes that only decode
+// the blocks that can contain anything wanted. Otherwise, the input must already contain only the relevant objects,
+// see 'osmium getid' in COMMANDS.txt.
+static const bool DIRECT_PASSES = true;
+// Only with DIRECT_PASSES, and opt-in: StoreIfPresent or Store take the node locations from the flat store next to
+// the input (see build_node_location_store) instead of the third pass.
+static const NodeLocationSource NODE_LOCATIONS = NodeLocationSource::Pbf;
 
-static const char* const INPUT_FILENAME = "/scratch/osm/relevant_europe-latest.osm.pbf";
+static const char* const INPUT_FILENAME = "/scratch/osm/europe-latest.osm.pbf";
+//static const char* const INPUT_FILENAME = "/scratch/osm/planet-231002.osm.pbf";
+// Only with DIRECT_PASSES = false:
+//static const char* const INPUT_FILENAME = "/scratch/osm/relevant_europe-latest.osm.pbf";
 //static const char* const INPUT_FILENAME = "/scratch/osm/relevant_planet-231002.osm.pbf";
 
 //static const char* const OUTPUT_FILENAME = "/scratch/osm/laendergrenzen.svg";
 static const char* const OUTPUT_FILENAME = "/scratch/osm/laendergrenzen.geo.json";
+// Appends ".gz" to OUTPUT_FILENAME (and TOPOLOGY_OUTPUT_FILENAME).
+static const bool GZIP_OUTPUT = false;
+// Write TopoJSON to TOPOLOGY_OUTPUT_FILENAME instead: The rings only refer to arcs, which are chains of ways between
+// the points where borders meet, so each border is located, simplified and written once, no matter how many relations
+// share it. That roughly halves the output, and neighbours can't drift apart when simplifying.
+static const bool TOPOLOGY_OUTPUT = false;
+static const char* const TOPOLOGY_OUTPUT_FILENAME = "/scratch/osm/laendergrenzen.topo.json";
+// Or cut everything into Mapbox Vector Tiles, as TILE_DIRECTORY/<z>/<x>/<y>.mvt, for the web mercator zoom levels
+// TILE_MIN_ZOOM to TILE_MAX_ZOOM (which have nothing to do with ZOOM_LEVELS), so that a frontend only loads what it
+// shows. Each tile gets the rings clipped to it plus TILE_BUFFER, simplified by TILE_SIMPLIFY_TOLERANCE, and
+// quantized to TILE_EXTENT, all in tile units.
+static const bool TILE_OUTPUT = false;
+static const char* const TILE_DIRECTORY = "/scratch/osm/laendergrenzen_tiles";
+static const int TILE_MIN_ZOOM = 0;
+static const int TILE_MAX_ZOOM = 10;
+static const uint32_t TILE_EXTENT = 4096;
+static const uint32_t TILE_BUFFER = 64;
+static const double TILE_SIMPLIFY_TOLERANCE = 1.0;
+// Simplify with Douglas-Peucker, measured in the pixels of the SVG projection, once for all zoom levels. Level z keeps
+// the points that are more than SIMPLIFY_TOLERANCE_PX / 2^z pixels off, and gets its own output, with "_z<level>"
+// added to the name. Every way is simplified on its own and in its own node order, so a border that two relations
+// share comes out identical on both sides. Level -1 writes every point, just like without simplification.
+static const int ZOOM_LEVELS[] = {-1};
+static const double SIMPLIFY_TOLERANCE_PX = 0.5;
 // Achieve compatibility with … a thing:
 // ORIGIN	45.88919, 4.96126
 // X0 Y130	55.67336, 4.96126
@@ -30,9 +84,16 @@ static const double MAX_LONG_DEG = 18.02294;
 static const double MIN_LAT_DEG = 45.88919;
 static const double MAX_LAT_DEG = 55.67336;
 static const double PX_PER_LONG_DEG = 99.52777896870847;
+// Clip every ring to the area above, plus the margin, so that nothing off-canvas gets projected and written.
+// Rings that lie outside entirely are already dropped after assembly, using their bbox. The topology output
+// only does the latter, since clipping would cut its shared arcs apart.
+static const bool CLIP_TO_VIEWPORT = false;
+static const double CLIP_MARGIN_PX = 10.0;
 // 0.5 is reasonable. Set to -1.0 to disable (0.0 should probably also work).
 static const double PX_PAINT_TRESHOLD_SQUARED = 0.81;
 static const bool VERBOSE_SVG = false;
+// Threads for assembling and rendering the relations, 0 means one per core.
+static const size_t ASSEMBLY_THREADS = 0;
 
 // v3.y = sin(latitude);
 // v3.x = cos(latitude) * sin(longitude);
@@ -51,6 +112,8 @@ static const double HEIGHT = (MAX_LAT_DEG - MIN_LAT_DEG) * PX_PER_LAT_DEG;
 
 static_assert(sizeof(osmium::Location) == 8);
 static_assert(sizeof(osmium::object_id_type) == 8);
+// See TileWriter::tile_key().
+static_assert(TILE_MAX_ZOOM <= 29);
 
 static osmium::object_id_type abs_id(osmium::object_id_type id) {
     assert(id != 0);
@@ -62,43 +125,49 @@ static osmium::object_id_type abs_id(osmium::object_id_type id) {
 }
 
 
+// Everything is stored flat and sorted by ID (see flat_id_store.hpp), which the PBF order gives us for free.
+// Only the end nodes arrive out of order, so call finish() once everything was read.
 class ExtractRelevantHandler : public osmium::handler::Handler {
 public:
     void node(const osmium::Node& node) {
-        assert(node_to_location.find(node.id()) == node_to_location.end());
-        node_to_location.insert({node.id(), node.location()});
+        node_to_location.append(node.id(), node.location());
     }
 
     void way(const osmium::Way& way) {
-        assert(way_to_nodes.find(way.id()) == way_to_nodes.end());
-        std::vector<osmium::object_id_type> node_ids;
+        way_to_nodes.begin_list(way.id());
         for (auto& node_ref : way.nodes()) {
-            node_ids.push_back(node_ref.ref());
+            way_to_nodes.add_item(node_ref.ref());
         }
-        way_to_nodes.insert({way.id(), node_ids});
         assert(way.id() > 0);
-        end_node_to_incident_ways.insert({node_ids.front(), way.id()});
-        end_node_to_incident_ways.insert({node_ids.back(), -way.id()});
+        end_node_to_incident_ways.append(way.nodes().front().ref(), way.id());
+        end_node_to_incident_ways.append(way.nodes().back().ref(), -way.id());
     }
 
     void relation(const osmium::Relation& relation) {
-        assert(relation_to_ways.find(relation.id()) == relation_to_ways.end());
         if (!is_relevant_relation(relation.id())) {
             this->discarded += 1;
             return;
         }
-        std::vector<osmium::object_id_type> way_ids;
+        relation_to_ways.begin_list(relation.id());
+        relation_to_inner_ways.begin_list(relation.id());
         for (auto& item_ref : relation.members()) {
             if (item_ref.type() == osmium::item_type::way) {
-                way_ids.push_back(item_ref.ref());
+                relation_to_ways.add_item(item_ref.ref());
+                if (strcmp(item_ref.role(), "inner") == 0) {
+                    relation_to_inner_ways.add_item(item_ref.ref());
+                }
             }
         }
-        relation_to_ways.insert({relation.id(), way_ids});
+    }
+
+    void finish() {
+        node_to_location.sort();
+        end_node_to_incident_ways.sort();
     }
 
     void check() const {
         for (auto const& entry : end_node_to_incident_ways) {
-            auto const& way_nodes = way_to_nodes.at(abs_id(entry.second));
+            auto way_nodes = way_to_nodes.at(abs_id(entry.second));
             if (entry.second < 0) {
                 assert(entry.first == way_nodes.back());
             } else {
@@ -110,7 +179,7 @@ public:
     osmium::Box compute_bbox(std::vector<osmium::object_id_type> const& consecutive_ways) const {
         osmium::Box bbox;
         for (auto signed_way_id : consecutive_ways) {
-            auto const& way_nodes = way_to_nodes.at(abs_id(signed_way_id));
+            auto way_nodes = way_to_nodes.at(abs_id(signed_way_id));
             for (auto node_id : way_nodes) {
                 bbox.extend(node_to_location.at(node_id));
             }
@@ -119,21 +188,36 @@ public:
     }
 
     size_t discarded = 0;
-    std::map<osmium::object_id_type, osmium::Location> node_to_location;
-    std::map<osmium::object_id_type, std::vector<osmium::object_id_type>> way_to_nodes;
-    std::map<osmium::object_id_type, std::vector<osmium::object_id_type>> relation_to_ways;
-    std::multimap<osmium::object_id_type, osmium::object_id_type> end_node_to_incident_ways;
+    FlatIdMap<osmium::Location> node_to_location;
+    FlatIdLists way_to_nodes;
+    // Only the way members.
+    FlatIdLists relation_to_ways;
+    // Only the ones with role "inner". SVG and GeoJSON fill even-odd anyway, but vector tiles need to know.
+    FlatIdLists relation_to_inner_ways;
+    // Positive way IDs for ways that start at the node, negative ones for ways that end there.
+    FlatIdMap<osmium::object_id_type> end_node_to_incident_ways;
 };
 
+// How many locations a writer painted, and how many it could leave out.
+struct PaintStats {
+    size_t painted {0};
+    size_t skipped_painting {0};
+
+    void add(PaintStats const& other) {
+        painted += other.painted;
+        skipped_painting += other.skipped_painting;
+    }
+};
+
+// Both writers render each relation separately into a TextBuffer, which touches nothing but the buffer and the
+// stats, so that PolyFeeder can render many relations in parallel. write_rendered() then writes them in order.
 class SvgWriter {
 public:
-    explicit SvgWriter(const char* const output_filename)
+    SvgWriter(std::string const& output_filename, bool gzip)
+        : m_out(output_filename, gzip)
     {
-        // Note: iostream supports RAII, but it seems a better idea to use fprintf than streaming I/O.
-        m_file = fopen(output_filename, "w");
-        assert(m_file);
-        fprintf(m_file, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%f\" height=\"%f\">\n", WIDTH, HEIGHT);
-        fprintf(m_file, " <rect width=\"%f\" height=\"%f\" style=\"fill:rgb(245,245,245)\"/>\n", WIDTH, HEIGHT);
+        m_out.write_format("<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%f\" height=\"%f\">\n", WIDTH, HEIGHT);
+        m_out.write_format(" <rect width=\"%f\" height=\"%f\" style=\"fill:rgb(245,245,245)\"/>\n", WIDTH, HEIGHT);
     }
     SvgWriter(const SvgWriter&) = delete;
     SvgWriter(SvgWriter&&) = delete;
@@ -141,111 +225,129 @@ public:
     SvgWriter& operator=(SvgWriter&&) = delete;
 
     ~SvgWriter() {
-        fputs("</svg>\n", m_file);
-        fclose(m_file);
-        m_file = nullptr;
+        // The file itself is closed by m_out.
+        m_out.write("</svg>\n");
     }
 
-    void write_rings(std::vector<std::vector<osmium::Location>> const& rings, osmium::object_id_type relation_id, osmium::object_id_type some_way_id) {
+    static void render_relation(TextBuffer& out, PaintStats& stats, std::vector<std::vector<osmium::Location>> const& rings, osmium::object_id_type relation_id, osmium::object_id_type some_way_id) {
         if (VERBOSE_SVG) {
-            fprintf(m_file, " <path id=\"relation_%ld_with_%lu_rings\"", relation_id, rings.size());
-            fprintf(m_file, " comment=\"w%lu...\"", some_way_id);
+            out.write_format(" <path id=\"relation_%ld_with_%lu_rings\"", relation_id, rings.size());
+            out.write_format(" comment=\"w%lu...\"", some_way_id);
         } else {
-            fprintf(m_file, " <path");
+            out.write(" <path");
         }
-        fprintf(m_file, " stroke=\"rgb(245,245,245)\"");
+        out.write(" stroke=\"rgb(245,245,245)\"");
         if (is_thick_stroke_relation(relation_id)) {
-            fprintf(m_file, " stroke-width=\"5\"");
-            fprintf(m_file, " fill=\"none\"");
+            out.write(" stroke-width=\"5\"");
+            out.write(" fill=\"none\"");
         } else {
-            fprintf(m_file, " stroke-width=\"1\"");
-            fprintf(m_file, " fill-rule=\"evenodd\"");
-            //fprintf(m_file, " fill=\"rgb(%d,%d,%d)\"", rand() % 256, rand() % 256, rand() % 256);
-            fprintf(m_file, " fill=\"rgb(159,159,159)\"");
+            out.write(" stroke-width=\"1\"");
+            out.write(" fill-rule=\"evenodd\"");
+            //out.write_format(" fill=\"rgb(%d,%d,%d)\"", rand() % 256, rand() % 256, rand() % 256);
+            out.write(" fill=\"rgb(159,159,159)\"");
         }
-        fprintf(m_file, " d=\"");
+        out.write(" d=\"");
+        PathPainter painter {out, stats};
         for (auto const& ring : rings) {
             for (auto location : ring) {
-                this->offer_location(location);
+                painter.offer_location(location);
             }
             // The first and last locations *must* be written (to make extra-sure that loops are closed),
             // but intermediate points may be skipped.
-            this->flush_location();
+            painter.flush_location();
         }
-        fputs("\"/>\n", m_file);
+        out.write("\"/>\n");
+    }
+
+    void write_rendered(std::vector<TextBuffer> const& relations, PaintStats const& stats) {
+        m_out.write_all(relations, "");
+        m_stats.add(stats);
     }
 
     size_t skipped_painting() const {
-        return m_skipped_painting;
+        return m_stats.skipped_painting;
     }
 
     size_t painted() const {
-        return m_painted;
+        return m_stats.painted;
     }
 
 private:
-    void offer_location(osmium::Location const& location) {
-        double x = (location.lon() - MIN_LONG_DEG) * PX_PER_LONG_DEG;
-        double y = (MAX_LAT_DEG - location.lat()) * PX_PER_LAT_DEG;
-
-        // Paint, unless the last painted point is close enough.
-        bool should_update = true;
-        if (m_last_painted_valid) {
-            double dx = x - m_last_painted_x;
-            double dy = y - m_last_painted_y;
-            double dist_sq = dx * dx + dy * dy;
-            should_update = dist_sq >= PX_PAINT_TRESHOLD_SQUARED;
-        }
-
-        if (should_update) {
-            paint_location_now(x, y);
-            m_buffered_x = x;
-            m_buffered_y = y;
+    class PathPainter {
+    public:
+        PathPainter(TextBuffer& out, PaintStats& stats)
+            : m_out(out)
+            , m_stats(stats)
+        {
+        }
+
+        void offer_location(osmium::Location const& location) {
+            double x = (location.lon() - MIN_LONG_DEG) * PX_PER_LONG_DEG;
+            double y = (MAX_LAT_DEG - location.lat()) * PX_PER_LAT_DEG;
+
+            // Paint, unless the last painted point is close enough.
+            bool should_update = true;
+            if (m_last_painted_valid) {
+                double dx = x - m_last_painted_x;
+                double dy = y - m_last_painted_y;
+                double dist_sq = dx * dx + dy * dy;
+                should_update = dist_sq >= PX_PAINT_TRESHOLD_SQUARED;
+            }
+
+            if (should_update) {
+                paint_location_now(x, y);
+                m_buffered_x = x;
+                m_buffered_y = y;
+                m_buffer_needs_painting = false;
+            } else {
+                m_buffered_x = x;
+                m_buffered_y = y;
+                m_buffer_needs_painting = true;
+                m_stats.skipped_painting += 1;
+            }
+        }
+
+        void flush_location() {
+            if (m_buffer_needs_painting) {
+                paint_location_now(m_buffered_x, m_buffered_y);
+                m_stats.skipped_painting -= 1;
+            }
+            m_last_painted_valid = false;
             m_buffer_needs_painting = false;
-        } else {
-            m_buffered_x = x;
-            m_buffered_y = y;
-            m_buffer_needs_painting = true;
-            m_skipped_painting += 1;
         }
-    }
 
-    void flush_location() {
-        if (m_buffer_needs_painting) {
-            paint_location_now(m_buffered_x, m_buffered_y);
-            m_skipped_painting -= 1;
+    private:
+        void paint_location_now(double x, double y) {
+            m_out.write(m_last_painted_valid ? 'L' : 'M');
+            m_out.write_fixed(x, 1);
+            m_out.write(',');
+            m_out.write_fixed(y, 1);
+            m_last_painted_x = x;
+            m_last_painted_y = y;
+            m_last_painted_valid = true;
+            m_stats.painted += 1;
         }
-        m_last_painted_valid = false;
-        m_buffer_needs_painting = false;
-    }
 
-    void paint_location_now(double x, double y) {
-        fprintf(m_file, "%s%.1f,%.1f", m_last_painted_valid ? "L" : "M", x, y);
-        m_last_painted_x = x;
-        m_last_painted_y = y;
-        m_last_painted_valid = true;
-        m_painted += 1;
-    }
+        TextBuffer& m_out;
+        PaintStats& m_stats;
+        double m_last_painted_x;
+        double m_last_painted_y;
+        bool m_last_painted_valid {false};
+        double m_buffered_x;
+        double m_buffered_y;
+        bool m_buffer_needs_painting {false};
+    };
 
-    FILE* m_file;
-    double m_last_painted_x;
-    double m_last_painted_y;
-    bool m_last_painted_valid {false};
-    double m_buffered_x;
-    double m_buffered_y;
-    bool m_buffer_needs_painting {false};
-    size_t m_skipped_painting {0};
-    size_t m_painted {0};
+    OutputBuffer m_out;
+    PaintStats m_stats;
 };
 
 class GeoJsonWriter {
 public:
-    explicit GeoJsonWriter(const char* const output_filename)
+    GeoJsonWriter(std::string const& output_filename, bool gzip)
+        : m_out(output_filename, gzip)
     {
-        // Note: iostream supports RAII, but it seems a better idea to use fprintf than streaming I/O.
-        m_file = fopen(output_filename, "w");
-        assert(m_file);
-        fprintf(m_file, "{\"type\": \"FeatureCollection\", \"features\": [\n");
+        m_out.write("{\"type\": \"FeatureCollection\", \"features\": [\n");
     }
     GeoJsonWriter(const GeoJsonWriter&) = delete;
     GeoJsonWriter(GeoJsonWriter&&) = delete;
@@ -253,32 +355,27 @@ public:
     GeoJsonWriter& operator=(GeoJsonWriter&&) = delete;
 
     ~GeoJsonWriter() {
-        fputs("]}\n", m_file);
-        fclose(m_file);
-        m_file = nullptr;
+        // The file itself is closed by m_out.
+        m_out.write("]}\n");
     }
 
-    void write_rings(std::vector<std::vector<osmium::Location>> const& rings, osmium::object_id_type relation_id, osmium::object_id_type some_way_id) {
-        if (m_first_feature) {
-            m_first_feature = false;
-        } else {
-            fprintf(m_file, ",\n");
-        }
-        fprintf(m_file, "{\"type\":\"Feature\",\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[\n");
+    // One feature, without the separator to the previous one.
+    static void render_relation(TextBuffer& out, PaintStats& stats, std::vector<std::vector<osmium::Location>> const& rings, osmium::object_id_type relation_id, osmium::object_id_type some_way_id) {
+        out.write("{\"type\":\"Feature\",\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[\n");
         bool first_ring = true;
         for (auto const& ring : rings) {
             if (first_ring) {
                 first_ring = false;
-                fprintf(m_file, "  [");
+                out.write("  [");
             } else {
-                fprintf(m_file, " ,[");
+                out.write(" ,[");
             }
             bool first_point_in_ring = true;
             for (auto location : ring) {
                 if (first_point_in_ring) {
                     first_point_in_ring = false;
                 } else {
-                    fprintf(m_file, ",");
+                    out.write(',');
                 }
                 // 180° = 20 000 km
                 // Let's round that to:
@@ -287,12 +384,29 @@ public:
                 // → 0.01° = 1 km
                 // → 0.00001° = 1 m
                 // So we definitely don't need more than 5 decimal digits.
-                fprintf(m_file, "[%.5f,%.5f]", location.lon(), location.lat());
+                out.write('[');
+                out.write_fixed(location.lon(), 5);
+                out.write(',');
+                out.write_fixed(location.lat(), 5);
+                out.write(']');
             }
-            fprintf(m_file, "]\n");
-            m_painted += ring.size();
+            out.write("]\n");
+            stats.painted += ring.size();
         }
-        fprintf(m_file, "]},\"properties\":{\"relation_id\":\"%ld\",\"some_way\":\"%ld\"}}\n", relation_id, some_way_id);
+        out.write_format("]},\"properties\":{\"relation_id\":\"%ld\",\"some_way\":\"%ld\"}}\n", relation_id, some_way_id);
+    }
+
+    void write_rendered(std::vector<TextBuffer> const& relations, PaintStats const& stats) {
+        if (relations.empty()) {
+            return;
+        }
+        if (m_first_feature) {
+            m_first_feature = false;
+        } else {
+            m_out.write(",\n");
+        }
+        m_out.write_all(relations, ",\n");
+        m_stats.add(stats);
     }
 
     size_t skipped_painting() const {
@@ -300,141 +414,1091 @@ public:
     }
 
     size_t painted() const {
-        return m_painted;
+        return m_stats.painted;
     }
 
 private:
-    FILE* m_file;
-    size_t m_painted {0};
+    OutputBuffer m_out;
+    PaintStats m_stats;
     bool m_first_feature {true};
 };
 
 using Consumer = GeoJsonWriter;
 
+// The ways of one relation that aren't part of any ring yet. Sorted by ID, so that checking for a particular way
+// is a binary search and a bit, and the rings start with the lowest remaining way, just like with a std::set.
+class RemainingWays {
+public:
+    explicit RemainingWays(IdSpan ways)
+        : m_way_ids(ways.begin(), ways.end())
+    {
+        std::sort(m_way_ids.begin(), m_way_ids.end());
+        assert(std::adjacent_find(m_way_ids.begin(), m_way_ids.end()) == m_way_ids.end());
+        m_way_ids.erase(std::unique(m_way_ids.begin(), m_way_ids.end()), m_way_ids.end());
+        m_remaining.resize(m_way_ids.size(), true);
+        m_remaining_count = m_way_ids.size();
+    }
+
+    bool empty() const {
+        return m_remaining_count == 0;
+    }
+
+    osmium::object_id_type take_lowest() {
+        assert(!empty());
+        while (!m_remaining[m_lowest]) {
+            ++m_lowest;
+        }
+        m_remaining[m_lowest] = false;
+        m_remaining_count -= 1;
+        return m_way_ids[m_lowest];
+    }
+
+    // Returns false if the way isn't part of the relation, or already used.
+    bool take(osmium::object_id_type way_id) {
+        auto it = std::lower_bound(m_way_ids.begin(), m_way_ids.end(), way_id);
+        if (it == m_way_ids.end() || *it != way_id) {
+            return false;
+        }
+        size_t way_index = it - m_way_ids.begin();
+        if (!m_remaining[way_index]) {
+            return false;
+        }
+        m_remaining[way_index] = false;
+        m_remaining_count -= 1;
+        return true;
+    }
+
+private:
+    std::vector<osmium::object_id_type> m_way_ids;
+    std::vector<bool> m_remaining;
+    size_t m_remaining_count {0};
+    size_t m_lowest {0};
+};
+
+// The viewport, plus CLIP_MARGIN_PX, so that the strokes along the edge of the canvas don't visibly end.
+static ClipRect viewport_clip_rect() {
+    double margin_long_deg = CLIP_MARGIN_PX / PX_PER_LONG_DEG;
+    double margin_lat_deg = CLIP_MARGIN_PX / PX_PER_LAT_DEG;
+    return ClipRect{MIN_LONG_DEG - margin_long_deg, MIN_LAT_DEG - margin_lat_deg, MAX_LONG_DEG + margin_long_deg, MAX_LAT_DEG + margin_lat_deg};
+}
+
+// The rings of the relation, as signed way IDs: Negative ones are walked backwards. Rings that would be smaller than
+// a pixel are left out, and with CLIP_TO_VIEWPORT, so are the ones outside of it.
+static std::vector<std::vector<osmium::object_id_type>> assemble_ring_ways(osmium::object_id_type relation_id, ExtractRelevantHandler const& handler) {
+    RemainingWays remaining_ways {handler.relation_to_ways.at(relation_id)};
+    std::vector<std::vector<osmium::object_id_type>> rings;
+    while (!remaining_ways.empty()) {
+        std::vector<osmium::object_id_type> consecutive_ways;
+        osmium::object_id_type first_node;
+        osmium::object_id_type last_node;
+        {
+            auto way_id = remaining_ways.take_lowest();
+            auto way_nodes = handler.way_to_nodes.at(way_id);
+            first_node = way_nodes.front();
+            last_node = way_nodes.back();
+            consecutive_ways.push_back(way_id);
+        }
+        // Try to find more ways of this relation that connect nicely, unless we formed a loop.
+        // Note: This does not detect all cycles! But I hope this is enough.
+        while (first_node != last_node) {
+            bool found_usable_way = false;
+            auto range = handler.end_node_to_incident_ways.equal_range(last_node);
+            for (auto incident_way_iter = range.first; incident_way_iter != range.second; ++incident_way_iter) {
+                auto incident_way_id = incident_way_iter->second;
+                if (!remaining_ways.take(abs_id(incident_way_id))) {
+                    // The way is incident, yes, but since it's not part of this relation (or already used) we need to skip it.
+                    continue;
+                }
+                // We can use this!
+                found_usable_way = true;
+                consecutive_ways.push_back(incident_way_id);
+                auto way_nodes = handler.way_to_nodes.at(abs_id(incident_way_id));
+                if (incident_way_id > 0) {
+                    assert(last_node == way_nodes.front());
+                    last_node = way_nodes.back();
+                } else {
+                    assert(last_node == way_nodes.back());
+                    last_node = way_nodes.front();
+                }
+                // Because last_node (probably) changed, we have to search from scratch:
+                break;
+            }
+            if (!found_usable_way) {
+                // This is a dead end, we have to stop looking for ways to extend this way.
+                break;
+            }
+            // … otherwise, we could extend the way a little further, so loop again.
+        }
+        if (first_node != last_node) {
+            printf("Cannot close ring in relation %lu involving ways %ld --(%ld)--> … --(%ld)--> %ld!\n",
+                relation_id, first_node, consecutive_ways.front(), consecutive_ways.back(), last_node);
+            exit(1);
+        }
+        // We're done with the current ring!
+        // Check whether it is even visible:
+        auto bbox = handler.compute_bbox(consecutive_ways);
+        double width_px = (bbox.right() - bbox.left()) * PX_PER_LONG_DEG;
+        double height_px = (bbox.top() - bbox.bottom()) * PX_PER_LAT_DEG;
+        if (width_px < 1.0 || height_px < 1.0) {
+            // Skipping this ring entirely!
+            printf("   Skipping ring with %lu ways (e.g. %lu) in relation %lu: bbox is only %f x %f pixels.\n",
+                consecutive_ways.size(), consecutive_ways.front(), relation_id, width_px, height_px);
+            continue;
+        }
+        if (CLIP_TO_VIEWPORT) {
+            ClipRect viewport = viewport_clip_rect();
+            if (bbox.right() < viewport.min_x || bbox.left() > viewport.max_x || bbox.top() < viewport.min_y || bbox.bottom() > viewport.max_y) {
+                // Not worth a message, on a continent there are thousands of them.
+                continue;
+            }
+        }
+        rings.emplace_back(consecutive_ways);
+    }
+    return rings;
+}
+
+// The rings of one relation, ready to be written.
+struct AssembledRelation {
+    std::vector<std::vector<osmium::Location>> rings;
+    // For each location in rings, see douglas_peucker_importance(). Empty if no zoom level simplifies.
+    std::vector<std::vector<float>> importance;
+    osmium::object_id_type some_way_id {0};
+};
+
+static bool any_zoom_level_simplifies() {
+    return std::any_of(std::begin(ZOOM_LEVELS), std::end(ZOOM_LEVELS), [](int level){
+        return level >= 0;
+    });
+}
+
+// In pixels, or negative for no simplification.
+static double zoom_level_tolerance(int level) {
+    return level < 0 ? -1.0 : std::ldexp(SIMPLIFY_TOLERANCE_PX, -level);
+}
+
+// The base filename, with "_z<level>" before the extension, unless there is only one unsimplified output.
+static std::string zoom_level_filename(const char* base_filename, int level) {
+    std::string filename = base_filename;
+    if (level >= 0 || std::size(ZOOM_LEVELS) > 1) {
+        size_t basename_start = filename.rfind('/');
+        size_t extension_start = filename.find('.', basename_start == std::string::npos ? 0 : basename_start);
+        filename.insert(extension_start == std::string::npos ? filename.size() : extension_start, "_z" + std::to_string(level));
+    }
+    if (GZIP_OUTPUT) {
+        filename += ".gz";
+    }
+    return filename;
+}
+
+// Writes every relation to all consumers, one per entry of ZOOM_LEVELS.
 class PolyFeeder {
 public:
-    explicit PolyFeeder(Consumer& consumer)
-        : m_consumer(consumer)
+    explicit PolyFeeder(std::vector<std::unique_ptr<Consumer>>& consumers)
+        : m_consumers(consumers)
     {
+        assert(m_consumers.size() == std::size(ZOOM_LEVELS));
     }
     PolyFeeder(const PolyFeeder&) = delete;
     PolyFeeder(PolyFeeder&&) = delete;
     PolyFeeder& operator=(const PolyFeeder&) = delete;
     PolyFeeder& operator=(PolyFeeder&&) = delete;
 
+    // The handler doesn't change anymore, so the relations can be assembled and rendered independently of each other.
+    // They are written afterwards in list order, so the output doesn't depend on the scheduling.
     void write_relations_from(ExtractRelevantHandler const& handler) {
-        for (auto relation_id : EXPORT_RELATIONS) {
-            this->write_relation_from(relation_id, handler);
-        }
-    }
-
-    void write_relation_from(osmium::object_id_type relation_id, ExtractRelevantHandler const& handler) {
-        std::vector<osmium::object_id_type> const& ways_in_relation = handler.relation_to_ways.at(relation_id);
-        std::set<osmium::object_id_type> remaining_ways{ways_in_relation.begin(), ways_in_relation.end()};
-        assert(remaining_ways.size() == ways_in_relation.size());
-        std::vector<std::vector<osmium::object_id_type>> rings;
-        while (!remaining_ways.empty()) {
-            std::vector<osmium::object_id_type> consecutive_ways;
-            osmium::object_id_type first_node;
-            osmium::object_id_type last_node;
-            {
-                auto way_id = *remaining_ways.begin();
-                remaining_ways.erase(remaining_ways.begin());
-                auto const& way_nodes = handler.way_to_nodes.at(way_id);
-                first_node = way_nodes.front();
-                last_node = way_nodes.back();
-                consecutive_ways.push_back(way_id);
-            }
-            // Try to find more ways of this relation that connect nicely, unless we formed a loop.
-            // Note: This does not detect all cycles! But I hope this is enough.
-            while (first_node != last_node) {
-                bool found_usable_way = false;
-                auto range = handler.end_node_to_incident_ways.equal_range(last_node);
-                for (auto incident_way_iter = range.first; incident_way_iter != range.second; ++incident_way_iter) {
-                    auto incident_way_id = incident_way_iter->second;
-                    auto way_iter = remaining_ways.find(abs_id(incident_way_id));
-                    if (way_iter == remaining_ways.end()) {
-                        // The way is incident, yes, but since it's not part of this relation we need to skip it.
+        size_t relation_count = std::size(EXPORT_RELATIONS);
+        size_t level_count = std::size(ZOOM_LEVELS);
+        std::vector<std::vector<TextBuffer>> rendered(level_count, std::vector<TextBuffer>(relation_count));
+        std::vector<std::vector<PaintStats>> stats(level_count, std::vector<PaintStats>(relation_count));
+        ClipRect viewport = viewport_clip_rect();
+        parallel_for(relation_count, ASSEMBLY_THREADS, [&handler, &rendered, &stats, level_count, &viewport](size_t i){
+            AssembledRelation assembled = assemble_relation(EXPORT_RELATIONS[i], handler);
+            for (size_t level_index = 0; level_index < level_count; ++level_index) {
+                double tolerance = zoom_level_tolerance(ZOOM_LEVELS[level_index]);
+                if (tolerance < 0.0 && !CLIP_TO_VIEWPORT) {
+                    Consumer::render_relation(rendered[level_index][i], stats[level_index][i], assembled.rings, EXPORT_RELATIONS[i], assembled.some_way_id);
+                    continue;
+                }
+                std::vector<std::vector<osmium::Location>> simplified_rings;
+                std::vector<osmium::Location> simplified;
+                for (size_t ring_index = 0; ring_index < assembled.rings.size(); ++ring_index) {
+                    simplify_by_importance(assembled.rings[ring_index], assembled.importance[ring_index], tolerance, simplified);
+                    // Only after simplifying, so that the importance (and thus the shared borders) doesn't depend on the viewport.
+                    // A ring may fall apart into several ones here.
+                    if (CLIP_TO_VIEWPORT) {
+                        clip_ring(simplified, viewport, simplified_rings);
                         continue;
                     }
-                    // We can use this!
-                    found_usable_way = true;
-                    remaining_ways.erase(way_iter);
-                    consecutive_ways.push_back(incident_way_id);
-                    auto const& way_nodes = handler.way_to_nodes.at(abs_id(incident_way_id));
-                    if (incident_way_id > 0) {
-                        assert(last_node == way_nodes.front());
-                        last_node = way_nodes.back();
-                    } else {
-                        assert(last_node == way_nodes.back());
-                        last_node = way_nodes.front();
+                    // Anything less has no area left at this level.
+                    if (simplified.size() >= 4) {
+                        simplified_rings.push_back(simplified);
                     }
-                    // Because last_node (probably) changed, we have to search from scratch:
-                    break;
-                }
-                if (!found_usable_way) {
-                    // This is a dead end, we have to stop looking for ways to extend this way.
-                    break;
                 }
-                // … otherwise, we could extend the way a little further, so loop again.
-            }
-            if (first_node != last_node) {
-                printf("Cannot close ring in relation %lu involving ways %ld --(%ld)--> … --(%ld)--> %ld!\n",
-                    relation_id, first_node, consecutive_ways.front(), consecutive_ways.back(), last_node);
-                exit(1);
-            }
-            // We're done with the current ring!
-            // Check whether it is even visible:
-            auto bbox = handler.compute_bbox(consecutive_ways);
-            double width_px = (bbox.right() - bbox.left()) * PX_PER_LONG_DEG;
-            double height_px = (bbox.top() - bbox.bottom()) * PX_PER_LAT_DEG;
-            if (width_px < 1.0 || height_px < 1.0) {
-                // Skipping this ring entirely!
-                printf("   Skipping ring with %lu ways (e.g. %lu) in relation %lu: bbox is only %f x %f pixels.\n",
-                    consecutive_ways.size(), consecutive_ways.front(), relation_id, width_px, height_px);
-                continue;
+                Consumer::render_relation(rendered[level_index][i], stats[level_index][i], simplified_rings, EXPORT_RELATIONS[i], assembled.some_way_id);
+            }
+        });
+        for (size_t level_index = 0; level_index < level_count; ++level_index) {
+            PaintStats total_stats;
+            for (PaintStats const& relation_stats : stats[level_index]) {
+                total_stats.add(relation_stats);
             }
-            rings.emplace_back(consecutive_ways);
+            m_consumers[level_index]->write_rendered(rendered[level_index], total_stats);
         }
-        this->write_rings_from(relation_id, rings, handler);
     }
 
-    void write_rings_from(osmium::object_id_type relation_id, std::vector<std::vector<osmium::object_id_type>> const& rings_ways, ExtractRelevantHandler const& handler) {
-        std::vector<std::vector<osmium::Location>> rings_locs;
+private:
+    static AssembledRelation assemble_relation(osmium::object_id_type relation_id, ExtractRelevantHandler const& handler) {
+        return locate_rings(assemble_ring_ways(relation_id, handler), handler);
+    }
+
+    static AssembledRelation locate_rings(std::vector<std::vector<osmium::object_id_type>> const& rings_ways, ExtractRelevantHandler const& handler) {
+        AssembledRelation assembled;
+        if (!rings_ways.empty()) {
+            assembled.some_way_id = rings_ways.front().front();
+        }
+        std::vector<std::vector<osmium::Location>>& rings_locs = assembled.rings;
+        bool simplify = any_zoom_level_simplifies();
+        std::vector<osmium::Location> way_locs;
+        std::vector<float> way_importance;
         for (auto const& ring_ways : rings_ways) {
             std::vector<osmium::Location> ring_locs;
+            std::vector<float> ring_importance;
             for (auto signed_way_id : ring_ways) {
-                auto const& way_nodes = handler.way_to_nodes.at(abs_id(signed_way_id));
+                auto way_nodes = handler.way_to_nodes.at(abs_id(signed_way_id));
+                // Always in the way's own order, so the simplification doesn't depend on the direction.
+                way_locs.clear();
+                for (auto& node_id : way_nodes) {
+                    way_locs.push_back(handler.node_to_location.at(node_id));
+                }
+                if (simplify) {
+                    way_importance.resize(way_locs.size());
+                    douglas_peucker_importance(way_locs.data(), way_locs.size(), PX_PER_LONG_DEG, PX_PER_LAT_DEG, way_importance.data());
+                }
                 // Note: On consecutive ways, some nodes are duplicated.
                 // However, this is automatically thrown out by skipping nearby nodes.
                 if (signed_way_id < 0) {
-                    for (auto& node_id : boost::adaptors::reverse(way_nodes)) {
-                        ring_locs.push_back(handler.node_to_location.at(node_id));
+                    ring_locs.insert(ring_locs.end(), way_locs.rbegin(), way_locs.rend());
+                    ring_importance.insert(ring_importance.end(), way_importance.rbegin(), way_importance.rend());
+                } else {
+                    ring_locs.insert(ring_locs.end(), way_locs.begin(), way_locs.end());
+                    ring_importance.insert(ring_importance.end(), way_importance.begin(), way_importance.end());
+                }
+            }
+            rings_locs.push_back(std::move(ring_locs));
+            assembled.importance.push_back(std::move(ring_importance));
+        }
+        return assembled;
+    }
+
+    std::vector<std::unique_ptr<Consumer>>& m_consumers;
+};
+
+// Writes all relations as one TopoJSON topology per entry of ZOOM_LEVELS (see TOPOLOGY_OUTPUT). An arc is a chain of
+// ways that only meet each other: Wherever a third way joins, or the relations on both sides change, a new arc starts.
+// Coordinates are quantized to 1e-5 degrees, which is what GeoJsonWriter writes, too, and delta-encoded.
+class TopologyWriter {
+public:
+    TopologyWriter() = default;
+    TopologyWriter(const TopologyWriter&) = delete;
+    TopologyWriter(TopologyWriter&&) = delete;
+    TopologyWriter& operator=(const TopologyWriter&) = delete;
+    TopologyWriter& operator=(TopologyWriter&&) = delete;
+
+    void write_from(ExtractRelevantHandler const& handler) {
+        size_t relation_count = std::size(EXPORT_RELATIONS);
+        std::vector<std::vector<std::vector<osmium::object_id_type>>> relation_rings(relation_count);
+        parallel_for(relation_count, ASSEMBLY_THREADS, [&handler, &relation_rings](size_t i){
+            relation_rings[i] = assemble_ring_ways(EXPORT_RELATIONS[i], handler);
+        });
+        collect_ways(relation_rings);
+        build_arcs(handler);
+        locate_arcs(handler);
+
+        std::vector<std::vector<std::vector<int64_t>>> relation_arcs(relation_count);
+        for (size_t i = 0; i < relation_count; ++i) {
+            for (auto const& ring : relation_rings[i]) {
+                relation_arcs[i].push_back(ring_arcs(ring, EXPORT_RELATIONS[i]));
+            }
+        }
+        for (int level : ZOOM_LEVELS) {
+            write_level(level, relation_rings, relation_arcs);
+        }
+    }
+
+    size_t way_count() const {
+        return m_way_ids.size();
+    }
+
+    size_t arc_count() const {
+        return m_arc_ways.size();
+    }
+
+    // One entry per zoom level.
+    std::vector<size_t> const& painted() const {
+        return m_painted;
+    }
+
+private:
+    static constexpr size_t NONE = static_cast<size_t>(-1);
+
+    static osmium::object_id_type start_node(ExtractRelevantHandler const& handler, osmium::object_id_type signed_way_id) {
+        auto way_nodes = handler.way_to_nodes.at(abs_id(signed_way_id));
+        return signed_way_id > 0 ? way_nodes.front() : way_nodes.back();
+    }
+
+    static osmium::object_id_type end_node(ExtractRelevantHandler const& handler, osmium::object_id_type signed_way_id) {
+        auto way_nodes = handler.way_to_nodes.at(abs_id(signed_way_id));
+        return signed_way_id > 0 ? way_nodes.back() : way_nodes.front();
+    }
+
+    void collect_ways(std::vector<std::vector<std::vector<osmium::object_id_type>>> const& relation_rings) {
+        for (auto const& rings : relation_rings) {
+            for (auto const& ring : rings) {
+                for (auto signed_way_id : ring) {
+                    m_way_ids.push_back(abs_id(signed_way_id));
+                }
+            }
+        }
+        std::sort(m_way_ids.begin(), m_way_ids.end());
+        m_way_ids.erase(std::unique(m_way_ids.begin(), m_way_ids.end()), m_way_ids.end());
+        // Relations are visited in order, so each list comes out sorted.
+        m_way_relations.resize(m_way_ids.size());
+        for (size_t i = 0; i < relation_rings.size(); ++i) {
+            for (auto const& ring : relation_rings[i]) {
+                for (auto signed_way_id : ring) {
+                    std::vector<size_t>& relations = m_way_relations[way_index(abs_id(signed_way_id))];
+                    if (relations.empty() || relations.back() != i) {
+                        relations.push_back(i);
+                    }
+                }
+            }
+        }
+    }
+
+    // Returns NONE if no ring uses the way.
+    size_t way_index(osmium::object_id_type way_id) const {
+        auto it = std::lower_bound(m_way_ids.begin(), m_way_ids.end(), way_id);
+        if (it == m_way_ids.end() || *it != way_id) {
+            return NONE;
+        }
+        return it - m_way_ids.begin();
+    }
+
+    // The other way at the node, signed like in end_node_to_incident_ways, if the arc of the given way continues there:
+    // Exactly two used ways meet at the node, and they belong to the same relations. Otherwise 0.
+    osmium::object_id_type continuation(ExtractRelevantHandler const& handler, osmium::object_id_type node_id, osmium::object_id_type way_id) const {
+        auto range = handler.end_node_to_incident_ways.equal_range(node_id);
+        size_t used_count = 0;
+        osmium::object_id_type other = 0;
+        for (auto incident_way_iter = range.first; incident_way_iter != range.second; ++incident_way_iter) {
+            if (way_index(abs_id(incident_way_iter->second)) == NONE) {
+                continue;
+            }
+            used_count += 1;
+            if (abs_id(incident_way_iter->second) != way_id) {
+                other = incident_way_iter->second;
+            }
+        }
+        // A closed way has both of its own ends here, and then other stays 0.
+        if (used_count != 2 || other == 0) {
+            return 0;
+        }
+        if (m_way_relations[way_index(way_id)] != m_way_relations[way_index(abs_id(other))]) {
+            return 0;
+        }
+        return other;
+    }
+
+    void build_arcs(ExtractRelevantHandler const& handler) {
+        m_way_arc.assign(m_way_ids.size(), NONE);
+        m_way_reversed_in_arc.assign(m_way_ids.size(), false);
+        for (size_t i = 0; i < m_way_ids.size(); ++i) {
+            if (m_way_arc[i] != NONE) {
+                continue;
+            }
+            // Walk back to where the chain starts. If it's a loop, it simply starts here.
+            osmium::object_id_type first = m_way_ids[i];
+            while (true) {
+                osmium::object_id_type previous = continuation(handler, start_node(handler, first), abs_id(first));
+                if (previous == 0 || abs_id(previous) == m_way_ids[i]) {
+                    break;
+                }
+                // The previous way has to end at our start node, so walk it backwards if it starts there.
+                first = -previous;
+            }
+            size_t arc_index = m_arc_ways.size();
+            m_arc_ways.emplace_back();
+            osmium::object_id_type current = first;
+            do {
+                size_t current_index = way_index(abs_id(current));
+                assert(m_way_arc[current_index] == NONE);
+                m_way_arc[current_index] = arc_index;
+                m_way_reversed_in_arc[current_index] = current < 0;
+                m_arc_ways.back().push_back(current);
+                // The next way has to start at our end node, so walk it backwards if it ends there.
+                current = continuation(handler, end_node(handler, current), abs_id(current));
+            } while (current != 0 && abs_id(current) != abs_id(first));
+        }
+    }
+
+    void locate_arcs(ExtractRelevantHandler const& handler) {
+        m_arc_locations.resize(m_arc_ways.size());
+        m_arc_importance.resize(m_arc_ways.size());
+        bool simplify = any_zoom_level_simplifies();
+        parallel_for(m_arc_ways.size(), ASSEMBLY_THREADS, [this, &handler, simplify](size_t arc_index){
+            std::vector<osmium::Location>& locations = m_arc_locations[arc_index];
+            for (auto signed_way_id : m_arc_ways[arc_index]) {
+                auto way_nodes = handler.way_to_nodes.at(abs_id(signed_way_id));
+                // The first node is the last one of the previous way.
+                size_t skip = locations.empty() ? 0 : 1;
+                if (signed_way_id > 0) {
+                    for (auto node_iter = way_nodes.begin() + skip; node_iter != way_nodes.end(); ++node_iter) {
+                        locations.push_back(handler.node_to_location.at(*node_iter));
                     }
                 } else {
-                    for (auto& node_id : way_nodes) {
-                        ring_locs.push_back(handler.node_to_location.at(node_id));
+                    for (auto node_iter = way_nodes.end() - skip; node_iter != way_nodes.begin(); --node_iter) {
+                        locations.push_back(handler.node_to_location.at(*(node_iter - 1)));
                     }
                 }
             }
-            rings_locs.push_back(ring_locs);
+            if (simplify) {
+                m_arc_importance[arc_index].resize(locations.size());
+                douglas_peucker_importance(locations.data(), locations.size(), PX_PER_LONG_DEG, PX_PER_LAT_DEG, m_arc_importance[arc_index].data());
+            }
+        });
+    }
+
+    // Whether the ring walks into the arc of this way here, i.e. the way is the first one of its arc in walking direction.
+    bool enters_arc(osmium::object_id_type signed_way_id) const {
+        size_t i = way_index(abs_id(signed_way_id));
+        std::vector<osmium::object_id_type> const& arc_ways = m_arc_ways[m_way_arc[i]];
+        bool forward = (signed_way_id < 0) == m_way_reversed_in_arc[i];
+        return abs_id(forward ? arc_ways.front() : arc_ways.back()) == abs_id(signed_way_id);
+    }
+
+    // The ring as arc indices, where ~index means the arc backwards, like TopoJSON wants it.
+    std::vector<int64_t> ring_arcs(std::vector<osmium::object_id_type> const& ring, osmium::object_id_type relation_id) const {
+        // The ring may start in the middle of an arc, so start at the first arc that begins in it.
+        size_t start = 0;
+        while (start < ring.size() && !enters_arc(ring[start])) {
+            ++start;
         }
-        m_consumer.write_rings(rings_locs, relation_id, rings_ways.front().front());
+        std::vector<int64_t> arcs;
+        size_t covered_ways = 0;
+        for (size_t offset = 0; start < ring.size() && offset < ring.size(); ++offset) {
+            osmium::object_id_type signed_way_id = ring[(start + offset) % ring.size()];
+            if (!enters_arc(signed_way_id)) {
+                continue;
+            }
+            size_t i = way_index(abs_id(signed_way_id));
+            int64_t arc_index = m_way_arc[i];
+            bool forward = (signed_way_id < 0) == m_way_reversed_in_arc[i];
+            arcs.push_back(forward ? arc_index : ~arc_index);
+            covered_ways += m_arc_ways[arc_index].size();
+        }
+        if (covered_ways != ring.size()) {
+            printf("Ring with way %ld in relation %ld doesn't follow its arcs?!\n", ring.front(), relation_id);
+            exit(1);
+        }
+        return arcs;
+    }
+
+    static void render_arc(TextBuffer& out, std::vector<osmium::Location> const& points) {
+        out.write('[');
+        int64_t last_x = 0;
+        int64_t last_y = 0;
+        for (size_t i = 0; i < points.size(); ++i) {
+            // osmium stores 1e-7 degrees, so this rounds to 1e-5 degrees, counted from the translate corner.
+            int64_t x = (int64_t{points[i].x()} + 1800000000 + 50) / 100;
+            int64_t y = (int64_t{points[i].y()} + 900000000 + 50) / 100;
+            out.write(i ? ",[" : "[");
+            out.write_integer(x - last_x);
+            out.write(',');
+            out.write_integer(y - last_y);
+            out.write(']');
+            last_x = x;
+            last_y = y;
+        }
+        out.write(']');
+    }
+
+    void write_level(int level, std::vector<std::vector<std::vector<osmium::object_id_type>>> const& relation_rings, std::vector<std::vector<std::vector<int64_t>>> const& relation_arcs) {
+        double tolerance = zoom_level_tolerance(level);
+        std::vector<TextBuffer> arcs(m_arc_ways.size());
+        std::vector<size_t> arc_points(m_arc_ways.size());
+        parallel_for(m_arc_ways.size(), ASSEMBLY_THREADS, [this, tolerance, &arcs, &arc_points](size_t arc_index){
+            std::vector<osmium::Location> simplified;
+            simplify_by_importance(m_arc_locations[arc_index], m_arc_importance[arc_index], tolerance, simplified);
+            render_arc(arcs[arc_index], simplified);
+            arc_points[arc_index] = simplified.size();
+        });
+
+        std::vector<TextBuffer> relations(relation_arcs.size());
+        for (size_t i = 0; i < relation_arcs.size(); ++i) {
+            TextBuffer& out = relations[i];
+            out.write("{\"type\":\"Polygon\",\"arcs\":[");
+            bool first_ring = true;
+            for (auto const& ring : relation_arcs[i]) {
+                // Adjacent arcs share their end points.
+                size_t ring_points = 1;
+                for (int64_t arc_ref : ring) {
+                    ring_points += arc_points[arc_ref < 0 ? ~arc_ref : arc_ref] - 1;
+                }
+                // Anything less has no area left at this level.
+                if (ring_points < 4) {
+                    continue;
+                }
+                out.write(first_ring ? "[" : ",[");
+                first_ring = false;
+                for (size_t j = 0; j < ring.size(); ++j) {
+                    if (j > 0) {
+                        out.write(',');
+                    }
+                    out.write_integer(ring[j]);
+                }
+                out.write(']');
+            }
+            osmium::object_id_type some_way_id = relation_rings[i].empty() ? 0 : relation_rings[i].front().front();
+            out.write_format("],\"properties\":{\"relation_id\":\"%ld\",\"some_way\":\"%ld\"}}", EXPORT_RELATIONS[i], some_way_id);
+        }
+
+        OutputBuffer out {zoom_level_filename(TOPOLOGY_OUTPUT_FILENAME, level), GZIP_OUTPUT};
+        out.write("{\"type\":\"Topology\",\"transform\":{\"scale\":[0.00001,0.00001],\"translate\":[-180,-90]},\n");
+        out.write("\"objects\":{\"boundaries\":{\"type\":\"GeometryCollection\",\"geometries\":[\n");
+        out.write_all(relations, ",\n");
+        out.write("\n]}},\n\"arcs\":[\n");
+        out.write_all(arcs, ",\n");
+        out.write("\n]}\n");
+
+        size_t painted = 0;
+        for (size_t points : arc_points) {
+            painted += points;
+        }
+        m_painted.push_back(painted);
+    }
+
+    // All ways of all rings, sorted.
+    std::vector<osmium::object_id_type> m_way_ids;
+    // By way index: The (indices of) relations that use the way, the arc it belongs to, and whether the arc walks it backwards.
+    std::vector<std::vector<size_t>> m_way_relations;
+    std::vector<size_t> m_way_arc;
+    std::vector<bool> m_way_reversed_in_arc;
+    // By arc index: Its ways as signed IDs, in the order the arc walks them, and their locations.
+    std::vector<std::vector<osmium::object_id_type>> m_arc_ways;
+    std::vector<std::vector<osmium::Location>> m_arc_locations;
+    // For each location, see douglas_peucker_importance(). Empty if no zoom level simplifies.
+    std::vector<std::vector<float>> m_arc_importance;
+    std::vector<size_t> m_painted;
+};
+
+// Web mercator, with the whole world in [0, 1] x [0, 1], north-west at (0, 0).
+static const double MERCATOR_MAX_LAT_DEG = 85.05112877980659;
+static const double PI = 3.14159265358979323846;
+
+static ClipPoint mercator(osmium::Location const& location) {
+    double lat = std::clamp(location.lat(), -MERCATOR_MAX_LAT_DEG, MERCATOR_MAX_LAT_DEG) * PI / 180.0;
+    return ClipPoint{(location.lon() + 180.0) / 360.0, (1.0 - std::asinh(std::tan(lat)) / PI) / 2.0};
+}
+
+// The parts of https://github.com/mapbox/vector-tile-spec/blob/master/2.1/vector_tile.proto that we write.
+namespace VectorTile {
+enum class Tile : protozero::pbf_tag_type { repeated_Layer_layers = 3 };
+enum class Layer : protozero::pbf_tag_type { required_string_name = 1, repeated_Feature_features = 2, repeated_string_keys = 3, repeated_Value_values = 4, optional_uint32_extent = 5, required_uint32_version = 15 };
+enum class Feature : protozero::pbf_tag_type { optional_uint64_id = 1, packed_uint32_tags = 2, optional_GeomType_type = 3, packed_uint32_geometry = 4 };
+enum class Value : protozero::pbf_tag_type { optional_uint64_uint_value = 5 };
+enum class GeomType : int32_t { POLYGON = 3 };
+}
+
+// Cuts all relations into vector tiles (see TILE_OUTPUT), one layer "boundaries" with one polygon feature per relation
+// and tile. The rings are assembled, projected and get their Douglas-Peucker importance once, and then every tile only
+// simplifies, clips and quantizes the rings that may touch it, so the tiles are independent and built in parallel.
+// Within a ring, each tile only looks at the points of the ways that may touch it, so a long border costs every tile
+// along it only the ways near that tile, not the whole ring.
+class TileWriter {
+public:
+    TileWriter() = default;
+    TileWriter(const TileWriter&) = delete;
+    TileWriter(TileWriter&&) = delete;
+    TileWriter& operator=(const TileWriter&) = delete;
+    TileWriter& operator=(TileWriter&&) = delete;
+
+    void write_from(ExtractRelevantHandler const& handler) {
+        m_relations.resize(std::size(EXPORT_RELATIONS));
+        parallel_for(m_relations.size(), ASSEMBLY_THREADS, [this, &handler](size_t i){
+            locate_relation(i, handler);
+        });
+        std::vector<TileJob> jobs = plan_jobs();
+        // Where each tile's jobs start, plus the end.
+        std::vector<size_t> tile_starts;
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            if (i == 0 || jobs[i].tile != jobs[i - 1].tile) {
+                tile_starts.push_back(i);
+            }
+        }
+        tile_starts.push_back(jobs.size());
+        m_tile_count = tile_starts.size() - 1;
+        // Sorted by zoom and x, so each directory comes up once.
+        for (size_t t = 0; t < m_tile_count; ++t) {
+            uint64_t tile = jobs[tile_starts[t]].tile;
+            if (t == 0 || tile >> 29 != jobs[tile_starts[t - 1]].tile >> 29) {
+                std::filesystem::create_directories(tile_filename(tile).parent_path());
+            }
+        }
+        std::atomic<size_t> written {0};
+        std::atomic<size_t> bytes {0};
+        parallel_for(m_tile_count, ASSEMBLY_THREADS, [this, &jobs, &tile_starts, &written, &bytes](size_t t){
+            std::string data = encode_tile(jobs[tile_starts[t]].tile, jobs.data() + tile_starts[t], jobs.data() + tile_starts[t + 1]);
+            if (data.empty()) {
+                return;
+            }
+            write_file(tile_filename(jobs[tile_starts[t]].tile), data);
+            written += 1;
+            bytes += data.size();
+        });
+        m_written = written;
+        m_bytes = bytes;
+    }
+
+    size_t written() const {
+        return m_written;
+    }
+
+    // Tiles that some ring's bbox touched, but where nothing was left after clipping.
+    size_t empty() const {
+        return m_tile_count - m_written;
+    }
+
+    size_t bytes() const {
+        return m_bytes;
     }
 
 private:
-    Consumer& m_consumer;
+    static constexpr size_t NONE = static_cast<size_t>(-1);
+
+    // The points of one way within a ring.
+    struct RingSpan {
+        size_t begin;
+        size_t end;
+        ClipRect bbox;
+    };
+
+    struct LocatedRelation {
+        // Closed rings, in mercator() coordinates.
+        std::vector<std::vector<ClipPoint>> rings;
+        // For each ring, its ways in order.
+        std::vector<std::vector<RingSpan>> spans;
+        // For each point in rings, see douglas_peucker_importance().
+        std::vector<std::vector<float>> importance;
+        std::vector<ClipRect> bboxes;
+        std::vector<bool> inner;
+        // For each outer ring, the inner rings inside it.
+        std::vector<std::vector<size_t>> holes;
+        // For each inner ring, the outer ring it is inside of, or NONE.
+        std::vector<size_t> outer;
+    };
+
+    // One ring that may touch one tile.
+    struct TileJob {
+        // See tile_key().
+        uint64_t tile;
+        uint32_t relation_index;
+        uint32_t ring_index;
+
+        bool operator<(TileJob const& other) const {
+            return std::tie(tile, relation_index, ring_index) < std::tie(other.tile, other.relation_index, other.ring_index);
+        }
+    };
+
+    struct TilePoint {
+        int32_t x;
+        int32_t y;
+
+        bool operator==(TilePoint const& other) const {
+            return x == other.x && y == other.y;
+        }
+    };
+
+    // Sorts by zoom level, then x, then y.
+    static uint64_t tile_key(int zoom, uint32_t x, uint32_t y) {
+        return (uint64_t{static_cast<uint32_t>(zoom)} << 58) | (uint64_t{x} << 29) | y;
+    }
+
+    static std::filesystem::path tile_filename(uint64_t tile) {
+        uint64_t zoom = tile >> 58;
+        uint64_t x = (tile >> 29) & ((uint64_t{1} << 29) - 1);
+        uint64_t y = tile & ((uint64_t{1} << 29) - 1);
+        return std::filesystem::path{TILE_DIRECTORY} / std::to_string(zoom) / std::to_string(x) / (std::to_string(y) + ".mvt");
+    }
+
+    static void write_file(std::filesystem::path const& filename, std::string const& data) {
+        FILE* fp = fopen(filename.c_str(), "wb");
+        if (!fp) {
+            printf("Cannot write %s: %s\n", filename.c_str(), strerror(errno));
+            exit(1);
+        }
+        bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+        ok = (fclose(fp) == 0) && ok;
+        if (!ok) {
+            printf("Cannot write %s, disk full?!\n", filename.c_str());
+            exit(1);
+        }
+    }
+
+    void locate_relation(size_t relation_index, ExtractRelevantHandler const& handler) {
+        osmium::object_id_type relation_id = EXPORT_RELATIONS[relation_index];
+        LocatedRelation& relation = m_relations[relation_index];
+        IdSpan inner_ways = handler.relation_to_inner_ways.at(relation_id);
+        std::vector<ClipPoint> way_points;
+        std::vector<float> way_importance;
+        for (auto const& ring_ways : assemble_ring_ways(relation_id, handler)) {
+            std::vector<ClipPoint> ring_points;
+            std::vector<float> ring_importance;
+            std::vector<RingSpan> ring_spans;
+            for (auto signed_way_id : ring_ways) {
+                // Always in the way's own order, so the simplification doesn't depend on the direction.
+                way_points.clear();
+                for (auto node_id : handler.way_to_nodes.at(abs_id(signed_way_id))) {
+                    way_points.push_back(mercator(handler.node_to_location.at(node_id)));
+                }
+                way_importance.resize(way_points.size());
+                auto x = [&way_points](size_t i){
+                    return way_points[i].x;
+                };
+                auto y = [&way_points](size_t i){
+                    return way_points[i].y;
+                };
+                douglas_peucker_importance(way_points.size(), x, y, way_importance.data());
+                RingSpan span {ring_points.size(), ring_points.size() + way_points.size(), ClipRect{way_points.front().x, way_points.front().y, way_points.front().x, way_points.front().y}};
+                for (ClipPoint const& point : way_points) {
+                    span.bbox.min_x = std::min(span.bbox.min_x, point.x);
+                    span.bbox.min_y = std::min(span.bbox.min_y, point.y);
+                    span.bbox.max_x = std::max(span.bbox.max_x, point.x);
+                    span.bbox.max_y = std::max(span.bbox.max_y, point.y);
+                }
+                ring_spans.push_back(span);
+                // The duplicated end nodes of consecutive ways disappear when quantizing.
+                if (signed_way_id < 0) {
+                    ring_points.insert(ring_points.end(), way_points.rbegin(), way_points.rend());
+                    ring_importance.insert(ring_importance.end(), way_importance.rbegin(), way_importance.rend());
+                } else {
+                    ring_points.insert(ring_points.end(), way_points.begin(), way_points.end());
+                    ring_importance.insert(ring_importance.end(), way_importance.begin(), way_importance.end());
+                }
+            }
+            ClipRect bbox = ring_spans.front().bbox;
+            for (RingSpan const& span : ring_spans) {
+                bbox.min_x = std::min(bbox.min_x, span.bbox.min_x);
+                bbox.min_y = std::min(bbox.min_y, span.bbox.min_y);
+                bbox.max_x = std::max(bbox.max_x, span.bbox.max_x);
+                bbox.max_y = std::max(bbox.max_y, span.bbox.max_y);
+            }
+            // A ring is as inner as its first way.
+            relation.inner.push_back(std::find(inner_ways.begin(), inner_ways.end(), abs_id(ring_ways.front())) != inner_ways.end());
+            relation.rings.push_back(std::move(ring_points));
+            relation.importance.push_back(std::move(ring_importance));
+            relation.spans.push_back(std::move(ring_spans));
+            relation.bboxes.push_back(bbox);
+        }
+        // MVT decoders attach each inner ring to the outer ring before it, so find out which one that has to be.
+        size_t ring_count = relation.rings.size();
+        relation.holes.resize(ring_count);
+        relation.outer.resize(ring_count, NONE);
+        for (size_t hole = 0; hole < ring_count; ++hole) {
+            if (!relation.inner[hole]) {
+                continue;
+            }
+            ClipRect const& hole_bbox = relation.bboxes[hole];
+            for (size_t outer = 0; outer < ring_count; ++outer) {
+                ClipRect const& outer_bbox = relation.bboxes[outer];
+                if (relation.inner[outer] || hole_bbox.min_x < outer_bbox.min_x || hole_bbox.max_x > outer_bbox.max_x
+                        || hole_bbox.min_y < outer_bbox.min_y || hole_bbox.max_y > outer_bbox.max_y) {
+                    continue;
+                }
+                if (ring_contains(relation.rings[outer], relation.rings[hole].front())) {
+                    relation.outer[hole] = outer;
+                    relation.holes[outer].push_back(hole);
+                    break;
+                }
+            }
+            if (relation.outer[hole] == NONE) {
+                printf("   Inner ring with %lu points in relation %lu isn't inside any outer ring, leaving it out of the tiles.\n",
+                    relation.rings[hole].size(), relation_id);
+            }
+        }
+    }
+
+    // Each ring goes to every tile that its bbox (plus TILE_BUFFER) touches, on every zoom level.
+    std::vector<TileJob> plan_jobs() const {
+        std::vector<TileJob> jobs;
+        for (int zoom = TILE_MIN_ZOOM; zoom <= TILE_MAX_ZOOM; ++zoom) {
+            double tiles_per_side = std::ldexp(1.0, zoom);
+            double buffer = static_cast<double>(TILE_BUFFER) / TILE_EXTENT;
+            double last_tile = tiles_per_side - 1.0;
+            auto tile_index = [last_tile](double position){
+                return static_cast<uint32_t>(std::clamp(std::floor(position), 0.0, last_tile));
+            };
+            for (size_t relation_index = 0; relation_index < m_relations.size(); ++relation_index) {
+                LocatedRelation const& relation = m_relations[relation_index];
+                for (size_t ring_index = 0; ring_index < relation.rings.size(); ++ring_index) {
+                    if (relation.inner[ring_index] && relation.outer[ring_index] == NONE) {
+                        continue;
+                    }
+                    ClipRect const& bbox = relation.bboxes[ring_index];
+                    uint32_t last_x = tile_index(bbox.max_x * tiles_per_side + buffer);
+                    uint32_t last_y = tile_index(bbox.max_y * tiles_per_side + buffer);
+                    for (uint32_t x = tile_index(bbox.min_x * tiles_per_side - buffer); x <= last_x; ++x) {
+                        for (uint32_t y = tile_index(bbox.min_y * tiles_per_side - buffer); y <= last_y; ++y) {
+                            jobs.push_back(TileJob{tile_key(zoom, x, y), static_cast<uint32_t>(relation_index), static_cast<uint32_t>(ring_index)});
+                        }
+                    }
+                }
+            }
+        }
+        std::sort(jobs.begin(), jobs.end());
+        return jobs;
+    }
+
+    // The ring in tile units: Simplified for the zoom level, clipped to the tile plus TILE_BUFFER, quantized, and
+    // without the closing point. Clipping may cut it into several rings. Outer rings have a positive area in tile
+    // coordinates (y points down), inner ones a negative area, as the spec wants it. Empty if nothing is left.
+    std::vector<std::vector<TilePoint>> tile_ring(uint64_t tile, LocatedRelation const& relation, size_t ring_index) const {
+        int zoom = static_cast<int>(tile >> 58);
+        double scale = std::ldexp(static_cast<double>(TILE_EXTENT), zoom);
+        double origin_x = static_cast<double>((tile >> 29) & ((uint64_t{1} << 29) - 1)) * TILE_EXTENT;
+        double origin_y = static_cast<double>(tile & ((uint64_t{1} << 29) - 1)) * TILE_EXTENT;
+        double tolerance = TILE_SIMPLIFY_TOLERANCE / scale;
+        double buffer = TILE_BUFFER;
+        // The same rectangle in mercator() coordinates, to check the ways against.
+        ClipRect area {(origin_x - buffer) / scale, (origin_y - buffer) / scale, (origin_x + TILE_EXTENT + buffer) / scale, (origin_y + TILE_EXTENT + buffer) / scale};
+        std::vector<ClipPoint> const& ring = relation.rings[ring_index];
+        std::vector<float> const& importance = relation.importance[ring_index];
+        std::vector<ClipPoint> points;
+        auto add_point = [&points, &ring, scale, origin_x, origin_y](size_t i){
+            points.push_back(ClipPoint{ring[i].x * scale - origin_x, ring[i].y * scale - origin_y});
+        };
+        for (RingSpan const& span : relation.spans[ring_index]) {
+            // Without the closing point.
+            size_t end = std::min(span.end, ring.size() - 1);
+            if (span.begin >= end) {
+                continue;
+            }
+            if (span.bbox.max_x < area.min_x || span.bbox.min_x > area.max_x || span.bbox.max_y < area.min_y || span.bbox.min_y > area.max_y) {
+                // The whole way lies beyond one edge of the tile, so clipping would turn it into a run along that edge
+                // anyway. Its end points (which Douglas-Peucker always keeps) are enough to get the same area.
+                add_point(span.begin);
+                add_point(end - 1);
+                continue;
+            }
+            for (size_t i = span.begin; i < end; ++i) {
+                if (importance[i] > tolerance) {
+                    add_point(i);
+                }
+            }
+        }
+        std::vector<std::vector<ClipPoint>> pieces;
+        clip_open_ring(points, ClipRect{-buffer, -buffer, TILE_EXTENT + buffer, TILE_EXTENT + buffer}, pieces);
+        std::vector<std::vector<TilePoint>> quantized_pieces;
+        for (auto const& piece : pieces) {
+            std::vector<TilePoint> quantized;
+            for (ClipPoint const& point : piece) {
+                TilePoint rounded {static_cast<int32_t>(std::lround(point.x)), static_cast<int32_t>(std::lround(point.y))};
+                if (quantized.empty() || !(rounded == quantized.back())) {
+                    quantized.push_back(rounded);
+                }
+            }
+            while (quantized.size() > 1 && quantized.front() == quantized.back()) {
+                quantized.pop_back();
+            }
+            if (quantized.size() < 3) {
+                continue;
+            }
+            int64_t twice_area = 0;
+            for (size_t i = 0; i < quantized.size(); ++i) {
+                TilePoint const& a = quantized[i];
+                TilePoint const& b = quantized[(i + 1) % quantized.size()];
+                twice_area += int64_t{a.x} * b.y - int64_t{b.x} * a.y;
+            }
+            if (twice_area == 0) {
+                continue;
+            }
+            if ((twice_area > 0) == relation.inner[ring_index]) {
+                std::reverse(quantized.begin(), quantized.end());
+            }
+            quantized_pieces.push_back(std::move(quantized));
+        }
+        return quantized_pieces;
+    }
+
+    // The outer piece (see tile_ring()) that a piece of a hole belongs to. Its points on the tile border may lie on the
+    // border of the outer piece as well, so rather test one of the others.
+    static size_t outer_piece_of(std::vector<TilePoint> const& hole, std::vector<std::vector<TilePoint>> const& outer_pieces) {
+        if (outer_pieces.size() == 1) {
+            return 0;
+        }
+        int32_t min = -static_cast<int32_t>(TILE_BUFFER);
+        int32_t max = static_cast<int32_t>(TILE_EXTENT + TILE_BUFFER);
+        TilePoint probe = hole.front();
+        for (TilePoint const& point : hole) {
+            if (point.x != min && point.x != max && point.y != min && point.y != max) {
+                probe = point;
+                break;
+            }
+        }
+        for (size_t i = 0; i < outer_pieces.size(); ++i) {
+            if (ring_contains(outer_pieces[i], probe)) {
+                return i;
+            }
+        }
+        return outer_pieces.size() - 1;
+    }
+
+    // MVT geometry commands: MoveTo the first point, LineTo the others, ClosePath, with zigzag-encoded deltas.
+    static void encode_ring(std::vector<TilePoint> const& ring, TilePoint& cursor, std::vector<uint32_t>& geometry) {
+        auto command = [](uint32_t id, uint32_t count){
+            return (id & 0x7) | (count << 3);
+        };
+        for (size_t i = 0; i < ring.size(); ++i) {
+            if (i == 0) {
+                geometry.push_back(command(1, 1));
+            } else if (i == 1) {
+                geometry.push_back(command(2, ring.size() - 1));
+            }
+            geometry.push_back(protozero::encode_zigzag32(ring[i].x - cursor.x));
+            geometry.push_back(protozero::encode_zigzag32(ring[i].y - cursor.y));
+            cursor = ring[i];
+        }
+        geometry.push_back(command(7, 1));
+    }
+
+    // Empty if nothing is left in the tile. The jobs are sorted by relation and ring.
+    std::string encode_tile(uint64_t tile, TileJob const* begin, TileJob const* end) const {
+        std::vector<std::pair<size_t, std::vector<uint32_t>>> features;
+        for (TileJob const* relation_begin = begin; relation_begin != end; ) {
+            size_t relation_index = relation_begin->relation_index;
+            TileJob const* relation_end = std::find_if(relation_begin, end, [relation_index](TileJob const& job){
+                return job.relation_index != relation_index;
+            });
+            LocatedRelation const& relation = m_relations[relation_index];
+            std::vector<std::vector<std::vector<TilePoint>>> rings(relation.rings.size());
+            for (TileJob const* job = relation_begin; job != relation_end; ++job) {
+                rings[job->ring_index] = tile_ring(tile, relation, job->ring_index);
+            }
+            // Each piece of an outer ring, followed by the pieces of its inner rings that lie inside that piece.
+            std::vector<uint32_t> geometry;
+            TilePoint cursor {0, 0};
+            for (TileJob const* job = relation_begin; job != relation_end; ++job) {
+                std::vector<std::vector<TilePoint>> const& outer_pieces = rings[job->ring_index];
+                if (relation.inner[job->ring_index] || outer_pieces.empty()) {
+                    continue;
+                }
+                std::vector<std::vector<std::vector<TilePoint> const*>> piece_holes(outer_pieces.size());
+                for (size_t hole : relation.holes[job->ring_index]) {
+                    for (std::vector<TilePoint> const& hole_piece : rings[hole]) {
+                        piece_holes[outer_piece_of(hole_piece, outer_pieces)].push_back(&hole_piece);
+                    }
+                }
+                for (size_t piece = 0; piece < outer_pieces.size(); ++piece) {
+                    encode_ring(outer_pieces[piece], cursor, geometry);
+                    for (std::vector<TilePoint> const* hole_piece : piece_holes[piece]) {
+                        encode_ring(*hole_piece, cursor, geometry);
+                    }
+                }
+            }
+            if (!geometry.empty()) {
+                features.emplace_back(relation_index, std::move(geometry));
+            }
+            relation_begin = relation_end;
+        }
+        if (features.empty()) {
+            return {};
+        }
+
+        std::string data;
+        {
+            protozero::pbf_builder<VectorTile::Tile> tile_builder {data};
+            protozero::pbf_builder<VectorTile::Layer> layer {tile_builder, VectorTile::Tile::repeated_Layer_layers};
+            layer.add_uint32(VectorTile::Layer::required_uint32_version, 2);
+            layer.add_string(VectorTile::Layer::required_string_name, "boundaries");
+            for (size_t i = 0; i < features.size(); ++i) {
+                protozero::pbf_builder<VectorTile::Feature> feature {layer, VectorTile::Layer::repeated_Feature_features};
+                feature.add_uint64(VectorTile::Feature::optional_uint64_id, EXPORT_RELATIONS[features[i].first]);
+                // The only key, and the value of this feature.
+                uint32_t tags[2] = {0, static_cast<uint32_t>(i)};
+                feature.add_packed_uint32(VectorTile::Feature::packed_uint32_tags, std::begin(tags), std::end(tags));
+                feature.add_enum(VectorTile::Feature::optional_GeomType_type, static_cast<int32_t>(VectorTile::GeomType::POLYGON));
+                feature.add_packed_uint32(VectorTile::Feature::packed_uint32_geometry, features[i].second.begin(), features[i].second.end());
+            }
+            layer.add_string(VectorTile::Layer::repeated_string_keys, "relation_id");
+            for (auto const& feature : features) {
+                protozero::pbf_builder<VectorTile::Value> value {layer, VectorTile::Layer::repeated_Value_values};
+                value.add_uint64(VectorTile::Value::optional_uint64_uint_value, EXPORT_RELATIONS[feature.first]);
+            }
+            layer.add_uint32(VectorTile::Layer::optional_uint32_extent, TILE_EXTENT);
+        }
+        return data;
+    }
+
+    std::vector<LocatedRelation> m_relations;
+    size_t m_tile_count {0};
+    size_t m_written {0};
+    size_t m_bytes {0};
 };
 
+template <osmium::item_type TType>
+using TypeIdSelection = AllOf<OfType<TType>, IdSet>;
+
+// Each pass collects the IDs that the next one needs. They are sorted arrays, so checking an object is a
+// binary search, and the block index can skip every block whose ID range doesn't contain any of them.
+static void read_direct(ExtractRelevantHandler& handler) {
+    printf("indexing %s\n", INPUT_FILENAME);
+    PbfBlockIndex index {INPUT_FILENAME};
+    ExtractCounters counters;
+
+    printf("pass 1: relations\n");
+    TypeIdSelection<osmium::item_type::relation> relation_selection {OfType<osmium::item_type::relation>{}, RELEVANT_RELATIONS};
+    apply_blocks_counted(index, selected_blocks(index, relation_selection), osmium::osm_entity_bits::relation, handler, counters);
+
+    printf("pass 2: ways of %lu relations\n", handler.relation_to_ways.size());
+    IdSpan wanted_ways = handler.relation_to_ways.all_items();
+    TypeIdSelection<osmium::item_type::way> way_selection {OfType<osmium::item_type::way>{}, IdSet{wanted_ways.begin(), wanted_ways.end()}};
+    SelectingHandler way_handler {way_selection, handler};
+    apply_blocks_counted(index, selected_blocks(index, way_selection), osmium::osm_entity_bits::way, way_handler, counters);
+
+    IdSpan wanted_nodes = handler.way_to_nodes.all_items();
+    IdSet wanted_node_set {wanted_nodes.begin(), wanted_nodes.end()};
+    std::unique_ptr<NodeLocationStore> store = open_node_location_store(index, NODE_LOCATIONS);
+    if (store) {
+        printf("looking up %lu nodes of %lu ways\n", wanted_node_set.size(), handler.way_to_nodes.size());
+        // Like the pass, leave out the nodes that don't exist.
+        for (osmium::object_id_type node_id : wanted_node_set.ids()) {
+            osmium::Location location = store->get(node_id);
+            if (location) {
+                handler.node_to_location.append(node_id, location);
+            }
+        }
+    } else {
+        printf("pass 3: nodes of %lu ways\n", handler.way_to_nodes.size());
+        TypeIdSelection<osmium::item_type::node> node_selection {OfType<osmium::item_type::node>{}, std::move(wanted_node_set)};
+        SelectingHandler node_handler {node_selection, handler};
+        apply_blocks_counted(index, selected_blocks(index, node_selection), osmium::osm_entity_bits::node, node_handler, counters);
+    }
+
+    printf("    decoded %lu of %lu blocks, %lu bytes\n", counters.blocks_decoded.load(), index.size(), counters.bytes_read.load());
+}
+
 int main() {
-    printf("reading input header\n");
     srand(time(nullptr));
-    osmium::io::Reader reader{INPUT_FILENAME, osmium::osm_entity_bits::all};
     ExtractRelevantHandler handler;
-
-    printf("reading *all* data to memory (this assumes that you already ran 'osmium getid')\n");
-    osmium::apply(reader, handler);
-    reader.close();
+    if (DIRECT_PASSES) {
+        read_direct(handler);
+    } else {
+        printf("reading input header\n");
+        osmium::io::Reader reader{INPUT_FILENAME, osmium::osm_entity_bits::all};
+        printf("reading *all* data to memory (this assumes that you already ran 'osmium getid')\n");
+        osmium::apply(reader, handler);
+        reader.close();
+    }
+    handler.finish();
     printf(
         "    got %ld nodes, %ld ways, %ld of %ld useful relations, and %ld useless relations\n",
         handler.node_to_location.size(),
@@ -446,13 +1510,41 @@ int main() {
     printf("checking consistency …\n");
     handler.check();
 
+    if (TILE_OUTPUT) {
+        printf("writing tiles\n");
+        TileWriter tiles;
+        tiles.write_from(handler);
+        printf("   wrote %lu tiles with %lu bytes, %lu more were empty\n", tiles.written(), tiles.bytes(), tiles.empty());
+        printf("closing\n");
+        return 0;
+    }
+    if (TOPOLOGY_OUTPUT) {
+        printf("writing topology\n");
+        TopologyWriter topology;
+        topology.write_from(handler);
+        printf("   %lu ways in %lu arcs\n", topology.way_count(), topology.arc_count());
+        for (size_t level_index = 0; level_index < std::size(ZOOM_LEVELS); ++level_index) {
+            printf("   zoom level %d: wrote %lu nodes\n", ZOOM_LEVELS[level_index], topology.painted()[level_index]);
+        }
+        printf("closing\n");
+        return 0;
+    }
+
     printf("writing svg\n");
-    Consumer consumer{OUTPUT_FILENAME};
-    PolyFeeder writer{consumer};
+    std::vector<std::unique_ptr<Consumer>> consumers;
+    for (int level : ZOOM_LEVELS) {
+        consumers.push_back(std::make_unique<Consumer>(zoom_level_filename(OUTPUT_FILENAME, level), GZIP_OUTPUT));
+    }
+    PolyFeeder writer{consumers};
     writer.write_relations_from(handler);
-    printf("   painted %lu nodes\n", consumer.painted());
-    printf("   could skip painting %lu nodes\n", consumer.skipped_painting());
+    for (size_t level_index = 0; level_index < consumers.size(); ++level_index) {
+        if (consumers.size() > 1) {
+            printf("   zoom level %d:\n", ZOOM_LEVELS[level_index]);
+        }
+        printf("   painted %lu nodes\n", consumers[level_index]->painted());
+        printf("   could skip painting %lu nodes\n", consumers[level_index]->skipped_painting());
+    }
 
     printf("closing\n");
-    return 0; // Implicit: Deconstruct consumer, which finishes and closes the file.
+    return 0; // Implicit: Deconstruct consumers, which finish and close the files.
 }
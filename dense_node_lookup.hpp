@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <protozero/pbf_message.hpp>
+
+#include <osmium/io/detail/protobuf_tags.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/types.hpp>
+
+#include "pbf_block_index.hpp"
+
+using PackedSint64 = protozero::iterator_range<protozero::pbf_reader::const_sint64_iterator>;
+
+// PBF coordinates are in nanodegrees (times granularity), osmium::Location uses 1e-7 degrees.
+static const int64_t PBF_TO_OSMIUM_COORDINATE = 1000000000 / osmium::detail::coordinate_precision;
+
+// Looks up a single node in a decompressed PrimitiveBlock, without materializing any osmium objects.
+// For DenseNodes (which is what every planet extract uses), only the delta-coded ID column is summed up
+// until the needle is found, and then only the lat/lon columns up to that index. Tags and metadata are
+// never touched. Returns an undefined Location if the node is not in the block.
+class DenseNodeLookup {
+public:
+    explicit DenseNodeLookup(protozero::data_view primitive_block) {
+        protozero::pbf_message<OSMFormat::PrimitiveBlock> pbf_block{primitive_block};
+        while (pbf_block.next()) {
+            switch (pbf_block.tag()) {
+            case OSMFormat::PrimitiveBlock::repeated_PrimitiveGroup_primitivegroup:
+                m_groups.push_back(pbf_block.get_view());
+                break;
+            case OSMFormat::PrimitiveBlock::optional_int32_granularity:
+                m_granularity = pbf_block.get_int32();
+                break;
+            case OSMFormat::PrimitiveBlock::optional_int64_lat_offset:
+                m_lat_offset = pbf_block.get_int64();
+                break;
+            case OSMFormat::PrimitiveBlock::optional_int64_lon_offset:
+                m_lon_offset = pbf_block.get_int64();
+                break;
+            default:
+                // Most importantly the string table, which we don't need at all.
+                pbf_block.skip();
+            }
+        }
+    }
+
+    osmium::Location find(osmium::object_id_type node_id) const {
+        for (protozero::data_view group : m_groups) {
+            protozero::pbf_message<OSMFormat::PrimitiveGroup> pbf_group{group};
+            while (pbf_group.next()) {
+                switch (pbf_group.tag()) {
+                case OSMFormat::PrimitiveGroup::optional_DenseNodes_dense: {
+                    osmium::Location loc = find_in_dense(pbf_group.get_view(), node_id);
+                    if (loc) {
+                        return loc;
+                    }
+                    break;
+                }
+                case OSMFormat::PrimitiveGroup::repeated_Node_nodes: {
+                    osmium::Location loc = find_in_node(pbf_group.get_view(), node_id);
+                    if (loc) {
+                        return loc;
+                    }
+                    break;
+                }
+                default:
+                    // Ways and relations.
+                    pbf_group.skip();
+                }
+            }
+        }
+        return osmium::Location();
+    }
+
+private:
+    osmium::Location make_location(int64_t lon, int64_t lat) const {
+        return osmium::Location(
+            static_cast<int32_t>((lon * m_granularity + m_lon_offset) / PBF_TO_OSMIUM_COORDINATE),
+            static_cast<int32_t>((lat * m_granularity + m_lat_offset) / PBF_TO_OSMIUM_COORDINATE)
+        );
+    }
+
+    // Sums up the deltas of a packed column up to and including the given index.
+    static int64_t sum_deltas_until(PackedSint64 const& deltas, size_t index) {
+        int64_t value = 0;
+        size_t current = 0;
+        for (auto it = deltas.begin(); it != deltas.end(); ++it, ++current) {
+            value += *it;
+            if (current == index) {
+                break;
+            }
+        }
+        return value;
+    }
+
+    osmium::Location find_in_dense(protozero::data_view dense, osmium::object_id_type node_id) const {
+        // The columns may come in any order, so remember where they are first. This doesn't decode anything yet.
+        PackedSint64 ids;
+        PackedSint64 lats;
+        PackedSint64 lons;
+        protozero::pbf_message<OSMFormat::DenseNodes> pbf_dense{dense};
+        while (pbf_dense.next()) {
+            switch (pbf_dense.tag()) {
+            case OSMFormat::DenseNodes::packed_sint64_id:
+                ids = pbf_dense.get_packed_sint64();
+                break;
+            case OSMFormat::DenseNodes::packed_sint64_lat:
+                lats = pbf_dense.get_packed_sint64();
+                break;
+            case OSMFormat::DenseNodes::packed_sint64_lon:
+                lons = pbf_dense.get_packed_sint64();
+                break;
+            default:
+                pbf_dense.skip();
+            }
+        }
+
+        int64_t current_id = 0;
+        size_t index = 0;
+        for (auto it = ids.begin(); it != ids.end(); ++it, ++index) {
+            current_id += *it;
+            if (current_id == node_id) {
+                return make_location(sum_deltas_until(lons, index), sum_deltas_until(lats, index));
+            }
+            if (object_id_less(node_id, current_id)) {
+                // Sorted input, so we're already past the needle.
+                return osmium::Location();
+            }
+        }
+        return osmium::Location();
+    }
+
+    osmium::Location find_in_node(protozero::data_view node, osmium::object_id_type node_id) const {
+        osmium::object_id_type id = 0;
+        int64_t lat = 0;
+        int64_t lon = 0;
+        protozero::pbf_message<OSMFormat::Node> pbf_node{node};
+        while (pbf_node.next()) {
+            switch (pbf_node.tag()) {
+            case OSMFormat::Node::required_sint64_id:
+                id = pbf_node.get_sint64();
+                break;
+            case OSMFormat::Node::required_sint64_lat:
+                lat = pbf_node.get_sint64();
+                break;
+            case OSMFormat::Node::required_sint64_lon:
+                lon = pbf_node.get_sint64();
+                break;
+            default:
+                pbf_node.skip();
+            }
+        }
+        if (id != node_id) {
+            return osmium::Location();
+        }
+        return make_location(lon, lat);
+    }
+
+    std::vector<protozero::data_view> m_groups;
+    int64_t m_granularity {100};
+    int64_t m_lat_offset {0};
+    int64_t m_lon_offset {0};
+};
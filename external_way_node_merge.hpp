@@ -0,0 +1,339 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include <osmium/handler.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "pbf_block_index.hpp"
+#include "selection.hpp"
+#include "way_node_merge.hpp"
+
+// The linear-scan engine for when the selected ways don't fit into memory: The (node ID, way ID) pairs are
+// collected into sorted runs on disk, which are k-way merged during the node pass. The locations found that way
+// go through a second external sort, by way, so that each way gets its first resolvable node in way order.
+// Memory stays within a budget, except for one bit per way ID (about 150 MiB for the planet) to remember which
+// ways already got their very first node.
+
+struct NodeWayPair {
+    osmium::object_id_type node_id;
+    osmium::object_id_type way_id;
+    // Of the node within the way.
+    size_t position;
+
+    bool operator<(NodeWayPair const& other) const {
+        return object_id_less(node_id, other.node_id) || (node_id == other.node_id && way_id < other.way_id);
+    }
+};
+static_assert(sizeof(NodeWayPair) == 24);
+
+// A candidate location for a way. Sorted by way, the first one of each way is the one to print.
+struct WayLocation {
+    osmium::object_id_type way_id;
+    size_t position;
+    osmium::Location location;
+
+    bool operator<(WayLocation const& other) const {
+        return object_id_less(way_id, other.way_id) || (way_id == other.way_id && position < other.position);
+    }
+};
+static_assert(sizeof(WayLocation) == 24);
+// Sorts after every real position, so that it only wins if the way has no resolvable node at all.
+static const size_t WAY_LOCATION_PLACEHOLDER = SIZE_MAX;
+
+// Sorts more records than fit into memory. add() everything, then finish(), then next() returns all records in
+// order. As long as everything fits into the budget, nothing is ever written to disk. The records are written to
+// disk as they are, so they must be trivially copyable, and shouldn't have padding.
+template <typename TRecord>
+class SpillingSorter {
+public:
+    SpillingSorter(std::string scratch_directory, std::string run_prefix, size_t budget_bytes)
+        : m_scratch_directory(std::move(scratch_directory))
+        , m_run_prefix(std::move(run_prefix))
+        , m_max_buffered(std::max(size_t{1}, budget_bytes / sizeof(TRecord)))
+    {
+        // Allocate the whole budget once, so that add() never reallocates (which would briefly need 1.5 times
+        // as much, and copy everything). Pages that are never touched don't cost any actual memory.
+        m_buffer.reserve(m_max_buffered);
+    }
+    SpillingSorter(const SpillingSorter&) = delete;
+    SpillingSorter(SpillingSorter&&) = delete;
+    SpillingSorter& operator=(const SpillingSorter&) = delete;
+    SpillingSorter& operator=(SpillingSorter&&) = delete;
+
+    ~SpillingSorter() {
+        for (Run& run : m_runs) {
+            if (run.fp) {
+                fclose(run.fp);
+            }
+            unlink(run.filename.c_str());
+        }
+    }
+
+    void add(TRecord const& record) {
+        assert(!m_finished);
+        m_buffer.push_back(record);
+        if (m_buffer.size() >= m_max_buffered) {
+            spill();
+        }
+    }
+
+    void finish() {
+        assert(!m_finished);
+        m_finished = true;
+        if (m_runs.empty()) {
+            // Everything fit into memory. Otherwise, spill() sorts the last run.
+            std::sort(m_buffer.begin(), m_buffer.end());
+            return;
+        }
+        if (!m_buffer.empty()) {
+            spill();
+        }
+        m_buffer = std::vector<TRecord>();
+        // Split the budget evenly over the read buffers of all runs.
+        size_t records_per_run = std::max(size_t{1024}, m_max_buffered / m_runs.size());
+        printf("# Merging %lu runs from %s, reading %lu records at a time …\n", m_runs.size(), m_scratch_directory.c_str(), records_per_run);
+        for (size_t run_index = 0; run_index < m_runs.size(); ++run_index) {
+            Run& run = m_runs[run_index];
+            run.fp = fopen(run.filename.c_str(), "rb");
+            if (!run.fp) {
+                printf("Can't reopen run %s?!\n", run.filename.c_str());
+                exit(1);
+            }
+            run.buffer.resize(records_per_run);
+            refill(run_index);
+        }
+    }
+
+    // Returns false once all records were returned.
+    bool next(TRecord& record) {
+        assert(m_finished);
+        if (m_runs.empty()) {
+            if (m_next_in_buffer >= m_buffer.size()) {
+                return false;
+            }
+            record = m_buffer[m_next_in_buffer++];
+            return true;
+        }
+        if (m_heads.empty()) {
+            return false;
+        }
+        size_t run_index = m_heads.top().second;
+        record = m_heads.top().first;
+        m_heads.pop();
+        refill(run_index);
+        return true;
+    }
+
+    size_t spilled_runs() const {
+        return m_runs.size();
+    }
+
+private:
+    struct Run {
+        std::string filename;
+        FILE* fp {nullptr};
+        std::vector<TRecord> buffer;
+        size_t next {0};
+        size_t end {0};
+    };
+
+    void spill() {
+        std::sort(m_buffer.begin(), m_buffer.end());
+        Run run;
+        run.filename = m_scratch_directory + "/" + m_run_prefix + "_run_" + std::to_string(getpid()) + "_" + std::to_string(m_runs.size()) + ".bin";
+        FILE* fp = fopen(run.filename.c_str(), "wb");
+        if (!fp) {
+            printf("Can't write run %s, does the scratch directory exist?!\n", run.filename.c_str());
+            exit(1);
+        }
+        if (fwrite(m_buffer.data(), sizeof(TRecord), m_buffer.size(), fp) != m_buffer.size() || fclose(fp) != 0) {
+            printf("Can't write run %s, disk full?!\n", run.filename.c_str());
+            exit(1);
+        }
+        printf("# Spilled run %lu with %lu records to %s\n", m_runs.size(), m_buffer.size(), run.filename.c_str());
+        m_runs.push_back(std::move(run));
+        // Keeps the capacity for the next run.
+        m_buffer.clear();
+    }
+
+    // Pushes the next record of the run onto the heap, reading the next chunk from disk if necessary.
+    void refill(size_t run_index) {
+        Run& run = m_runs[run_index];
+        if (run.next == run.end) {
+            run.next = 0;
+            run.end = fread(run.buffer.data(), sizeof(TRecord), run.buffer.size(), run.fp);
+            if (run.end == 0) {
+                // Run exhausted, so free its memory early.
+                run.buffer = std::vector<TRecord>();
+                return;
+            }
+        }
+        m_heads.emplace(run.buffer[run.next++], run_index);
+    }
+
+    using Head = std::pair<TRecord, size_t>;
+
+    std::string m_scratch_directory;
+    std::string m_run_prefix;
+    size_t m_max_buffered;
+    bool m_finished {false};
+    std::vector<TRecord> m_buffer;
+    size_t m_next_in_buffer {0};
+    std::vector<Run> m_runs;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> m_heads;
+};
+
+using SpillingNodeWaySorter = SpillingSorter<NodeWayPair>;
+using SpillingWayLocationSorter = SpillingSorter<WayLocation>;
+
+// First pass: Feeds the nodes of all selected ways into the sorter, and a placeholder for each way into the location
+// sorter, so that ways without any resolvable node get printed too. If an index is given, it also remembers which
+// node blocks the second pass needs, because the spilled pairs can't cheaply be iterated twice.
+template <typename TSelection>
+class ExternalWayNodesExtractor : public osmium::handler::Handler {
+public:
+    ExternalWayNodesExtractor(TSelection const& selection, SpillingNodeWaySorter& sorter, SpillingWayLocationSorter& locations, PbfBlockIndex const* index)
+        : m_selection(selection)
+        , m_sorter(sorter)
+        , m_locations(locations)
+        , m_index(index)
+        , m_needed_blocks(index ? index->size() : 0, false)
+    {
+    }
+
+    void way(const osmium::Way& way) {
+        if (!is_selected(m_selection, way))
+            return;
+        m_ways += 1;
+        m_max_way_id = std::max(m_max_way_id, way.id());
+        m_locations.add(WayLocation{way.id(), WAY_LOCATION_PLACEHOLDER, osmium::Location()});
+        size_t position = 0;
+        for (auto const& noderef : way.nodes()) {
+            m_sorter.add(NodeWayPair{noderef.ref(), way.id(), position++});
+            if (m_index) {
+                size_t block_index = m_index->find_block_range(osmium::item_type::node, noderef.ref());
+                if (block_index != m_index->size()) {
+                    m_needed_blocks[block_index] = true;
+                }
+            }
+        }
+    }
+
+    size_t ways() const {
+        return m_ways;
+    }
+
+    osmium::object_id_type max_way_id() const {
+        return m_max_way_id;
+    }
+
+    std::vector<size_t> needed_blocks() const {
+        std::vector<size_t> blocks;
+        for (size_t block_index = 0; block_index < m_needed_blocks.size(); ++block_index) {
+            if (m_needed_blocks[block_index]) {
+                blocks.push_back(block_index);
+            }
+        }
+        return blocks;
+    }
+
+private:
+    TSelection const& m_selection;
+    SpillingNodeWaySorter& m_sorter;
+    SpillingWayLocationSorter& m_locations;
+    PbfBlockIndex const* m_index;
+    std::vector<bool> m_needed_blocks;
+    size_t m_ways {0};
+    osmium::object_id_type m_max_way_id {0};
+};
+
+// Second pass: Same merge as FirstLocationExtractor, but pulling the pairs from the sorter, and pushing every
+// location found into the location sorter. Once a way got its very first node, nothing can beat that anymore,
+// so later nodes of that way are dropped right away.
+class ExternalFirstLocationExtractor : public osmium::handler::Handler {
+public:
+    ExternalFirstLocationExtractor(SpillingNodeWaySorter& sorter, SpillingWayLocationSorter& locations, osmium::object_id_type max_way_id)
+        : m_sorter(sorter)
+        , m_locations(locations)
+        , m_first_node_found(max_way_id + 1, false)
+    {
+        m_has_current = m_sorter.next(m_current);
+    }
+
+    void node(const osmium::Node& node) {
+        merge_location(node.id(), node.location());
+    }
+
+    // Instead of a node pass, see FirstLocationExtractor::resolve_all().
+    template <typename TGetLocation>
+    void resolve_all(TGetLocation&& get_location) {
+        while (m_has_current) {
+            osmium::object_id_type node_id = m_current.node_id;
+            osmium::Location loc = get_location(node_id);
+            if (loc) {
+                merge_location(node_id, loc);
+            } else {
+                while (m_has_current && m_current.node_id == node_id) {
+                    m_has_current = m_sorter.next(m_current);
+                }
+            }
+        }
+    }
+
+    // Call once the node pass is done. Prints every way in file order, like the lookup engines, with an undefined
+    // location if none of its nodes exist.
+    void print_locations() {
+        m_locations.finish();
+        WayLocation candidate {0, 0, osmium::Location()};
+        bool has_previous = false;
+        osmium::object_id_type previous_way_id = 0;
+        while (m_locations.next(candidate)) {
+            if (has_previous && candidate.way_id == previous_way_id) {
+                continue;
+            }
+            has_previous = true;
+            previous_way_id = candidate.way_id;
+            printf("w%lu x%d y%d\n", candidate.way_id, candidate.location.x(), candidate.location.y());
+        }
+    }
+
+private:
+    void merge_location(osmium::object_id_type node_id, osmium::Location loc) {
+        // Interesting nodes before this one are not in the dataset, so skip them.
+        while (m_has_current && object_id_less(m_current.node_id, node_id)) {
+            m_has_current = m_sorter.next(m_current);
+        }
+        // Several ways may share this node. It's a candidate for each of them that doesn't have its first node yet.
+        while (m_has_current && m_current.node_id == node_id) {
+            // Negative way IDs have no bit, so all of their candidates go into the sort.
+            bool has_bit = m_current.way_id >= 0;
+            if (!has_bit || !m_first_node_found[m_current.way_id]) {
+                if (has_bit) {
+                    m_first_node_found[m_current.way_id] = m_current.position == 0;
+                }
+                m_locations.add(WayLocation{m_current.way_id, m_current.position, loc});
+            }
+            m_has_current = m_sorter.next(m_current);
+        }
+    }
+
+    SpillingNodeWaySorter& m_sorter;
+    SpillingWayLocationSorter& m_locations;
+    std::vector<bool> m_first_node_found;
+    NodeWayPair m_current {0, 0, 0};
+    bool m_has_current {false};
+};
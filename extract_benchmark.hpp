@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <vector>
+
+#include <osmium/io/reader.hpp>
+#include <osmium/osm/entity_bits.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/thread/pool.hpp>
+#include <osmium/visitor.hpp>
+
+#include "pbf_block_index.hpp"
+
+// How many blocks apply_blocks_counted() may decode ahead of the handler. Each one is a few MiB once decoded.
+static const size_t DECODE_BLOCKS_IN_FLIGHT_PER_THREAD = 4;
+
+// Shared by the extract_some_* tools, so that benchmark_extract.py can run all of them on the same input:
+//     ./extract_some_… [INPUT_FILENAME [MODULO]]
+// Without arguments, the tools keep using their compiled-in defaults.
+struct ExtractArgs {
+    const char* input_filename;
+    osmium::object_id_type modulo;
+};
+
+static ExtractArgs parse_extract_args(int argc, char const* const* argv, const char* default_input_filename, osmium::object_id_type default_modulo) {
+    if (argc > 3) {
+        printf("Usage: %s [INPUT_FILENAME [MODULO]]\n", argv[0]);
+        exit(1);
+    }
+    ExtractArgs args {default_input_filename, default_modulo};
+    if (argc > 1) {
+        args.input_filename = argv[1];
+    }
+    if (argc > 2) {
+        char* end = nullptr;
+        args.modulo = strtoull(argv[2], &end, 10);
+        if (*end != '\0' || args.modulo == 0) {
+            printf("Modulo must be a positive number, not '%s'?!\n", argv[2]);
+            exit(1);
+        }
+    }
+    return args;
+}
+
+// Work counters that are comparable across all strategies. "Blocks decoded" counts every block that was
+// decompressed, whether by a sequential pass or by a random access, and "bytes read" is the compressed size.
+struct ExtractCounters {
+    std::atomic<size_t> blocks_decoded {0};
+    std::atomic<size_t> bytes_read {0};
+
+    void add_block(size_t compressed_bytes) {
+        blocks_decoded += 1;
+        bytes_read += compressed_bytes;
+    }
+
+    // The benchmark script looks for exactly this line, so keep it on one line and valid JSON.
+    void print() const {
+        printf("# BENCHMARK {\"blocks_decoded\": %lu, \"bytes_read\": %lu}\n", blocks_decoded.load(), bytes_read.load());
+    }
+};
+
+// Like osmium::apply(reader, handler), but counts the work. The PBF reader hands out one buffer per block
+// that contains wanted objects. It decompresses the other blocks too, but those never show up here,
+// so this undercounts a bit. The bytes are exact, because the reader reads the whole file anyway.
+template <typename THandler>
+void apply_counted(osmium::io::Reader& reader, THandler& handler, ExtractCounters& counters) {
+    while (osmium::memory::Buffer buffer = reader.read()) {
+        counters.blocks_decoded += 1;
+        osmium::apply(buffer, handler);
+    }
+    counters.bytes_read += reader.offset();
+}
+
+// Like apply_counted(), but only over the given blocks, e.g. from selected_blocks() in selection.hpp.
+// The blocks are decoded on the pool and handed to the handler in the given order, so with ascending
+// block indices the handler still sees everything sorted like the file. This counts exactly.
+template <typename THandler>
+void apply_blocks_counted(PbfBlockIndex const& index, std::vector<size_t> const& blocks, osmium::osm_entity_bits::type read_types, THandler& handler, ExtractCounters& counters) {
+    printf("# Decoding only %lu of %lu blocks …\n", blocks.size(), index.size());
+    osmium::thread::Pool& pool = osmium::thread::Pool::default_instance();
+    size_t max_in_flight = pool.num_threads() * DECODE_BLOCKS_IN_FLIGHT_PER_THREAD;
+    std::deque<std::future<osmium::memory::Buffer>> in_flight;
+    auto consume_front = [&in_flight, &handler](){
+        osmium::memory::Buffer buffer = in_flight.front().get();
+        in_flight.pop_front();
+        osmium::apply(buffer, handler);
+    };
+    for (size_t block_index : blocks) {
+        while (in_flight.size() >= max_in_flight) {
+            consume_front();
+        }
+        counters.add_block(index.block(block_index).datasize);
+        in_flight.push_back(pool.submit([&index, block_index, read_types](){
+            return PbfBlockIndex::decode_blob(index.read_blob(block_index), read_types, osmium::io::read_meta::no);
+        }));
+    }
+    while (!in_flight.empty()) {
+        consume_front();
+    }
+}
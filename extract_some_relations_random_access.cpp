@@ -1,132 +1,98 @@
 #include <cassert>
 #include <cstdio>
+#include <functional>
 
 #include <osmium/io/pbf_input.hpp>
-#include <osmium/io/pbf_input_randomaccess.hpp>
 #include <osmium/io/reader.hpp>
 #include <osmium/handler.hpp>
 #include <osmium/visitor.hpp>
 
+#include "extract_benchmark.hpp"
+#include "memoized_resolver.hpp"
+#include "pbf_block_index.hpp"
+#include "selection.hpp"
+
 static const char* const INPUT_FILENAME = "/scratch/osm/planet-231002.osm.pbf"; // 72 GiB, 11 million relations
 // Out of 11 million relations, want to capture roughly 110. That means 1 in 100 000. Choose closest prime for fun.
 static const osmium::object_id_type ANALYZE_WAY_MODULO = 100'003;
 
-static bool is_selected(osmium::object_id_type id) {
-    return id % ANALYZE_WAY_MODULO == 0;
-}
+using Selection = TypeModuloSelection<osmium::item_type::relation>;
 
 class RareObjectLocator : public osmium::handler::Handler {
 public:
-    explicit RareObjectLocator(osmium::io::PbfBlockIndexTable& table)
-        : m_table(table)
+    RareObjectLocator(Selection const& selection, PbfBlockIndex const& index, ExtractCounters& counters)
+        : m_selection(selection)
+        , m_index(index)
+        , m_counters(counters)
+        , m_resolver(m_memo, [this](osmium::item_type type, osmium::object_id_type id, auto&& callback){
+            this->visit_object(type, id, callback);
+        })
     {
     }
 
     void relation(const osmium::Relation& relation) {
-        if (!is_selected(relation.id()))
+        if (!is_selected(m_selection, relation))
             return;
         printf("# r%lu\n", relation.id());
-        osmium::Location loc = resolve(relation);
+        osmium::Location loc = m_resolver.resolve(relation);
         printf("r%lu x%d y%d\n", relation.id(), loc.x(), loc.y());
     }
 
-private:
-    osmium::Location resolve(const osmium::Relation& relation) {
-        for (auto const& memberref : relation.members()) {
-            osmium::Location loc = resolve_id(memberref.type(), memberref.ref());
-            if (loc)
-                return loc;
-        }
-        return osmium::Location();
+    void print_stats() {
+        m_resolver.stats().print(m_memo);
     }
 
-    osmium::Location resolve(const osmium::Way& way) {
-        for (auto const& noderef : way.nodes()) {
-            osmium::Location loc = resolve_id(osmium::item_type::node, noderef.ref());
-            if (loc)
-                return loc;
-        }
-        return osmium::Location();
-    }
+private:
+    using VisitObject = std::function<void(osmium::item_type, osmium::object_id_type, std::function<void(osmium::OSMObject const&)> const&)>;
 
-    osmium::Location resolve_id(osmium::item_type type, const osmium::object_id_type id) {
+    void visit_object(osmium::item_type type, const osmium::object_id_type id, std::function<void(osmium::OSMObject const&)> const& callback) {
         printf("# -> %c%lu\n", osmium::item_type_to_char(type), id);
-        auto buffers = m_table.binary_search_object(type, id, osmium::io::read_meta::no);
-        for (auto buf_it = buffers.rbegin(); buf_it != buffers.rend(); ++buf_it) {
-            const auto& buffer = *buf_it;
-            for (auto it = buffer->begin<osmium::OSMObject>(); it != buffer->end<osmium::OSMObject>(); ++it) {
-                if (it->type() != type) {
-                    // TODO: Exploit order on object types?
-                    continue;
-                }
-                if (it->id() > id) {
-                    // Exploit the fact that early IDs come first, so we immediately know that we're behind where the needle would have been.
-                    printf("# UNRESOLVED LATE? %c%lu\n", osmium::item_type_to_char(type), id);
-                    return osmium::Location();
-                }
-                if (it->id() == id) {
-                    switch (type) {
-                    case osmium::item_type::node:
-                        printf("# @ n%lu\n", it->id());
-                        return static_cast<osmium::Node&>(*it).location();
-                    case osmium::item_type::way:
-                        return resolve(static_cast<osmium::Way&>(*it));
-                    case osmium::item_type::relation:
-                        return resolve(static_cast<osmium::Relation&>(*it));
-                    default:
-                        printf("Object %c%lu has weird item type %u?!\n", osmium::item_type_to_char(type), id, static_cast<uint16_t>(type));
-                        return osmium::Location();
-                    }
-                }
+        size_t block_index = m_index.find_block(type, id);
+        if (block_index == m_index.size()) {
+            // Not even in the range of any block, so no need to decode anything.
+            printf("# UNRESOLVED NOFIND? %c%lu\n", osmium::item_type_to_char(type), id);
+            return;
+        }
+        auto buffer = m_index.decode_block(block_index, osmium::io::read_meta::no);
+        m_counters.add_block(m_index.block(block_index).datasize);
+        for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+            if (object_key_less(it->type(), it->id(), type, id)) {
+                continue;
             }
+            if (it->type() != type || it->id() > id) {
+                // Exploit the fact that objects are sorted by type and then ID, so we immediately know that we're behind where the needle would have been.
+                printf("# UNRESOLVED LATE? %c%lu\n", osmium::item_type_to_char(type), id);
+                return;
+            }
+            if (type == osmium::item_type::node) {
+                printf("# @ n%lu\n", it->id());
+            }
+            callback(*it);
+            return;
         }
         printf("# UNRESOLVED NOFIND? %c%lu\n", osmium::item_type_to_char(type), id);
-        return osmium::Location();
     }
 
-    osmium::io::PbfBlockIndexTable& m_table;
+    Selection const& m_selection;
+    PbfBlockIndex const& m_index;
+    ExtractCounters& m_counters;
+    LocationMemo m_memo;
+    MemoizedResolver<VisitObject> m_resolver;
 };
 
-int main() {
-    printf("# Running on %s …\n", INPUT_FILENAME);
-    osmium::io::PbfBlockIndexTable table {INPUT_FILENAME};
-    printf("# File has %lu blocks.\n", table.block_starts().size());
-
-
-    // for (size_t i = 27792; i < 27794 + 1; ++i) {
-    //     auto reversed_buffers = table.get_parsed_block(i, osmium::io::read_meta::no);
-    //     auto lastbuf_firstobj = (*reversed_buffers.begin())->begin<osmium::OSMObject>();
-    //     auto firstbuf_firstobj = (*reversed_buffers.rbegin())->begin<osmium::OSMObject>();
-    //     printf(
-    //         "Page %lu has buffers %c%lu...??? until buffer %c%lu...???\n", i,
-    //         osmium::item_type_to_char(firstbuf_firstobj->type()), firstbuf_firstobj->id(),
-    //         osmium::item_type_to_char(lastbuf_firstobj->type()), lastbuf_firstobj->id()
-    //     );
-    // }
-    // {
-    //     printf("Now looking for w33665256...\n");
-    //     auto reversed_buffers = table.binary_search_object(osmium::item_type::way, 33665256, osmium::io::read_meta::no);
-    //     auto lastbuf_firstobj = (*reversed_buffers.begin())->begin<osmium::OSMObject>();
-    //     auto firstbuf_firstobj = (*reversed_buffers.rbegin())->begin<osmium::OSMObject>();
-    //     printf(
-    //         "Found page has buffers %c%lu...??? until buffer %c%lu...???\n",
-    //         osmium::item_type_to_char(firstbuf_firstobj->type()), firstbuf_firstobj->id(),
-    //         osmium::item_type_to_char(lastbuf_firstobj->type()), lastbuf_firstobj->id()
-    //     );
-    // }
-    // {
-    //     RareObjectLocator rare_object_locator {table};
-    //     rare_object_locator.hack();
-    // }
-    // exit(42);
-
-
-    RareObjectLocator rare_object_locator {table};
-    osmium::io::Reader reader{INPUT_FILENAME, osmium::osm_entity_bits::relation};
-    osmium::apply(reader, rare_object_locator);
-    reader.close();
-
-    printf("# Done iterating.\n");
+int main(int argc, char** argv) {
+    ExtractArgs args = parse_extract_args(argc, argv, INPUT_FILENAME, ANALYZE_WAY_MODULO);
+    Selection selection = type_modulo_selection<osmium::item_type::relation>(args.modulo);
+    ExtractCounters counters;
+    printf("# Running on %s …\n", args.input_filename);
+    PbfBlockIndex index {args.input_filename};
+    printf("# File has %lu blocks%s.\n", index.size(), index.loaded_from_sidecar() ? " (index loaded from sidecar)" : "");
+    RareObjectLocator rare_object_locator {selection, index, counters};
+    apply_blocks_counted(index, selected_blocks(index, selection), Selection::entity_bits, rare_object_locator, counters);
+    rare_object_locator.print_stats();
+
+    printf("# Done iterating. %lu lookups were answered by the Bloom filters alone.\n", index.bloom_rejections());
+    counters.print();
     return 0;
 }
 
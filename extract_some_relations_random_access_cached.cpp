@@ -1,112 +1,224 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
+#include <functional>
+#include <vector>
 
 #include <osmium/io/pbf_input.hpp>
-#include <osmium/io/pbf_input_randomaccess.hpp>
 #include <osmium/io/reader.hpp>
 #include <osmium/handler.hpp>
 #include <osmium/visitor.hpp>
 
+#include "cached_indexed_pbf.hpp"
+#include "extract_benchmark.hpp"
+#include "memoized_resolver.hpp"
+#include "parallel_for.hpp"
+#include "selection.hpp"
+
 static const char* const INPUT_FILENAME = "/scratch/osm/planet-231002.osm.pbf"; // 72 GiB, 11 million relations
 // Out of 11 million relations, want to capture roughly 110. That means 1 in 100 000. Choose closest prime for fun.
 static const osmium::object_id_type ANALYZE_WAY_MODULO = 100'003;
 
-static bool is_selected(osmium::object_id_type id) {
-    return id % ANALYZE_WAY_MODULO == 0;
-}
+enum class ResolveMode {
+    // Resolve each relation member by member as soon as it is read, and trace every lookup.
+    Serial,
+    // Collect all selected relations first, and then resolve them level by level, with one batched lookup per level.
+    Batched,
+    // Collect all selected relations first, and then resolve them member by member on a pool of worker threads.
+    // The workers share the block cache, so independent lookups decode in parallel.
+    Parallel,
+};
+static const ResolveMode RESOLVE_MODE = ResolveMode::Parallel;
+// 0 means one per core.
+static const size_t RESOLVER_THREADS = 0;
+// Batched mode resolves level by level, so it can't see cycles directly. Stop at this depth instead.
+static const size_t MAX_BATCH_DEPTH = 64;
+// Size this per machine. If the stats at the end show many evictions, the cache thrashes.
+static const size_t BLOCK_CACHE_BUDGET_BYTES = size_t{8} << 30;
+
+using Selection = TypeModuloSelection<osmium::item_type::relation>;
 
 class RareObjectLocator : public osmium::handler::Handler {
 public:
-    explicit RareObjectLocator(osmium::io::CachedRandomAccessPbf& resolver)
-        : m_resolver(resolver)
+    RareObjectLocator(Selection const& selection, CachedIndexedPbf& resolver)
+        : m_selection(selection)
+        , m_resolver(resolver)
+        , m_serial_resolver(make_memoized_resolver())
     {
     }
 
     void relation(const osmium::Relation& relation) {
-        if (!is_selected(relation.id()))
+        if (!is_selected(m_selection, relation))
             return;
+        if (RESOLVE_MODE != ResolveMode::Serial) {
+            m_selected.add_item(relation);
+            m_selected.commit();
+            return;
+        }
         printf("# r%lu\n", relation.id());
-        osmium::Location loc = resolve(relation);
+        osmium::Location loc = m_serial_resolver.resolve(relation);
         printf("r%lu x%d y%d\n", relation.id(), loc.x(), loc.y());
     }
 
+    // Does nothing in serial mode, because then everything was already resolved while reading.
+    void resolve_selected() {
+        std::vector<osmium::OSMObject const*> relations;
+        for (auto it = m_selected.begin<osmium::Relation>(); it != m_selected.end<osmium::Relation>(); ++it) {
+            relations.push_back(&*it);
+        }
+        std::vector<osmium::Location> locs;
+        if (RESOLVE_MODE == ResolveMode::Batched) {
+            printf("# Resolving %lu relations in batches …\n", relations.size());
+            locs = resolve_batch(relations, 0);
+        } else {
+            printf("# Resolving %lu relations in parallel …\n", relations.size());
+            locs.resize(relations.size());
+            // A resolver tracks the recursion path of one relation, so each relation gets its own. They all
+            // share m_memo, so members that several relations have in common are only resolved once.
+            std::vector<ResolverStats> stats(relations.size());
+            parallel_for(relations.size(), RESOLVER_THREADS, [this, &relations, &locs, &stats](size_t i){
+                MemoizedResolver<VisitObject> resolver = make_memoized_resolver();
+                locs[i] = resolver.resolve(*relations[i]);
+                stats[i] = resolver.stats();
+            });
+            for (ResolverStats const& relation_stats : stats) {
+                m_parallel_stats.add(relation_stats);
+            }
+        }
+        for (size_t i = 0; i < relations.size(); ++i) {
+            printf("r%lu x%d y%d\n", relations[i]->id(), locs[i].x(), locs[i].y());
+        }
+    }
+
+    void print_stats() {
+        if (RESOLVE_MODE == ResolveMode::Batched) {
+            // Batched mode has no memo, it looks up every level at once.
+            printf("# Resolver: batched, max recursion depth %lu\n", m_batch_max_depth);
+            return;
+        }
+        ResolverStats stats = m_serial_resolver.stats();
+        stats.add(m_parallel_stats);
+        stats.print(m_memo);
+    }
+
 private:
-    osmium::Location resolve(const osmium::Relation& relation) {
-        for (auto const& memberref : relation.members()) {
-            osmium::Location loc;
-            printf("# -> %c%lu\n", osmium::item_type_to_char(memberref.type()), memberref.ref());
-            m_resolver.visit_object(
-                memberref.type(),
-                memberref.ref(),
-                [&](osmium::OSMObject const& object){
-                    loc = resolve(object);
+    // Resolves all objects at once: One batched lookup for all their members (or nodes), and then
+    // one recursive call for all of those members that are ways or relations themselves.
+    // Like the serial version, each object gets the location of its first resolvable member.
+    std::vector<osmium::Location> resolve_batch(std::vector<osmium::OSMObject const*> const& objects, size_t depth) {
+        m_batch_max_depth = std::max(m_batch_max_depth, depth);
+        if (depth >= MAX_BATCH_DEPTH) {
+            // Real relation hierarchies are a handful of levels deep, so this is a cycle.
+            printf("# Giving up on %lu objects at level %lu, probably a relation cycle\n", objects.size(), depth);
+            return std::vector<osmium::Location>(objects.size());
+        }
+        std::vector<ObjectRequest> requests;
+        std::vector<size_t> first_request_of;
+        for (osmium::OSMObject const* object : objects) {
+            first_request_of.push_back(requests.size());
+            if (object->type() == osmium::item_type::way) {
+                for (auto const& noderef : static_cast<osmium::Way const*>(object)->nodes()) {
+                    requests.push_back({osmium::item_type::node, noderef.ref()});
                 }
-            );
-            if (loc)
-                return loc;
+            } else if (object->type() == osmium::item_type::relation) {
+                for (auto const& memberref : static_cast<osmium::Relation const*>(object)->members()) {
+                    requests.push_back({memberref.type(), memberref.ref()});
+                }
+            }
         }
-        return osmium::Location();
-    }
+        first_request_of.push_back(requests.size());
+        printf("# Level %lu: %lu objects need %lu lookups\n", depth, objects.size(), requests.size());
+
+        static const size_t NOT_FOUND = static_cast<size_t>(-1);
+        std::vector<size_t> found_offsets(requests.size(), NOT_FOUND);
+        osmium::memory::Buffer found {1024 * 1024};
+        m_resolver.visit_objects(requests, [&](size_t request_index, osmium::OSMObject const& object){
+            found_offsets[request_index] = found.committed();
+            found.add_item(object);
+            found.commit();
+        });
 
-    osmium::Location resolve(const osmium::Way& way) {
-        for (auto const& noderef : way.nodes()) {
-            printf("# -> n%lu\n", noderef.ref());
-            osmium::Location loc;
-            m_resolver.visit_node(
-                noderef.ref(),
-                [&](osmium::Node const& node){
-                    printf("# @ n%lu\n", node.id());
-                    loc = node.location();
+        std::vector<osmium::Location> request_locs(requests.size());
+        std::vector<osmium::OSMObject const*> nested;
+        std::vector<size_t> nested_request_index;
+        for (size_t request_index = 0; request_index < requests.size(); ++request_index) {
+            if (found_offsets[request_index] == NOT_FOUND) {
+                printf("# UNRESOLVED %c%lu\n", osmium::item_type_to_char(requests[request_index].type), requests[request_index].id);
+                continue;
+            }
+            auto const& object = found.get<osmium::OSMObject>(found_offsets[request_index]);
+            if (object.type() == osmium::item_type::node) {
+                request_locs[request_index] = static_cast<osmium::Node const&>(object).location();
+            } else {
+                nested.push_back(&object);
+                nested_request_index.push_back(request_index);
+            }
+        }
+        if (!nested.empty()) {
+            std::vector<osmium::Location> nested_locs = resolve_batch(nested, depth + 1);
+            for (size_t i = 0; i < nested.size(); ++i) {
+                request_locs[nested_request_index[i]] = nested_locs[i];
+            }
+        }
+
+        std::vector<osmium::Location> locs(objects.size());
+        for (size_t i = 0; i < objects.size(); ++i) {
+            if (objects[i]->type() == osmium::item_type::node) {
+                locs[i] = static_cast<osmium::Node const*>(objects[i])->location();
+                continue;
+            }
+            for (size_t request_index = first_request_of[i]; request_index < first_request_of[i + 1]; ++request_index) {
+                if (request_locs[request_index]) {
+                    locs[i] = request_locs[request_index];
+                    break;
                 }
-            );
-            if (loc)
-                return loc;
+            }
         }
-        return osmium::Location();
+        return locs;
     }
 
-    osmium::Location resolve(osmium::OSMObject const& object) {
-        switch (object.type()) {
-        case osmium::item_type::node:
-            printf("# @ n%lu\n", object.id());
-            return static_cast<osmium::Node const&>(object).location();
-        case osmium::item_type::way:
-            return resolve(static_cast<osmium::Way const&>(object));
-        case osmium::item_type::relation:
-            return resolve(static_cast<osmium::Relation const&>(object));
-        default:
-            printf("Object %c%lu has weird item type %u?!\n", osmium::item_type_to_char(object.type()), object.id(), static_cast<uint16_t>(object.type()));
-            return osmium::Location();
-        }
+    using VisitObject = std::function<void(osmium::item_type, osmium::object_id_type, std::function<void(osmium::OSMObject const&)> const&)>;
+
+    MemoizedResolver<VisitObject> make_memoized_resolver() {
+        return MemoizedResolver<VisitObject>{m_memo, [this](osmium::item_type type, osmium::object_id_type id, std::function<void(osmium::OSMObject const&)> const& callback){
+            if (m_trace) {
+                printf("# -> %c%lu\n", osmium::item_type_to_char(type), id);
+            }
+            m_resolver.visit_object(type, id, callback);
+        }};
     }
 
-    osmium::io::CachedRandomAccessPbf& m_resolver;
+    Selection const& m_selection;
+    CachedIndexedPbf& m_resolver;
+    osmium::memory::Buffer m_selected {1024 * 1024};
+    // Interleaved traces from several threads would be useless.
+    bool m_trace {RESOLVE_MODE == ResolveMode::Serial};
+    // For the whole run, and shared by all resolvers.
+    LocationMemo m_memo;
+    // Only used in serial mode.
+    MemoizedResolver<VisitObject> m_serial_resolver;
+    ResolverStats m_parallel_stats;
+    size_t m_batch_max_depth {0};
 };
 
-int main() {
-    printf("# Running on %s …\n", INPUT_FILENAME);
-    osmium::io::PbfBlockIndexTable table {INPUT_FILENAME};
-    osmium::io::CachedRandomAccessPbf resolver {table};
-
-    // for (size_t i = 1353; i < 1355 + 1; ++i) {
-    //     osmium::OSMObject const& first_on_page = resolver.first_in_block(i);
-    //     printf("Page %lu starts with object %c%lu\n", i, osmium::item_type_to_char(first_on_page.type()), first_on_page.id());
-    // }
-    // resolver.first_in_block(1353);
-    // resolver.visit_node(
-    //     469773053,
-    //     [&](osmium::Node const& node){
-    //         printf("# the node 469773053 exists!!!!\n");
-    //     }
-    // );
-    // exit(42);
-
-    printf("# File has %lu blocks.\n", table.block_starts().size());
-    RareObjectLocator rare_object_locator {resolver};
-    osmium::io::Reader reader{INPUT_FILENAME, osmium::osm_entity_bits::relation};
-    osmium::apply(reader, rare_object_locator);
-    reader.close();
+int main(int argc, char** argv) {
+    ExtractArgs args = parse_extract_args(argc, argv, INPUT_FILENAME, ANALYZE_WAY_MODULO);
+    Selection selection = type_modulo_selection<osmium::item_type::relation>(args.modulo);
+    ExtractCounters counters;
+    printf("# Running on %s …\n", args.input_filename);
+    PbfBlockIndex index {args.input_filename};
+    CachedIndexedPbf resolver {index, BLOCK_CACHE_BUDGET_BYTES};
+
+    printf("# File has %lu blocks%s.\n", index.size(), index.loaded_from_sidecar() ? " (index loaded from sidecar)" : "");
+    RareObjectLocator rare_object_locator {selection, resolver};
+    apply_blocks_counted(index, selected_blocks(index, selection), Selection::entity_bits, rare_object_locator, counters);
+    rare_object_locator.resolve_selected();
+    rare_object_locator.print_stats();
 
     printf("# Done iterating.\n");
+    resolver.print_stats();
+    counters.blocks_decoded += resolver.decoded_blocks();
+    counters.bytes_read += resolver.stats().bytes_read;
+    counters.print();
     return 0;
 }
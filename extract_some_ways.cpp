@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <osmium/io/pbf_input.hpp>
+#include <osmium/io/reader.hpp>
+#include <osmium/visitor.hpp>
+
+#include "block_read_planner.hpp"
+#include "dense_node_lookup.hpp"
+#include "extract_benchmark.hpp"
+#include "node_location_store.hpp"
+#include "parallel_for.hpp"
+#include "pbf_block_index.hpp"
+#include "selection.hpp"
+#include "way_geometry.hpp"
+#include "way_node_merge.hpp"
+
+// Same job as extract_some_ways_linear_scan and extract_some_ways_random_access, but decides by itself which
+// way is cheaper for the given input and selectivity.
+
+static const char* const INPUT_FILENAME = "/scratch/osm/planet-231002.osm.pbf"; // 72 GiB, >600 million ways, guessing around 1134 million ways
+// Out of 1134 million objects, want to capture roughly 550. That means 1 in 2 000 000. Choose closest prime for fun.
+static const osmium::object_id_type ANALYZE_WAY_MODULO = 2'000'003;
+
+enum class Engine {
+    // Let the planner decide between Scan and CoalescedLookup.
+    Auto,
+    // Second pass over the node blocks that hold any node of the selected ways, merging against the sorted
+    // node IDs. Like extract_some_ways_linear_scan.
+    Scan,
+    // One read per needed block. Like extract_some_ways_random_access.
+    Lookup,
+    // Like Lookup, but neighbouring needed blocks are fetched in one read, gap included, if that's cheaper than
+    // seeking. Still decodes only the needed blocks, so it's random access with fewer reads, not partly a scan.
+    CoalescedLookup,
+};
+static const Engine ENGINE = Engine::Auto;
+// Overrides ENGINE with the engine of that name, e.g. "scan". The tests use it to run every engine on the same input.
+static const char* const ENGINE_ENVIRONMENT_VARIABLE = "EXTRACT_SOME_WAYS_ENGINE";
+// 0 means one per core.
+static const size_t RESOLVER_THREADS = 0;
+// Resolve every node of the selected ways instead of just the first resolvable one, and write the geometries
+// to GEOMETRY_OUTPUT_FILENAME (see way_geometry.hpp for the format), and optionally as GeoJSON.
+static const bool FULL_GEOMETRY = false;
+static const char* const GEOMETRY_OUTPUT_FILENAME = "/scratch/osm/selected_ways.geom";
+static const char* const GEOJSON_OUTPUT_FILENAME = nullptr; // e.g. "/scratch/osm/selected_ways.geo.json"
+// Opt-in: With StoreIfPresent or Store, looking nodes up in the flat store next to the input (see
+// build_node_location_store) beats every engine, so the planner isn't even asked.
+static const NodeLocationSource NODE_LOCATIONS = NodeLocationSource::Pbf;
+
+
+static const char* engine_name(Engine engine) {
+    switch (engine) {
+    case Engine::Auto:
+        return "auto";
+    case Engine::Scan:
+        return "scan";
+    case Engine::Lookup:
+        return "lookup";
+    case Engine::CoalescedLookup:
+        return "coalesced";
+    }
+    return "???";
+}
+
+static Engine configured_engine() {
+    const char* name = getenv(ENGINE_ENVIRONMENT_VARIABLE);
+    if (!name) {
+        return ENGINE;
+    }
+    for (Engine engine : {Engine::Auto, Engine::Scan, Engine::Lookup, Engine::CoalescedLookup}) {
+        if (strcmp(name, engine_name(engine)) == 0) {
+            return engine;
+        }
+    }
+    printf("Unknown engine '%s' in %s?!\n", name, ENGINE_ENVIRONMENT_VARIABLE);
+    exit(1);
+}
+
+// Resolves each way to the location of its first resolvable node, with random accesses through the index.
+// Works in rounds: Each round looks up the next node of every way that is still unresolved, so usually
+// there is only a single round, and every block is fetched at most once per round.
+class WayLocationLookup {
+public:
+    WayLocationLookup(PbfBlockIndex const& index, BlockReadPlanner const& planner, WayNodeList const& ways, ExtractCounters& counters)
+        : m_index(index)
+        , m_planner(planner)
+        , m_ways(ways)
+        , m_counters(counters)
+        , m_locs(ways.size())
+        , m_next_node(ways.size(), 0)
+    {
+    }
+    WayLocationLookup(const WayLocationLookup&) = delete;
+    WayLocationLookup(WayLocationLookup&&) = delete;
+    WayLocationLookup& operator=(const WayLocationLookup&) = delete;
+    WayLocationLookup& operator=(WayLocationLookup&&) = delete;
+
+    // The distinct blocks that the first round would need, sorted.
+    std::vector<size_t> first_round_blocks() const {
+        std::vector<size_t> blocks;
+        for (auto const& request : round_requests(all_ways())) {
+            blocks.push_back(request.first);
+        }
+        blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+        return blocks;
+    }
+
+    void run(bool coalesce) {
+        std::vector<size_t> pending = all_ways();
+        size_t round = 0;
+        while (!pending.empty()) {
+            round += 1;
+            // Sorted by block, and each way appears at most once, so the workers never write the same location.
+            std::vector<std::pair<size_t, size_t>> requests = round_requests(pending);
+            std::vector<size_t> blocks;
+            for (auto const& request : requests) {
+                blocks.push_back(request.first);
+            }
+            blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+            std::vector<BlockRead> reads = m_planner.plan(blocks, coalesce);
+            printf("# Round %lu: %lu ways, %lu blocks, %lu reads …\n", round, pending.size(), blocks.size(), reads.size());
+            parallel_for(reads.size(), m_planner.num_threads(), [this, &reads, &requests](size_t i){
+                execute(reads[i], requests);
+            });
+
+            std::vector<size_t> still_pending;
+            for (size_t way_index : pending) {
+                m_next_node[way_index] += 1;
+                if (!m_locs[way_index] && m_next_node[way_index] < m_ways.node_count(way_index)) {
+                    still_pending.push_back(way_index);
+                }
+            }
+            pending.swap(still_pending);
+        }
+        for (size_t i = 0; i < m_ways.size(); ++i) {
+            printf("w%lu x%d y%d\n", m_ways.way_id(i), m_locs[i].x(), m_locs[i].y());
+        }
+    }
+
+private:
+    std::vector<size_t> all_ways() const {
+        std::vector<size_t> way_indices;
+        for (size_t i = 0; i < m_ways.size(); ++i) {
+            if (m_ways.node_count(i) > 0) {
+                way_indices.push_back(i);
+            }
+        }
+        return way_indices;
+    }
+
+    // (block index, way index) of the next node of each of the given ways, sorted by block.
+    // Nodes that can't be in any block are left out; those ways just move on to their next node.
+    std::vector<std::pair<size_t, size_t>> round_requests(std::vector<size_t> const& way_indices) const {
+        std::vector<std::pair<size_t, size_t>> requests;
+        for (size_t way_index : way_indices) {
+            size_t block_index = m_index.find_block_range(osmium::item_type::node, next_node_id(way_index));
+            if (block_index != m_index.size()) {
+                requests.emplace_back(block_index, way_index);
+            }
+        }
+        std::sort(requests.begin(), requests.end());
+        return requests;
+    }
+
+    osmium::object_id_type next_node_id(size_t way_index) const {
+        return m_ways.node(way_index, m_next_node[way_index]);
+    }
+
+    void execute(BlockRead const& read, std::vector<std::pair<size_t, size_t>> const& requests) {
+        std::string range = m_index.read_blob_range(read.first_block, read.last_block);
+        m_counters.bytes_read += range.size();
+        for (size_t block_index : read.needed_blocks) {
+            std::string blob = m_index.blob_in_range(range, read.first_block, block_index);
+            std::string decompressed;
+            DenseNodeLookup lookup {PbfBlockIndex::decompress_blob(blob, decompressed)};
+            m_counters.blocks_decoded += 1;
+            auto it = std::lower_bound(requests.begin(), requests.end(), std::make_pair(block_index, size_t{0}));
+            for (; it != requests.end() && it->first == block_index; ++it) {
+                m_locs[it->second] = lookup.find(next_node_id(it->second));
+            }
+        }
+    }
+
+    PbfBlockIndex const& m_index;
+    BlockReadPlanner const& m_planner;
+    WayNodeList const& m_ways;
+    ExtractCounters& m_counters;
+    std::vector<osmium::Location> m_locs;
+    std::vector<size_t> m_next_node;
+};
+
+// Fills in all geometries with random accesses. The refs are sorted by node ID, so the refs of each block form
+// one contiguous range, and each block is decoded exactly once.
+class WayGeometryLookup {
+public:
+    WayGeometryLookup(PbfBlockIndex const& index, BlockReadPlanner const& planner, WayGeometries& geometries, ExtractCounters& counters)
+        : m_index(index)
+        , m_planner(planner)
+        , m_geometries(geometries)
+        , m_counters(counters)
+    {
+        auto const& refs = m_geometries.sorted_refs();
+        for (size_t i = 0; i < refs.size(); ++i) {
+            size_t block_index = m_index.find_block_range(osmium::item_type::node, refs[i].first);
+            if (block_index == m_index.size()) {
+                // Doesn't exist. If this is in the middle of a block's range, the merge just skips it.
+                continue;
+            }
+            if (m_ranges.empty() || m_ranges.back().block_index != block_index) {
+                m_ranges.push_back(RefRange{block_index, i, i + 1});
+            } else {
+                m_ranges.back().end = i + 1;
+            }
+        }
+    }
+    WayGeometryLookup(const WayGeometryLookup&) = delete;
+    WayGeometryLookup(WayGeometryLookup&&) = delete;
+    WayGeometryLookup& operator=(const WayGeometryLookup&) = delete;
+    WayGeometryLookup& operator=(WayGeometryLookup&&) = delete;
+
+    // The distinct blocks that contain any of the nodes, sorted.
+    std::vector<size_t> blocks() const {
+        std::vector<size_t> blocks;
+        for (RefRange const& range : m_ranges) {
+            blocks.push_back(range.block_index);
+        }
+        return blocks;
+    }
+
+    void run(bool coalesce) {
+        std::vector<BlockRead> reads = m_planner.plan(blocks(), coalesce);
+        printf("# Resolving %lu refs from %lu blocks in %lu reads …\n", m_geometries.sorted_refs().size(), m_ranges.size(), reads.size());
+        parallel_for(reads.size(), m_planner.num_threads(), [this, &reads](size_t i){
+            execute(reads[i]);
+        });
+    }
+
+private:
+    struct RefRange {
+        size_t block_index;
+        size_t begin;
+        size_t end;
+    };
+
+    void execute(BlockRead const& read) {
+        std::string range = m_index.read_blob_range(read.first_block, read.last_block);
+        m_counters.bytes_read += range.size();
+        for (size_t block_index : read.needed_blocks) {
+            osmium::memory::Buffer buffer = PbfBlockIndex::decode_blob(m_index.blob_in_range(range, read.first_block, block_index), osmium::osm_entity_bits::node, osmium::io::read_meta::no);
+            m_counters.blocks_decoded += 1;
+            auto it = std::lower_bound(m_ranges.begin(), m_ranges.end(), block_index, [](RefRange const& ref_range, size_t needle){
+                return ref_range.block_index < needle;
+            });
+            assert(it != m_ranges.end() && it->block_index == block_index);
+            // Different blocks have disjoint ranges, so the workers never write the same location.
+            m_geometries.merge_block(buffer, it->begin, it->end);
+        }
+    }
+
+    PbfBlockIndex const& m_index;
+    BlockReadPlanner const& m_planner;
+    WayGeometries& m_geometries;
+    ExtractCounters& m_counters;
+    std::vector<RefRange> m_ranges;
+};
+
+static Engine choose_engine(CostEstimate const& scan_cost, CostEstimate const& lookup_cost, CostEstimate const& coalesced_cost) {
+    scan_cost.print("scan");
+    lookup_cost.print("lookup");
+    coalesced_cost.print("coalesced");
+    Engine engine = configured_engine();
+    if (engine == Engine::Auto) {
+        // CoalescedLookup never costs more than Lookup, so that's the only contender.
+        engine = scan_cost.seconds() < coalesced_cost.seconds() ? Engine::Scan : Engine::CoalescedLookup;
+    }
+    printf("# Using engine %s.\n", engine_name(engine));
+    return engine;
+}
+
+static void extract_full_geometries(PbfBlockIndex const& index, NodeLocationStore const* store, BlockReadPlanner const& planner, WayNodeList const& ways, ExtractCounters& counters) {
+    printf("# Sorting %lu node refs …\n", ways.total_nodes());
+    WayGeometries geometries {ways};
+    if (store) {
+        geometries.resolve_all([store](osmium::object_id_type node_id){
+            return store->get(node_id);
+        });
+    } else {
+        WayGeometryLookup lookup {index, planner, geometries, counters};
+        std::vector<size_t> blocks = lookup.blocks();
+        printf("# Selected %lu ways, their nodes are in %lu distinct blocks.\n", ways.size(), blocks.size());
+        Engine engine = choose_engine(
+            planner.estimate_block_scan(blocks),
+            planner.estimate(planner.plan(blocks, false)),
+            planner.estimate(planner.plan(blocks, true))
+        );
+        if (engine == Engine::Scan) {
+            printf("# Second pass for nodes …\n");
+            apply_blocks_counted(index, blocks, osmium::osm_entity_bits::node, geometries, counters);
+        } else {
+            lookup.run(engine == Engine::CoalescedLookup);
+        }
+    }
+    printf("# %lu of %lu node refs are unresolved. Writing %s …\n", geometries.unresolved(), ways.total_nodes(), GEOMETRY_OUTPUT_FILENAME);
+    write_way_geometries_binary(geometries, GEOMETRY_OUTPUT_FILENAME);
+    if (GEOJSON_OUTPUT_FILENAME) {
+        printf("# Writing %s …\n", GEOJSON_OUTPUT_FILENAME);
+        write_way_geometries_geojson(geometries, GEOJSON_OUTPUT_FILENAME);
+    }
+}
+
+int main(int argc, char** argv) {
+    ExtractArgs args = parse_extract_args(argc, argv, INPUT_FILENAME, ANALYZE_WAY_MODULO);
+    auto selection = type_modulo_selection<osmium::item_type::way>(args.modulo);
+    ExtractCounters counters;
+    printf("# Running on %s …\n", args.input_filename);
+    PbfBlockIndex index {args.input_filename};
+    printf("# File has %lu blocks%s.\n", index.size(), index.loaded_from_sidecar() ? " (index loaded from sidecar)" : "");
+
+    // Every engine needs the selected ways first, so the plan can be based on exact numbers instead of guesses.
+    // The selection rules out most way blocks by their ID range alone, so those are never even read.
+    WayNodesExtractor way_nodes {selection};
+    printf("# First pass for ways …\n");
+    apply_blocks_counted(index, selected_blocks(index, selection), decltype(selection)::entity_bits, way_nodes, counters);
+    WayNodeList const& ways = way_nodes.ways();
+
+    BlockReadPlanner planner {index, RESOLVER_THREADS};
+    std::unique_ptr<NodeLocationStore> store = open_node_location_store(index, NODE_LOCATIONS);
+    if (FULL_GEOMETRY) {
+        extract_full_geometries(index, store.get(), planner, ways, counters);
+        printf("# Done iterating.\n");
+        counters.print();
+        return 0;
+    }
+    if (store) {
+        FirstLocationExtractor first_locs {way_nodes.take_ways()};
+        first_locs.resolve_all([&store](osmium::object_id_type node_id){
+            return store->get(node_id);
+        });
+        first_locs.print_locations();
+        printf("# Done iterating.\n");
+        counters.print();
+        return 0;
+    }
+
+    WayLocationLookup lookup {index, planner, ways, counters};
+    // Almost every way resolves with its first node, so the first round is a good estimate for the whole job.
+    std::vector<size_t> blocks = lookup.first_round_blocks();
+    // The merge can't stop at the first node of each way, so it needs the blocks of all of them.
+    std::vector<size_t> scan_blocks = blocks_of_nodes(index, [&ways](auto&& func){
+        for (size_t way_index = 0; way_index < ways.size(); ++way_index) {
+            ways.for_each_node(way_index, func);
+        }
+    });
+    printf("# Selected %lu ways, their first nodes are in %lu distinct blocks, all nodes in %lu.\n", ways.size(), blocks.size(), scan_blocks.size());
+    Engine engine = choose_engine(
+        planner.estimate_block_scan(scan_blocks),
+        planner.estimate(planner.plan(blocks, false)),
+        planner.estimate(planner.plan(blocks, true))
+    );
+
+    if (engine == Engine::Scan) {
+        printf("# Sorting …\n");
+        // The lookup engine isn't needed anymore, so the merge can take over the node lists.
+        FirstLocationExtractor first_locs {way_nodes.take_ways()};
+        printf("# Second pass for nodes …\n");
+        apply_blocks_counted(index, scan_blocks, osmium::osm_entity_bits::node, first_locs, counters);
+        first_locs.print_locations();
+    } else {
+        lookup.run(engine == Engine::CoalescedLookup);
+    }
+
+    printf("# Done iterating.\n");
+    counters.print();
+    return 0;
+}
@@ -1,12 +1,19 @@
-#include <cassert>
 #include <cstdio>
-#include <unordered_set>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include <osmium/io/pbf_input.hpp>
 #include <osmium/io/reader.hpp>
-#include <osmium/handler.hpp>
 #include <osmium/visitor.hpp>
 
+#include "extract_benchmark.hpp"
+#include "external_way_node_merge.hpp"
+#include "node_location_store.hpp"
+#include "pbf_block_index.hpp"
+#include "selection.hpp"
+#include "way_node_merge.hpp"
+
 static const char* const INPUT_FILENAME = "/scratch/osm/planet-231002.osm.pbf"; // 72 GiB, >600 million ways, guessing around 1134 million ways
 // Out of 1134 million objects, want to capture roughly 550. That means 1 in 2 000 000. Choose closest prime for fun.
 static const osmium::object_id_type ANALYZE_WAY_MODULO = 2'000'003;
@@ -15,171 +22,118 @@ static const osmium::object_id_type ANALYZE_WAY_MODULO = 2'000'003;
 // // Out of 63 million objects, want to capture roughly 600. That means 1 in 100 000. Choose closest prime for fun.
 // static const osmium::object_id_type ANALYZE_WAY_MODULO = 100'003;
 
-static bool is_selected(osmium::object_id_type id) {
-    return id % ANALYZE_WAY_MODULO == 0;
+// Store the node lists of the collected ways as varint deltas, at about a third of the size. That only helps
+// during the first pass, because the merge needs them uncompressed anyway.
+static const bool COMPRESS_WAY_NODES = false;
+// Only decode the blocks that can contain a selected way or an interesting node, using the block index.
+// Otherwise, both passes read and decode every way and node of the file.
+static const bool SKIP_BLOCKS = true;
+// Only with SKIP_BLOCKS, and opt-in: StoreIfPresent or Store take the node locations from the flat store next to the
+// input (see build_node_location_store) instead of the second pass. The merge still walks the interesting nodes in
+// ascending order, which keeps the lookups in the store mostly sequential.
+static const NodeLocationSource NODE_LOCATIONS = NodeLocationSource::Pbf;
+
+// Collect the (node ID, way ID) pairs into sorted runs on disk, and merge them during the node pass.
+// Use this when the selected ways don't fit into memory, e.g. all ways of a given kind on the planet.
+static const bool EXTERNAL_SORT = false;
+static const char* const SCRATCH_DIRECTORY = "/scratch/osm/tmp";
+// Roughly the memory for collecting and merging the pairs, and for sorting the locations found by way. The two
+// sorts are busy at the same time, so each gets half. Pairs and locations take 24 bytes each.
+static const size_t EXTERNAL_SORT_BUDGET_BYTES = size_t{8} << 30;
+
+using Selection = TypeModuloSelection<osmium::item_type::way>;
+
+// The first pass. With an index, only the blocks that can contain a selected way are decoded.
+template <typename THandler>
+static void way_pass(const char* input_filename, PbfBlockIndex const* index, Selection const& selection, THandler& handler, ExtractCounters& counters) {
+    if (index) {
+        apply_blocks_counted(*index, selected_blocks(*index, selection), Selection::entity_bits, handler, counters);
+        return;
+    }
+    osmium::io::Reader reader{input_filename, Selection::entity_bits};
+    apply_counted(reader, handler, counters);
+    reader.close();
 }
 
-class WayEntry {
-public:
-    WayEntry(osmium::Way const& way)
-        : m_way_id(way.id())
-    {
-        for (auto const& noderef : way.nodes()) {
-            m_node_refs.push_back(noderef.ref());
-        }
-    }
-
-    std::vector<osmium::object_id_type> const& nodes() const {
-        return m_node_refs;
-    }
-
-    osmium::object_id_type way_id() const {
-        return m_way_id;
-    }
-
-private:
-    osmium::object_id_type m_way_id;
-    std::vector<osmium::object_id_type> m_node_refs;
-};
-
-class WayNodesExtractor : public osmium::handler::Handler {
-public:
-    WayNodesExtractor() {
-    }
-
-    void way(const osmium::Way& way) {
-        if (!is_selected(way.id()))
-            return;
-        m_way_entries.emplace_back(way);
-    }
-
-    //void relation(const osmium::Relation& relation) {
-    //    ???
-    //    Note that resolving relations this way will take at
-    //    least three passes, and potentially dozens.
-    //}
-
-    std::vector<WayEntry> const& way_entries() const {
-        return m_way_entries;
-    }
-
-    void clear() {
-        m_way_entries.clear();
-    }
-
-private:
-    std::vector<WayEntry> m_way_entries;
-};
-
-enum class NodeRelation {
-    Before,
-    Equal,
-    After,
-};
-
-class InterestingNode {
-public:
-    InterestingNode(osmium::object_id_type node_id, osmium::object_id_type way_id)
-        : m_node_id(node_id)
-        , m_way_id(way_id)
-    {
-    }
-
-    osmium::object_id_type node_id() const {
-        return m_node_id;
-    }
-
-    osmium::object_id_type way_id() const {
-        return m_way_id;
-    }
-
-    NodeRelation relative_to(osmium::object_id_type other_node_id) const {
-        if (m_node_id < other_node_id) {
-            return NodeRelation::Before;
-        }
-        if (m_node_id == other_node_id) {
-            return NodeRelation::Equal;
-        }
-        if (m_node_id > other_node_id) {
-            return NodeRelation::After;
-        }
-        assert(false);
-    }
-
-    bool operator<(InterestingNode const& other) const {
-        return m_node_id > other.m_node_id;
-    }
-
-private:
-    osmium::object_id_type m_node_id;
-    osmium::object_id_type m_way_id;
-};
+// The second pass without an index. With one, only the blocks that the merge can possibly care about are decoded,
+// still in file order, so it sees all relevant nodes sorted by ID. Interesting nodes in skipped blocks don't exist,
+// and the merge drops them just like before.
+template <typename THandler>
+static void full_node_pass(const char* input_filename, THandler& handler, ExtractCounters& counters) {
+    osmium::io::Reader reader{input_filename, osmium::osm_entity_bits::node};
+    apply_counted(reader, handler, counters);
+    reader.close();
+}
 
-class FirstLocationExtractor : public osmium::handler::Handler {
-public:
-    FirstLocationExtractor(std::vector<WayEntry> const& way_entries) {
-        for (auto const& way_entry : way_entries) {
-            for (osmium::object_id_type node_id : way_entry.nodes()) {
-                m_interesting_nodes.emplace_back(node_id, way_entry.way_id());
-            }
+static void extract_in_memory(const char* input_filename, PbfBlockIndex const* index, NodeLocationStore const* store, Selection const& selection, ExtractCounters& counters) {
+    WayNodesExtractor way_nodes {selection, COMPRESS_WAY_NODES};
+    printf("# First pass for ways on %s …\n", input_filename);
+    way_pass(input_filename, index, selection, way_nodes, counters);
+    printf("# Collected %lu ways with %lu nodes in %lu bytes.\n", way_nodes.ways().size(), way_nodes.ways().total_nodes(), way_nodes.ways().used_bytes());
+    printf("# Sorting …\n");
+    FirstLocationExtractor first_locs {way_nodes.take_ways()};
+    if (store) {
+        printf("# Looking up nodes …\n");
+        first_locs.resolve_all([store](osmium::object_id_type node_id){
+            return store->get(node_id);
+        });
+    } else {
+        printf("# Second pass for nodes on %s …\n", input_filename);
+        if (index) {
+            std::vector<size_t> blocks = blocks_of_nodes(*index, [&first_locs](auto&& func){
+                first_locs.for_each_interesting_node_id(func);
+            });
+            apply_blocks_counted(*index, blocks, osmium::osm_entity_bits::node, first_locs, counters);
+        } else {
+            full_node_pass(input_filename, first_locs, counters);
         }
-        // Note that this ends up sorting in order DESCENDING by node ID:
-        std::sort(m_interesting_nodes.begin(), m_interesting_nodes.end());
-        assert(m_interesting_nodes.size() >= 2);
-        assert(m_interesting_nodes[0].node_id() >= m_interesting_nodes[1].node_id());
     }
+    first_locs.print_locations();
+}
 
-    void node(const osmium::Node& node) {
-        while (!m_interesting_nodes.empty()) {
-            switch (m_interesting_nodes.back().relative_to(node.id())) {
-            case NodeRelation::Before:
-                // The current interesting node is not in the dataset. Remove it,
-                // and try the next InterestingNode.
-                m_interesting_nodes.pop_back();
-                break; // … from the switch block, not the loop.
-            case NodeRelation::Equal: {
-                // The current interesting node is encountered in the dataset.
-                // Maybe emit it, go to the next InterestingNode, and make sure we
-                // don't emit anything again for this Way.
-                osmium::object_id_type way = m_interesting_nodes.back().way_id();
-                if (m_emitted_ways.count(way) == 0) {
-                    m_emitted_ways.emplace(way);
-                    auto loc = node.location();
-                    printf("w%lu x%d y%d\n", way, loc.x(), loc.y());
-                }
-                m_interesting_nodes.pop_back();
-                return;
-            }
-            case NodeRelation::After:
-                // The encountered node is definitely not interesting.
-                return;
-            }
+static void extract_external(const char* input_filename, PbfBlockIndex const* index, NodeLocationStore const* store, Selection const& selection, ExtractCounters& counters) {
+    SpillingNodeWaySorter sorter {SCRATCH_DIRECTORY, "way_nodes", EXTERNAL_SORT_BUDGET_BYTES / 2};
+    SpillingWayLocationSorter locations {SCRATCH_DIRECTORY, "way_locations", EXTERNAL_SORT_BUDGET_BYTES / 2};
+    // With a store, there is no node pass, so there's no need to remember the blocks for it.
+    ExternalWayNodesExtractor way_nodes {selection, sorter, locations, store ? nullptr : index};
+    printf("# First pass for ways on %s, spilling to %s …\n", input_filename, SCRATCH_DIRECTORY);
+    way_pass(input_filename, index, selection, way_nodes, counters);
+    printf("# Collected %lu ways …\n", way_nodes.ways());
+    sorter.finish();
+    ExternalFirstLocationExtractor first_locs {sorter, locations, way_nodes.max_way_id()};
+    if (store) {
+        printf("# Looking up nodes …\n");
+        first_locs.resolve_all([store](osmium::object_id_type node_id){
+            return store->get(node_id);
+        });
+    } else {
+        printf("# Second pass for nodes on %s …\n", input_filename);
+        if (index) {
+            apply_blocks_counted(*index, way_nodes.needed_blocks(), osmium::osm_entity_bits::node, first_locs, counters);
+        } else {
+            full_node_pass(input_filename, first_locs, counters);
         }
     }
+    first_locs.print_locations();
+}
 
-private:
-    std::vector<InterestingNode> m_interesting_nodes;
-    std::unordered_set<osmium::object_id_type> m_emitted_ways;
-};
-
-int main() {
-    WayNodesExtractor way_nodes;
-    printf("# First pass for ways on %s …\n", INPUT_FILENAME);
-    {
-        osmium::io::Reader reader{INPUT_FILENAME, osmium::osm_entity_bits::way};
-        osmium::apply(reader, way_nodes);
-        reader.close();
-    }
-    printf("# Sorting …\n");
-    FirstLocationExtractor first_locs {way_nodes.way_entries()};
-    way_nodes.clear();
-    printf("# Second pass for nodes on %s …\n", INPUT_FILENAME);
-    {
-        osmium::io::Reader reader{INPUT_FILENAME, osmium::osm_entity_bits::node};
-        osmium::apply(reader, first_locs);
-        reader.close();
+int main(int argc, char** argv) {
+    ExtractArgs args = parse_extract_args(argc, argv, INPUT_FILENAME, ANALYZE_WAY_MODULO);
+    Selection selection = type_modulo_selection<osmium::item_type::way>(args.modulo);
+    ExtractCounters counters;
+    std::unique_ptr<PbfBlockIndex> index;
+    std::unique_ptr<NodeLocationStore> store;
+    if (SKIP_BLOCKS) {
+        index = std::make_unique<PbfBlockIndex>(args.input_filename);
+        store = open_node_location_store(*index, NODE_LOCATIONS);
+    }
+    if (EXTERNAL_SORT) {
+        extract_external(args.input_filename, index.get(), store.get(), selection, counters);
+    } else {
+        extract_in_memory(args.input_filename, index.get(), store.get(), selection, counters);
     }
     printf("# Done iterating.\n");
+    counters.print();
     return 0;
 }
 
@@ -0,0 +1,86 @@
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include <osmium/io/pbf_input.hpp>
+#include <osmium/handler.hpp>
+#include <osmium/visitor.hpp>
+
+#include "extract_benchmark.hpp"
+#include "node_location_store.hpp"
+#include "parallel_for.hpp"
+#include "pbf_block_index.hpp"
+#include "selection.hpp"
+
+// Like extract_some_ways_random_access, but always takes the node locations from the flat store next to the
+// input (see build_node_location_store), and never decodes a node block. If the store is missing or stale,
+// the first run builds it, which costs one pass over all nodes.
+
+static const char* const INPUT_FILENAME = "/scratch/osm/planet-231002.osm.pbf";
+static const osmium::object_id_type ANALYZE_WAY_MODULO = 2'000'003;
+
+// 0 means one per core.
+static const size_t RESOLVER_THREADS = 0;
+
+using Selection = TypeModuloSelection<osmium::item_type::way>;
+
+class SelectedWayCollector : public osmium::handler::Handler {
+public:
+    explicit SelectedWayCollector(Selection const& selection)
+        : m_selection(selection)
+    {
+    }
+
+    void way(const osmium::Way& way) {
+        if (!is_selected(m_selection, way))
+            return;
+        m_selected.add_item(way);
+        m_selected.commit();
+    }
+
+    void resolve_selected(NodeLocationStore const& store) {
+        std::vector<osmium::Way const*> ways;
+        for (auto it = m_selected.begin<osmium::Way>(); it != m_selected.end<osmium::Way>(); ++it) {
+            ways.push_back(&*it);
+        }
+        // The store is read-only once mapped, so the workers can share it without locking.
+        std::vector<osmium::Location> locs(ways.size());
+        parallel_for(ways.size(), RESOLVER_THREADS, [&store, &ways, &locs](size_t i){
+            for (auto const& noderef : ways[i]->nodes()) {
+                osmium::Location loc = store.get(noderef.ref());
+                if (loc) {
+                    locs[i] = loc;
+                    break;
+                }
+            }
+        });
+        for (size_t i = 0; i < ways.size(); ++i) {
+            printf("w%lu x%d y%d\n", ways[i]->id(), locs[i].x(), locs[i].y());
+        }
+    }
+
+private:
+    Selection const& m_selection;
+    osmium::memory::Buffer m_selected {1024 * 1024};
+};
+
+int main(int argc, char** argv) {
+    ExtractArgs args = parse_extract_args(argc, argv, INPUT_FILENAME, ANALYZE_WAY_MODULO);
+    Selection selection = type_modulo_selection<osmium::item_type::way>(args.modulo);
+    ExtractCounters counters;
+    printf("# Running on %s …\n", args.input_filename);
+    PbfBlockIndex index {args.input_filename};
+    printf("# File has %lu blocks%s.\n", index.size(), index.loaded_from_sidecar() ? " (index loaded from sidecar)" : "");
+    std::unique_ptr<NodeLocationStore> store = open_node_location_store(index, NodeLocationSource::Store);
+    if (!store) {
+        printf("Cannot open or build the node location store?!\n");
+        return 1;
+    }
+    SelectedWayCollector collector {selection};
+    apply_blocks_counted(index, selected_blocks(index, selection), Selection::entity_bits, collector, counters);
+    collector.resolve_selected(*store);
+
+    printf("# Done iterating.\n");
+    counters.print();
+    return 0;
+}
@@ -1,12 +1,21 @@
 #include <cassert>
 #include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include <osmium/io/pbf_input.hpp>
-#include <osmium/io/pbf_input_randomaccess.hpp>
 #include <osmium/io/reader.hpp>
 #include <osmium/handler.hpp>
 #include <osmium/visitor.hpp>
 
+#include "dense_node_lookup.hpp"
+#include "extract_benchmark.hpp"
+#include "node_location_store.hpp"
+#include "parallel_for.hpp"
+#include "pbf_block_index.hpp"
+#include "selection.hpp"
+
 static const char* const INPUT_FILENAME = "/scratch/osm/planet-231002.osm.pbf"; // 72 GiB, >600 million ways, guessing around 1134 million ways
 // Out of 1134 million objects, want to capture roughly 550. That means 1 in 2 000 000. Choose closest prime for fun.
 static const osmium::object_id_type ANALYZE_WAY_MODULO = 2'000'003;
@@ -15,30 +24,55 @@ static const osmium::object_id_type ANALYZE_WAY_MODULO = 2'000'003;
 // // Out of 63 million objects, want to capture roughly 600. That means 1 in 100 000. Choose closest prime for fun.
 // static const osmium::object_id_type ANALYZE_WAY_MODULO = 100'003;
 
-static bool is_selected(osmium::object_id_type id) {
-    return id % ANALYZE_WAY_MODULO == 0;
-}
+// Collect all selected ways first, and then resolve them on a pool of worker threads.
+// Otherwise, resolve each way as soon as it is read.
+static const bool RESOLVE_IN_PARALLEL = true;
+// 0 means one per core.
+static const size_t RESOLVER_THREADS = 0;
+// StoreIfPresent or Store: Look up node locations in the flat store next to the input (see build_node_location_store)
+// instead of decoding blocks. Opt-in, so that this stays the random access strategy; extract_some_ways_node_store
+// is the one that always uses the store.
+static const NodeLocationSource NODE_LOCATIONS = NodeLocationSource::Pbf;
+
+using Selection = TypeModuloSelection<osmium::item_type::way>;
 
 class RareObjectLocator : public osmium::handler::Handler {
 public:
-    explicit RareObjectLocator(osmium::io::PbfBlockIndexTable& table)
-        : m_table(table)
+    RareObjectLocator(Selection const& selection, PbfBlockIndex const& index, NodeLocationStore const* store, ExtractCounters& counters)
+        : m_selection(selection)
+        , m_index(index)
+        , m_store(store)
+        , m_counters(counters)
     {
     }
 
     void way(const osmium::Way& way) {
-        if (!is_selected(way.id()))
+        if (!is_selected(m_selection, way))
             return;
+        if (RESOLVE_IN_PARALLEL) {
+            m_selected.add_item(way);
+            m_selected.commit();
+            return;
+        }
         osmium::Location loc = resolve_way(way);
         printf("w%lu x%d y%d\n", way.id(), loc.x(), loc.y());
     }
 
-    //void relation(const osmium::Relation& relation) {
-    //    if (!is_selected(relation.id))
-    //        return;
-    //    osmium::location loc = resolve_relation(relation);
-    //    printf("r%lu x%d y%d\n", relation.id(), loc.x(), loc.y());
-    //}
+    // Does nothing in serial mode, because then everything was already resolved while reading.
+    void resolve_selected() {
+        std::vector<osmium::Way const*> ways;
+        for (auto it = m_selected.begin<osmium::Way>(); it != m_selected.end<osmium::Way>(); ++it) {
+            ways.push_back(&*it);
+        }
+        // PbfBlockIndex is read-only after construction, so the workers can share it without locking.
+        std::vector<osmium::Location> locs(ways.size());
+        parallel_for(ways.size(), RESOLVER_THREADS, [this, &ways, &locs](size_t i){
+            locs[i] = resolve_way(*ways[i]);
+        });
+        for (size_t i = 0; i < ways.size(); ++i) {
+            printf("w%lu x%d y%d\n", ways[i]->id(), locs[i].x(), locs[i].y());
+        }
+    }
 
 private:
     osmium::Location resolve_way(const osmium::Way& way) {
@@ -51,39 +85,43 @@ private:
     }
 
     osmium::Location resolve_node_id(const osmium::object_id_type node_id) {
-        auto buffers = m_table.binary_search_object(osmium::item_type::node, node_id, osmium::io::read_meta::no);
-        for (auto buf_it = buffers.rbegin(); buf_it != buffers.rend(); ++buf_it) {
-            const auto& buffer = *buf_it;
-            for (auto it = buffer->begin<osmium::OSMObject>(); it != buffer->end<osmium::OSMObject>(); ++it) {
-                if (it->type() != osmium::item_type::node) {
-                    // Exploit the fact that nodes come first, so we immediately know that we're behind where the needle would have been.
-                    return osmium::Location();
-                }
-                if (it->id() > node_id) {
-                    // Exploit the fact that early IDs come first, so we immediately know that we're behind where the needle would have been.
-                    return osmium::Location();
-                }
-                if (it->id() == node_id) {
-                    return static_cast<osmium::Node&>(*it).location();
-                }
-            }
+        if (m_store) {
+            return m_store->get(node_id);
         }
-        return osmium::Location();
+        size_t block_index = m_index.find_block(osmium::item_type::node, node_id);
+        if (block_index == m_index.size()) {
+            // Not even in the range of any block, so no need to decode anything.
+            return osmium::Location();
+        }
+        // Only decompress, and then dig out the single location, without building any osmium objects.
+        std::string blob = m_index.read_blob(block_index);
+        m_counters.add_block(blob.size());
+        std::string decompressed;
+        DenseNodeLookup lookup {PbfBlockIndex::decompress_blob(blob, decompressed)};
+        return lookup.find(node_id);
     }
 
-    osmium::io::PbfBlockIndexTable& m_table;
+    Selection const& m_selection;
+    PbfBlockIndex const& m_index;
+    NodeLocationStore const* m_store;
+    ExtractCounters& m_counters;
+    osmium::memory::Buffer m_selected {1024 * 1024};
 };
 
-int main() {
-    printf("# Running on %s …\n", INPUT_FILENAME);
-    osmium::io::PbfBlockIndexTable table {INPUT_FILENAME};
-    printf("# File has %lu blocks.\n", table.block_starts().size());
-    RareObjectLocator rare_object_locator {table};
-    osmium::io::Reader reader{INPUT_FILENAME, osmium::osm_entity_bits::way};
-    osmium::apply(reader, rare_object_locator);
-    reader.close();
+int main(int argc, char** argv) {
+    ExtractArgs args = parse_extract_args(argc, argv, INPUT_FILENAME, ANALYZE_WAY_MODULO);
+    Selection selection = type_modulo_selection<osmium::item_type::way>(args.modulo);
+    ExtractCounters counters;
+    printf("# Running on %s …\n", args.input_filename);
+    PbfBlockIndex index {args.input_filename};
+    printf("# File has %lu blocks%s.\n", index.size(), index.loaded_from_sidecar() ? " (index loaded from sidecar)" : "");
+    std::unique_ptr<NodeLocationStore> store = open_node_location_store(index, NODE_LOCATIONS);
+    RareObjectLocator rare_object_locator {selection, index, store.get(), counters};
+    apply_blocks_counted(index, selected_blocks(index, selection), Selection::entity_bits, rare_object_locator, counters);
+    rare_object_locator.resolve_selected();
 
-    printf("# Done iterating.\n");
+    printf("# Done iterating. %lu lookups were answered by the Bloom filters alone.\n", index.bloom_rejections());
+    counters.print();
     return 0;
 }
 
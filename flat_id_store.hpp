@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/types.hpp>
+
+// Flat replacements for std::map<id, …>, for data that is read once and then only looked up. PBF files are
+// sorted by ID, so appending keeps everything sorted for free, and a lookup is a binary search over one
+// contiguous array, instead of chasing pointers through 48+ bytes of tree node per entry.
+
+// A sorted list of (ID, value) pairs. Several values per ID are fine, too (see equal_range()).
+// Appending out of order is allowed, but then call sort() before the first lookup.
+template <typename TValue>
+class FlatIdMap {
+public:
+    using Entry = std::pair<osmium::object_id_type, TValue>;
+
+    void append(osmium::object_id_type id, TValue const& value) {
+        if (!m_entries.empty() && id < m_entries.back().first) {
+            m_sorted = false;
+        }
+        m_entries.emplace_back(id, value);
+    }
+
+    // Stable, so that several values for the same ID keep their order.
+    void sort() {
+        if (!m_sorted) {
+            std::stable_sort(m_entries.begin(), m_entries.end(), [](Entry const& lhs, Entry const& rhs){
+                return lhs.first < rhs.first;
+            });
+            m_sorted = true;
+        }
+        m_entries.shrink_to_fit();
+    }
+
+    size_t size() const {
+        return m_entries.size();
+    }
+
+    // Returns nullptr if there is no such ID.
+    TValue const* find(osmium::object_id_type id) const {
+        auto it = lower_bound(id);
+        if (it == m_entries.end() || it->first != id) {
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    TValue const& at(osmium::object_id_type id) const {
+        TValue const* value = find(id);
+        if (!value) {
+            printf("Object %ld is missing from the input?!\n", id);
+            exit(1);
+        }
+        return *value;
+    }
+
+    std::pair<Entry const*, Entry const*> equal_range(osmium::object_id_type id) const {
+        auto first = lower_bound(id);
+        auto last = std::find_if(first, m_entries.end(), [id](Entry const& entry){
+            return entry.first != id;
+        });
+        return {m_entries.data() + (first - m_entries.begin()), m_entries.data() + (last - m_entries.begin())};
+    }
+
+    Entry const* begin() const {
+        return m_entries.data();
+    }
+
+    Entry const* end() const {
+        return m_entries.data() + m_entries.size();
+    }
+
+private:
+    typename std::vector<Entry>::const_iterator lower_bound(osmium::object_id_type id) const {
+        assert(m_sorted);
+        return std::lower_bound(m_entries.begin(), m_entries.end(), id, [](Entry const& entry, osmium::object_id_type needle){
+            return entry.first < needle;
+        });
+    }
+
+    std::vector<Entry> m_entries;
+    bool m_sorted {true};
+};
+
+// A view of one list in a FlatIdLists.
+class IdSpan {
+public:
+    // So that boost::adaptors::reverse() and friends accept it.
+    using iterator = osmium::object_id_type const*;
+    using const_iterator = iterator;
+
+    IdSpan(osmium::object_id_type const* begin, osmium::object_id_type const* end)
+        : m_begin(begin)
+        , m_end(end)
+    {
+    }
+
+    osmium::object_id_type const* begin() const {
+        return m_begin;
+    }
+
+    osmium::object_id_type const* end() const {
+        return m_end;
+    }
+
+    size_t size() const {
+        return m_end - m_begin;
+    }
+
+    bool empty() const {
+        return m_begin == m_end;
+    }
+
+    osmium::object_id_type front() const {
+        assert(!empty());
+        return *m_begin;
+    }
+
+    osmium::object_id_type back() const {
+        assert(!empty());
+        return *(m_end - 1);
+    }
+
+private:
+    osmium::object_id_type const* m_begin;
+    osmium::object_id_type const* m_end;
+};
+
+// Lists of IDs per ID (nodes per way, members per relation) in compressed sparse row layout: One array of all
+// list items, and where each list starts in it. The owners must be appended in ascending order, like in the PBF.
+class FlatIdLists {
+public:
+    FlatIdLists() {
+        m_offsets.push_back(0);
+    }
+
+    // Call add_item() for each item of the list afterwards.
+    void begin_list(osmium::object_id_type owner_id) {
+        if (!m_owner_ids.empty() && owner_id <= m_owner_ids.back()) {
+            printf("Input isn't sorted by ID (%ld after %ld)?!\n", owner_id, m_owner_ids.back());
+            exit(1);
+        }
+        m_owner_ids.push_back(owner_id);
+        m_offsets.push_back(m_items.size());
+    }
+
+    void add_item(osmium::object_id_type item_id) {
+        assert(!m_owner_ids.empty());
+        m_items.push_back(item_id);
+        m_offsets.back() = m_items.size();
+    }
+
+    size_t size() const {
+        return m_owner_ids.size();
+    }
+
+    size_t total_items() const {
+        return m_items.size();
+    }
+
+    bool contains(osmium::object_id_type owner_id) const {
+        return std::binary_search(m_owner_ids.begin(), m_owner_ids.end(), owner_id);
+    }
+
+    IdSpan at(osmium::object_id_type owner_id) const {
+        auto it = std::lower_bound(m_owner_ids.begin(), m_owner_ids.end(), owner_id);
+        if (it == m_owner_ids.end() || *it != owner_id) {
+            printf("Object %ld is missing from the input?!\n", owner_id);
+            exit(1);
+        }
+        return list(it - m_owner_ids.begin());
+    }
+
+    osmium::object_id_type owner_id(size_t list_index) const {
+        return m_owner_ids[list_index];
+    }
+
+    IdSpan list(size_t list_index) const {
+        return IdSpan{m_items.data() + m_offsets[list_index], m_items.data() + m_offsets[list_index + 1]};
+    }
+
+    // The items of all lists, one after another.
+    IdSpan all_items() const {
+        return IdSpan{m_items.data(), m_items.data() + m_items.size()};
+    }
+
+private:
+    std::vector<osmium::object_id_type> m_owner_ids;
+    // One more than there are lists.
+    std::vector<size_t> m_offsets;
+    std::vector<osmium::object_id_type> m_items;
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/location.hpp>
+
+// Douglas-Peucker, but computed once for all tolerances: For each point, the largest tolerance at which Douglas-Peucker
+// would still keep it. A point only survives if the point that split its segment survives, so its importance is
+// capped by that one's. Then simplifying with tolerance t is just keeping the points with importance > t, which
+// gives exactly the same result as running Douglas-Peucker with t, for any number of zoom levels.
+// The first and last point are always kept. Distances are measured between (x(i), y(i)), which should be cheap,
+// because they are called over and over again.
+template <typename TX, typename TY>
+static void douglas_peucker_importance(size_t count, TX&& x, TY&& y, float* importance) {
+    if (count == 0) {
+        return;
+    }
+    std::fill(importance, importance + count, 0.0f);
+    importance[0] = std::numeric_limits<float>::infinity();
+    importance[count - 1] = std::numeric_limits<float>::infinity();
+    struct Segment {
+        size_t first;
+        size_t last;
+        float cap;
+    };
+    std::vector<Segment> todo;
+    todo.push_back(Segment{0, count - 1, std::numeric_limits<float>::infinity()});
+    while (!todo.empty()) {
+        Segment segment = todo.back();
+        todo.pop_back();
+        if (segment.last - segment.first < 2) {
+            continue;
+        }
+        double ax = x(segment.first);
+        double ay = y(segment.first);
+        double dx = x(segment.last) - ax;
+        double dy = y(segment.last) - ay;
+        double length_sq = dx * dx + dy * dy;
+        size_t farthest = segment.first + 1;
+        double farthest_distance_sq = -1.0;
+        for (size_t i = segment.first + 1; i < segment.last; ++i) {
+            double px = x(i) - ax;
+            double py = y(i) - ay;
+            // Distance to the segment, not the line, so that closed ways (where the segment is a point) work too.
+            double t = length_sq > 0.0 ? std::clamp((px * dx + py * dy) / length_sq, 0.0, 1.0) : 0.0;
+            double ex = px - t * dx;
+            double ey = py - t * dy;
+            double distance_sq = ex * ex + ey * ey;
+            // Strictly greater, so that ties go to the earliest point. Only the order of the points matters then.
+            if (distance_sq > farthest_distance_sq) {
+                farthest_distance_sq = distance_sq;
+                farthest = i;
+            }
+        }
+        float cap = std::min(segment.cap, static_cast<float>(std::sqrt(farthest_distance_sq)));
+        importance[farthest] = cap;
+        todo.push_back(Segment{segment.first, farthest, cap});
+        todo.push_back(Segment{farthest, segment.last, cap});
+    }
+}
+
+// The same for locations, after scaling lon/lat by x_scale/y_scale, e.g. into the pixels of a map projection.
+static void douglas_peucker_importance(osmium::Location const* points, size_t count, double x_scale, double y_scale, float* importance) {
+    auto x = [points, x_scale](size_t i){
+        return points[i].lon() * x_scale;
+    };
+    auto y = [points, y_scale](size_t i){
+        return points[i].lat() * y_scale;
+    };
+    douglas_peucker_importance(count, x, y, importance);
+}
+
+// Keeps the locations whose importance exceeds the tolerance. A negative tolerance keeps everything.
+static void simplify_by_importance(std::vector<osmium::Location> const& points, std::vector<float> const& importance, double tolerance, std::vector<osmium::Location>& output) {
+    output.clear();
+    if (tolerance < 0.0) {
+        output = points;
+        return;
+    }
+    for (size_t i = 0; i < points.size(); ++i) {
+        if (importance[i] > tolerance) {
+            output.push_back(points[i]);
+        }
+    }
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "pbf_block_index.hpp"
+
+// Locations of resolved objects by (type, id), shared by all resolvers of a run. Only finished results go in here,
+// so nobody ever waits for another thread: If two threads happen to resolve the same object at the same time, both
+// do the work, which is much cheaper than the deadlock that waiting could cause when their objects form a cycle.
+class LocationMemo {
+public:
+    explicit LocationMemo(size_t num_shards = DEFAULT_LOCATION_MEMO_SHARDS)
+        : m_shards(num_shards)
+    {
+    }
+    LocationMemo(const LocationMemo&) = delete;
+    LocationMemo(LocationMemo&&) = delete;
+    LocationMemo& operator=(const LocationMemo&) = delete;
+    LocationMemo& operator=(LocationMemo&&) = delete;
+
+    bool find(uint64_t key, osmium::Location& location) {
+        Shard& shard = shard_for(key);
+        std::lock_guard<std::mutex> lock {shard.mutex};
+        auto it = shard.locations.find(key);
+        if (it == shard.locations.end()) {
+            return false;
+        }
+        location = it->second;
+        return true;
+    }
+
+    void insert(uint64_t key, osmium::Location location) {
+        Shard& shard = shard_for(key);
+        std::lock_guard<std::mutex> lock {shard.mutex};
+        shard.locations.emplace(key, location);
+    }
+
+    size_t size() {
+        size_t total = 0;
+        for (Shard& shard : m_shards) {
+            std::lock_guard<std::mutex> lock {shard.mutex};
+            total += shard.locations.size();
+        }
+        return total;
+    }
+
+private:
+    static const size_t DEFAULT_LOCATION_MEMO_SHARDS = 64;
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, osmium::Location> locations;
+    };
+
+    Shard& shard_for(uint64_t key) {
+        // The IDs are dense, so the low bits spread well enough.
+        return m_shards[key % m_shards.size()];
+    }
+
+    std::vector<Shard> m_shards;
+};
+
+struct ResolverStats {
+    size_t memo_hits {0};
+    size_t cycles {0};
+    size_t not_memoized {0};
+    size_t max_depth {0};
+
+    void add(ResolverStats const& other) {
+        memo_hits += other.memo_hits;
+        cycles += other.cycles;
+        not_memoized += other.not_memoized;
+        max_depth = std::max(max_depth, other.max_depth);
+    }
+
+    void print(LocationMemo& memo) const {
+        printf("# Resolver: %lu objects memoized, %lu memo hits, %lu cycles, %lu results cut short by them, max recursion depth %lu\n",
+            memo.size(), memo_hits, cycles, not_memoized, max_depth);
+    }
+};
+
+// Resolves objects to the location of their first resolvable node, recursing into ways and
+// (sub-)relations. Results go into the LocationMemo, which lives for the whole run, so super-relations
+// that share members don't resolve them again and again, even on different threads. An object that is reached
+// again while this resolver is still resolving it closes a cycle; that edge counts as unresolved instead of
+// recursing forever. That makes the results of the objects between the two visits depend on the path that led
+// to them, so those are not memoized. The object that the cycle leads back to is, since the edge back to itself
+// could never have helped it anyway.
+//
+// TVisitObject is called as visit_object(type, id, callback), and must call callback(object)
+// if and only if the object exists. A resolver itself is not thread-safe; use one per thread (or task),
+// all with the same memo.
+template <typename TVisitObject>
+class MemoizedResolver {
+public:
+    MemoizedResolver(LocationMemo& memo, TVisitObject visit_object)
+        : m_memo(memo)
+        , m_visit_object(visit_object)
+    {
+    }
+
+    osmium::Location resolve(osmium::OSMObject const& object) {
+        return resolve_memoized(object.type(), object.id(), [this, &object](){
+            return resolve_uncached(object);
+        });
+    }
+
+    osmium::Location resolve(osmium::item_type type, osmium::object_id_type id) {
+        return resolve_memoized(type, id, [this, type, id](){
+            // If the object doesn't exist, it stays unresolved.
+            osmium::Location loc;
+            m_visit_object(type, id, [this, &loc](osmium::OSMObject const& object){
+                loc = resolve_uncached(object);
+            });
+            return loc;
+        });
+    }
+
+    ResolverStats const& stats() const {
+        return m_stats;
+    }
+
+private:
+    template <typename TResolve>
+    osmium::Location resolve_memoized(osmium::item_type type, osmium::object_id_type id, TResolve&& do_resolve) {
+        uint64_t key = object_key(type, id);
+        auto in_progress = m_in_progress.find(key);
+        if (in_progress != m_in_progress.end()) {
+            printf("# CYCLE via %c%lu\n", osmium::item_type_to_char(type), id);
+            m_stats.cycles += 1;
+            m_cut_at_depth = std::min(m_cut_at_depth, in_progress->second);
+            return osmium::Location();
+        }
+        osmium::Location loc;
+        if (m_memo.find(key, loc)) {
+            m_stats.memo_hits += 1;
+            return loc;
+        }
+        size_t depth = m_in_progress.size();
+        m_in_progress.emplace(key, depth);
+        size_t outer_cut_at_depth = m_cut_at_depth;
+        m_cut_at_depth = NOT_CUT;
+        loc = do_resolve();
+        m_in_progress.erase(key);
+        if (m_cut_at_depth < depth) {
+            // A cycle led back to an object further up, which made this result (and those of everything above,
+            // up to that object) depend on the path.
+            m_stats.not_memoized += 1;
+            m_cut_at_depth = std::min(outer_cut_at_depth, m_cut_at_depth);
+        } else {
+            // Cycles back to this object or below don't matter for anything above.
+            m_memo.insert(key, loc);
+            m_cut_at_depth = outer_cut_at_depth;
+        }
+        return loc;
+    }
+
+    osmium::Location resolve_uncached(osmium::OSMObject const& object) {
+        m_depth += 1;
+        m_stats.max_depth = std::max(m_stats.max_depth, m_depth);
+        osmium::Location loc;
+        switch (object.type()) {
+        case osmium::item_type::node:
+            loc = static_cast<osmium::Node const&>(object).location();
+            break;
+        case osmium::item_type::way:
+            for (auto const& noderef : static_cast<osmium::Way const&>(object).nodes()) {
+                loc = resolve(osmium::item_type::node, noderef.ref());
+                if (loc)
+                    break;
+            }
+            break;
+        case osmium::item_type::relation:
+            for (auto const& memberref : static_cast<osmium::Relation const&>(object).members()) {
+                loc = resolve(memberref.type(), memberref.ref());
+                if (loc)
+                    break;
+            }
+            break;
+        default:
+            printf("Object %c%lu has weird item type %u?!\n", osmium::item_type_to_char(object.type()), object.id(), static_cast<uint16_t>(object.type()));
+        }
+        m_depth -= 1;
+        return loc;
+    }
+
+    static constexpr size_t NOT_CUT = SIZE_MAX;
+
+    LocationMemo& m_memo;
+    TVisitObject m_visit_object;
+    // The objects on the current recursion path, and how deep each one is on it.
+    std::unordered_map<uint64_t, size_t> m_in_progress;
+    // The shallowest object on the path that a cycle led back to, while resolving the current object.
+    size_t m_cut_at_depth {NOT_CUT};
+    size_t m_depth {0};
+    ResolverStats m_stats;
+};
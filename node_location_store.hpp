@@ -0,0 +1,318 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/thread/pool.hpp>
+
+#include "pbf_block_index.hpp"
+
+// All node locations of a PBF file in a flat, mmap-able file next to it, e.g. "planet-231002.osm.pbf.nodelocs".
+// Building it costs one pass over the node blocks; afterwards, every lookup is a single page-cache access.
+// The ID space is cut into chunks of 2^16 IDs. Well-populated chunks are stored densely with 8 bytes per ID,
+// so a lookup is plain array indexing. Sparse chunks (typical for extracts, and for old, mostly deleted
+// ID ranges) only store the existing nodes, sorted, and need a binary search within the chunk.
+// Bump the version whenever the layout changes, so that old files get rebuilt.
+static const char* const NODE_LOCATION_STORE_SUFFIX = ".nodelocs";
+static const char NODE_LOCATION_STORE_MAGIC[8] = {'O', 'S', 'M', 'N', 'L', 'O', 'C', '\0'};
+static const uint32_t NODE_LOCATION_STORE_VERSION = 1;
+static const unsigned NODE_LOCATION_CHUNK_BITS = 16;
+static const size_t NODE_LOCATION_CHUNK_IDS = size_t{1} << NODE_LOCATION_CHUNK_BITS;
+// How many node blocks may be decoded ahead of the writer. Each one is a few MiB once decoded.
+static const size_t NODE_LOCATION_BUILD_BLOCKS_IN_FLIGHT_PER_THREAD = 4;
+
+static_assert(sizeof(osmium::Location) == 8);
+
+struct NodeLocationStoreHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_bits;
+    PbfFileKey pbf_key;
+    uint64_t node_count;
+    uint64_t chunk_count;
+    // The data section starts right after the header; the chunk directory follows it.
+    uint64_t directory_offset;
+};
+static_assert(sizeof(NodeLocationStoreHeader) == 72);
+
+struct NodeLocationChunk {
+    uint64_t offset; // Into the file. Dense chunks hold NODE_LOCATION_CHUNK_IDS Locations.
+    uint32_t count; // Existing nodes. Sparse chunks hold count Locations, then count uint16_t low ID bits.
+    uint32_t dense;
+};
+static_assert(sizeof(NodeLocationChunk) == 16);
+
+// Where a tool takes its node locations from.
+enum class NodeLocationSource {
+    // Always decode the node blocks of the PBF.
+    Pbf,
+    // Use the store if build_node_location_store already built an up-to-date one, and decode the PBF otherwise.
+    StoreIfPresent,
+    // Use the store, and build it first if it's missing or stale.
+    Store,
+};
+
+class NodeLocationStore {
+public:
+    // Maps the store next to the index's PBF file, building it first if it's missing or stale.
+    // Without build_if_missing, a missing or stale store is left alone, and mapped() is false.
+    explicit NodeLocationStore(PbfBlockIndex const& index, bool build_if_missing = true)
+        : m_filename(index.pbf_filename() + NODE_LOCATION_STORE_SUFFIX)
+    {
+        m_expected_header = {};
+        memcpy(m_expected_header.magic, NODE_LOCATION_STORE_MAGIC, sizeof(m_expected_header.magic));
+        m_expected_header.version = NODE_LOCATION_STORE_VERSION;
+        m_expected_header.chunk_bits = NODE_LOCATION_CHUNK_BITS;
+        m_expected_header.pbf_key = index.pbf_file_key();
+        if (!try_map()) {
+            if (!build_if_missing) {
+                return;
+            }
+            printf("# Building node location store %s …\n", m_filename.c_str());
+            build(index);
+            if (!try_map()) {
+                printf("Node location store %s is unusable right after building it?!\n", m_filename.c_str());
+                exit(1);
+            }
+        } else {
+            m_loaded_existing = true;
+        }
+    }
+    NodeLocationStore(const NodeLocationStore&) = delete;
+    NodeLocationStore(NodeLocationStore&&) = delete;
+    NodeLocationStore& operator=(const NodeLocationStore&) = delete;
+    NodeLocationStore& operator=(NodeLocationStore&&) = delete;
+
+    ~NodeLocationStore() {
+        if (m_mapping != nullptr) {
+            munmap(m_mapping, m_mapping_size);
+            m_mapping = nullptr;
+        }
+    }
+
+    // Returns an undefined Location if the node doesn't exist. Thread-safe.
+    osmium::Location get(osmium::object_id_type node_id) const {
+        if (node_id < 0) {
+            return osmium::Location();
+        }
+        uint64_t chunk_index = static_cast<uint64_t>(node_id) >> NODE_LOCATION_CHUNK_BITS;
+        if (chunk_index >= m_header->chunk_count) {
+            return osmium::Location();
+        }
+        NodeLocationChunk const& chunk = m_directory[chunk_index];
+        uint16_t low_id = static_cast<uint16_t>(node_id & (NODE_LOCATION_CHUNK_IDS - 1));
+        osmium::Location const* locations = reinterpret_cast<osmium::Location const*>(m_data + chunk.offset);
+        if (chunk.dense) {
+            return locations[low_id];
+        }
+        uint16_t const* low_ids = reinterpret_cast<uint16_t const*>(locations + chunk.count);
+        uint16_t const* found = std::lower_bound(low_ids, low_ids + chunk.count, low_id);
+        if (found == low_ids + chunk.count || *found != low_id) {
+            return osmium::Location();
+        }
+        return locations[found - low_ids];
+    }
+
+    size_t node_count() const {
+        return m_header->node_count;
+    }
+
+    size_t file_size() const {
+        return m_mapping_size;
+    }
+
+    bool loaded_existing() const {
+        return m_loaded_existing;
+    }
+
+    bool mapped() const {
+        return m_mapping != nullptr;
+    }
+
+    std::string const& filename() const {
+        return m_filename;
+    }
+
+private:
+    bool try_map() {
+        int fd = open(m_filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat store_stat;
+        bool ok = fstat(fd, &store_stat) == 0 && static_cast<size_t>(store_stat.st_size) >= sizeof(NodeLocationStoreHeader);
+        void* mapping = MAP_FAILED;
+        if (ok) {
+            mapping = mmap(nullptr, store_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd); // The mapping stays valid.
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+        NodeLocationStoreHeader const& header = *static_cast<NodeLocationStoreHeader const*>(mapping);
+        // Compare everything except the sizes, which we don't know in advance:
+        NodeLocationStoreHeader expected = m_expected_header;
+        expected.node_count = header.node_count;
+        expected.chunk_count = header.chunk_count;
+        expected.directory_offset = header.directory_offset;
+        if (memcmp(&header, &expected, sizeof(NodeLocationStoreHeader)) != 0
+                || store_stat.st_size != static_cast<off_t>(header.directory_offset + header.chunk_count * sizeof(NodeLocationChunk))) {
+            munmap(mapping, store_stat.st_size);
+            return false;
+        }
+        m_mapping = mapping;
+        m_mapping_size = store_stat.st_size;
+        m_data = static_cast<unsigned char const*>(mapping);
+        m_header = &header;
+        m_directory = reinterpret_cast<NodeLocationChunk const*>(m_data + header.directory_offset);
+        // Lookups are all over the place, so don't let the kernel read ahead.
+        madvise(mapping, store_stat.st_size, MADV_RANDOM);
+        return true;
+    }
+
+    // Writes one chunk, and appends its directory entry. Chunks without nodes take no space at all.
+    static bool write_chunk(FILE* fp, uint64_t& file_offset, std::vector<std::pair<uint16_t, osmium::Location>> const& nodes, std::vector<NodeLocationChunk>& directory) {
+        NodeLocationChunk chunk {file_offset, static_cast<uint32_t>(nodes.size()), 0};
+        bool ok = true;
+        // Sparse: 8 bytes per node for the location, 2 for the ID, and padding to keep the next chunk aligned.
+        size_t sparse_bytes = (nodes.size() * (sizeof(osmium::Location) + sizeof(uint16_t)) + 7) / 8 * 8;
+        size_t dense_bytes = NODE_LOCATION_CHUNK_IDS * sizeof(osmium::Location);
+        if (dense_bytes <= sparse_bytes) {
+            chunk.dense = 1;
+            std::vector<osmium::Location> locations(NODE_LOCATION_CHUNK_IDS);
+            for (auto const& node : nodes) {
+                locations[node.first] = node.second;
+            }
+            ok = fwrite(locations.data(), sizeof(osmium::Location), locations.size(), fp) == locations.size();
+            file_offset += dense_bytes;
+        } else if (!nodes.empty()) {
+            std::vector<osmium::Location> locations;
+            std::vector<uint16_t> low_ids;
+            for (auto const& node : nodes) {
+                low_ids.push_back(node.first);
+                locations.push_back(node.second);
+            }
+            // Padding, so that sparse_bytes are actually written.
+            while (low_ids.size() * sizeof(uint16_t) + locations.size() * sizeof(osmium::Location) < sparse_bytes) {
+                low_ids.push_back(0);
+            }
+            ok = fwrite(locations.data(), sizeof(osmium::Location), locations.size(), fp) == locations.size()
+                && fwrite(low_ids.data(), sizeof(uint16_t), low_ids.size(), fp) == low_ids.size();
+            file_offset += sparse_bytes;
+        }
+        directory.push_back(chunk);
+        return ok;
+    }
+
+    // One pass over the node blocks, decoded on the pool and written in file order, i.e. sorted by ID.
+    void build(PbfBlockIndex const& index) {
+        // Write to a temporary file and rename it, so that concurrent runs never see a half-written store.
+        std::string tmp_filename;
+        FILE* fp = open_unique_temporary(m_filename, tmp_filename);
+        if (!fp) {
+            printf("Cannot write a temporary file next to %s: %s\n", m_filename.c_str(), strerror(errno));
+            exit(1);
+        }
+        NodeLocationStoreHeader header = m_expected_header;
+        // The header is written again at the end, once the sizes are known.
+        bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+        uint64_t file_offset = sizeof(header);
+        std::vector<NodeLocationChunk> directory;
+        std::vector<std::pair<uint16_t, osmium::Location>> chunk_nodes;
+        uint64_t node_count = 0;
+        auto consume = [&](osmium::memory::Buffer const& buffer){
+            for (auto it = buffer.begin<osmium::Node>(); it != buffer.end<osmium::Node>(); ++it) {
+                if (it->id() < 0 || !it->location()) {
+                    continue;
+                }
+                uint64_t chunk_index = static_cast<uint64_t>(it->id()) >> NODE_LOCATION_CHUNK_BITS;
+                if (chunk_index < directory.size()) {
+                    printf("Node n%ld is out of order, is %s sorted?!\n", it->id(), index.pbf_filename().c_str());
+                    exit(1);
+                }
+                while (directory.size() < chunk_index) {
+                    ok = ok && write_chunk(fp, file_offset, chunk_nodes, directory);
+                    chunk_nodes.clear();
+                }
+                chunk_nodes.emplace_back(static_cast<uint16_t>(it->id() & (NODE_LOCATION_CHUNK_IDS - 1)), it->location());
+                node_count += 1;
+            }
+        };
+
+        osmium::thread::Pool& pool = osmium::thread::Pool::default_instance();
+        size_t max_in_flight = pool.num_threads() * NODE_LOCATION_BUILD_BLOCKS_IN_FLIGHT_PER_THREAD;
+        std::deque<std::future<osmium::memory::Buffer>> in_flight;
+        for (size_t block_index = 0; block_index < index.size(); ++block_index) {
+            BlockMeta const& meta = index.block(block_index);
+            if (meta.empty() || meta.first_item_type() != osmium::item_type::node) {
+                continue;
+            }
+            while (in_flight.size() >= max_in_flight) {
+                consume(in_flight.front().get());
+                in_flight.pop_front();
+            }
+            in_flight.push_back(pool.submit([&index, block_index](){
+                return PbfBlockIndex::decode_blob(index.read_blob(block_index), osmium::osm_entity_bits::node, osmium::io::read_meta::no);
+            }));
+        }
+        for (auto& future : in_flight) {
+            consume(future.get());
+        }
+        if (!chunk_nodes.empty()) {
+            ok = ok && write_chunk(fp, file_offset, chunk_nodes, directory);
+        }
+
+        header.node_count = node_count;
+        header.chunk_count = directory.size();
+        header.directory_offset = file_offset;
+        ok = ok && fwrite(directory.data(), sizeof(NodeLocationChunk), directory.size(), fp) == directory.size();
+        ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+        ok = (fclose(fp) == 0) && ok;
+        if (!ok || rename(tmp_filename.c_str(), m_filename.c_str()) != 0) {
+            printf("Cannot write %s: %s\n", m_filename.c_str(), strerror(errno));
+            unlink(tmp_filename.c_str());
+            exit(1);
+        }
+        printf("# Wrote %lu node locations in %lu chunks, %lu bytes.\n", node_count, directory.size(), file_offset + directory.size() * sizeof(NodeLocationChunk));
+    }
+
+    std::string m_filename;
+    NodeLocationStoreHeader m_expected_header;
+    void* m_mapping {nullptr};
+    size_t m_mapping_size {0};
+    unsigned char const* m_data {nullptr};
+    NodeLocationStoreHeader const* m_header {nullptr};
+    NodeLocationChunk const* m_directory {nullptr};
+    bool m_loaded_existing {false};
+};
+
+// Returns nullptr if the tool should decode the node locations from the PBF instead, see NodeLocationSource.
+static std::unique_ptr<NodeLocationStore> open_node_location_store(PbfBlockIndex const& index, NodeLocationSource source) {
+    if (source == NodeLocationSource::Pbf) {
+        return nullptr;
+    }
+    auto store = std::make_unique<NodeLocationStore>(index, source == NodeLocationSource::Store);
+    if (!store->mapped()) {
+        printf("# No up-to-date node location store %s, decoding node locations from the PBF.\n", store->filename().c_str());
+        return nullptr;
+    }
+    printf("# Taking node locations from %s.\n", store->filename().c_str());
+    return store;
+}
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Text output for writers that emit millions of coordinates. fprintf parses its format string and consults the
+// locale on every call, which dominates the runtime for big polygons. Instead, numbers go through std::to_chars,
+// which is specified to produce exactly what printf("%.*f") does in the C locale, so the output stays byte-identical.
+
+// Longest double is 309 digits before the point, and the decimals stay small here.
+static const size_t MAX_FIXED_CHARS = 400;
+
+// Same as sprintf(destination, "%.<decimals>f", value), without the terminating zero. Returns the length.
+static size_t format_fixed(char* destination, double value, int decimals) {
+    auto result = std::to_chars(destination, destination + MAX_FIXED_CHARS, value, std::chars_format::fixed, decimals);
+    assert(result.ec == std::errc());
+    return result.ptr - destination;
+}
+
+// Appends vsprintf(format, args) to text.
+static void append_format(std::string& text, const char* format, va_list args) {
+    va_list args_again;
+    va_copy(args_again, args);
+    char line[1024];
+    int size = vsnprintf(line, sizeof(line), format, args);
+    assert(size >= 0);
+    if (static_cast<size_t>(size) < sizeof(line)) {
+        text.append(line, size);
+    } else {
+        size_t old_size = text.size();
+        text.resize(old_size + size + 1);
+        vsnprintf(&text[old_size], size + 1, format, args_again);
+        text.resize(old_size + size);
+    }
+    va_end(args_again);
+}
+
+// Formats into memory, e.g. one feature per worker thread, so that an OutputBuffer can write them all at once later.
+class TextBuffer {
+public:
+    void write(char const* data, size_t size) {
+        m_text.append(data, size);
+    }
+
+    void write(char const* text) {
+        m_text.append(text);
+    }
+
+    void write(char c) {
+        m_text.push_back(c);
+    }
+
+    // Same as printf("%.<decimals>f", value).
+    void write_fixed(double value, int decimals) {
+        char number[MAX_FIXED_CHARS];
+        m_text.append(number, format_fixed(number, value, decimals));
+    }
+
+    // Same as printf("%ld", value).
+    void write_integer(int64_t value) {
+        char number[24];
+        auto result = std::to_chars(number, number + sizeof(number), value);
+        assert(result.ec == std::errc());
+        m_text.append(number, result.ptr - number);
+    }
+
+    __attribute__((format(printf, 2, 3)))
+    void write_format(const char* format, ...) {
+        va_list args;
+        va_start(args, format);
+        append_format(m_text, format, args);
+        va_end(args);
+    }
+
+    char const* data() const {
+        return m_text.data();
+    }
+
+    size_t size() const {
+        return m_text.size();
+    }
+
+private:
+    std::string m_text;
+};
+
+// A text output file with a large buffer. Optionally, the output is gzip-compressed on the fly
+// (zlib is linked anyway, for PBF).
+class OutputBuffer {
+public:
+    OutputBuffer(std::string const& filename, bool gzip)
+        : m_filename(filename)
+    {
+        m_buffer.resize(OUTPUT_BUFFER_BYTES);
+        if (gzip) {
+            m_gz_file = gzopen(m_filename.c_str(), "wb");
+        } else {
+            m_fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (m_fd < 0 && !m_gz_file) {
+            printf("Cannot write %s: %s\n", m_filename.c_str(), strerror(errno));
+            exit(1);
+        }
+    }
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer(OutputBuffer&&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(OutputBuffer&&) = delete;
+
+    ~OutputBuffer() {
+        flush();
+        bool ok = m_gz_file ? gzclose(m_gz_file) == Z_OK : close(m_fd) == 0;
+        if (!ok) {
+            printf("Cannot write %s, disk full?!\n", m_filename.c_str());
+            exit(1);
+        }
+    }
+
+    void write(char const* data, size_t size) {
+        if (m_used + size > m_buffer.size()) {
+            flush();
+            if (size > m_buffer.size()) {
+                write_through(data, size);
+                return;
+            }
+        }
+        memcpy(m_buffer.data() + m_used, data, size);
+        m_used += size;
+    }
+
+    void write(char const* text) {
+        write(text, strlen(text));
+    }
+
+    void write(char c) {
+        if (m_used == m_buffer.size()) {
+            flush();
+        }
+        m_buffer[m_used++] = c;
+    }
+
+    // Same as printf("%.<decimals>f", value).
+    void write_fixed(double value, int decimals) {
+        if (m_used + MAX_FIXED_CHARS > m_buffer.size()) {
+            flush();
+        }
+        m_used += format_fixed(m_buffer.data() + m_used, value, decimals);
+    }
+
+    // For everything that isn't hot, like headers and properties.
+    __attribute__((format(printf, 2, 3)))
+    void write_format(const char* format, ...) {
+        std::string text;
+        va_list args;
+        va_start(args, format);
+        append_format(text, format, args);
+        va_end(args);
+        write(text.data(), text.size());
+    }
+
+    // Writes all the texts, with the separator between each two of them. Without compression, this is one writev()
+    // per IOV_MAX pieces, straight from the texts, instead of copying everything through the buffer.
+    void write_all(std::vector<TextBuffer> const& texts, char const* separator) {
+        flush();
+        std::vector<iovec> pieces;
+        size_t separator_size = strlen(separator);
+        for (size_t i = 0; i < texts.size(); ++i) {
+            if (i > 0 && separator_size > 0) {
+                pieces.push_back(iovec{const_cast<char*>(separator), separator_size});
+            }
+            if (texts[i].size() > 0) {
+                pieces.push_back(iovec{const_cast<char*>(texts[i].data()), texts[i].size()});
+            }
+        }
+        if (m_gz_file) {
+            for (iovec const& piece : pieces) {
+                write_through(static_cast<char const*>(piece.iov_base), piece.iov_len);
+            }
+            return;
+        }
+        for (size_t first = 0; first < pieces.size(); first += IOV_MAX) {
+            write_vectored(pieces.data() + first, std::min(pieces.size() - first, size_t{IOV_MAX}));
+        }
+    }
+
+    void flush() {
+        write_through(m_buffer.data(), m_used);
+        m_used = 0;
+    }
+
+private:
+    static const size_t OUTPUT_BUFFER_BYTES = 4 * 1024 * 1024;
+
+    void write_through(char const* data, size_t size) {
+        iovec piece {const_cast<char*>(data), size};
+        if (m_gz_file) {
+            // gzwrite takes an unsigned int, so don't hand it more than 1 GiB at once.
+            while (size > 0) {
+                unsigned chunk = std::min(size, size_t{1} << 30);
+                if (gzwrite(m_gz_file, data, chunk) != static_cast<int>(chunk)) {
+                    printf("Cannot write %s, disk full?!\n", m_filename.c_str());
+                    exit(1);
+                }
+                data += chunk;
+                size -= chunk;
+            }
+            return;
+        }
+        write_vectored(&piece, 1);
+    }
+
+    // Handles short writes, which may leave any piece partially written.
+    void write_vectored(iovec* pieces, size_t count) {
+        while (count > 0) {
+            ssize_t written = writev(m_fd, pieces, count);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                printf("Cannot write %s: %s\n", m_filename.c_str(), strerror(errno));
+                exit(1);
+            }
+            size_t remaining = written;
+            while (count > 0 && remaining >= pieces->iov_len) {
+                remaining -= pieces->iov_len;
+                ++pieces;
+                --count;
+            }
+            if (count > 0) {
+                pieces->iov_base = static_cast<char*>(pieces->iov_base) + remaining;
+                pieces->iov_len -= remaining;
+            }
+        }
+    }
+
+    std::string m_filename;
+    int m_fd {-1};
+    gzFile m_gz_file {nullptr};
+    std::vector<char> m_buffer;
+    size_t m_used {0};
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Calls func(i) for every i in [0, count), spread over num_threads threads (0 means one per core).
+// The indices are handed out one by one, so expensive and cheap items balance out.
+template <typename TFunc>
+void parallel_for(size_t count, size_t num_threads, TFunc&& func) {
+    if (num_threads == 0) {
+        num_threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    num_threads = std::min(num_threads, count);
+    std::atomic<size_t> next_index {0};
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < num_threads; ++t) {
+        workers.emplace_back([&next_index, count, &func](){
+            for (size_t i = next_index++; i < count; i = next_index++) {
+                func(i);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
@@ -0,0 +1,607 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <protozero/pbf_message.hpp>
+
+#include <osmium/io/detail/pbf_decoder.hpp>
+#include <osmium/io/detail/protobuf_tags.hpp>
+#include <osmium/thread/pool.hpp>
+
+// The sidecar lives next to the PBF file, e.g. "planet-231002.osm.pbf.blockidx".
+// Bump the version whenever the layout of SidecarHeader or BlockMeta changes, or what object_key() returns (the
+// Bloom filters are built from it), so that old sidecars get rebuilt.
+static const char* const BLOCK_INDEX_SIDECAR_SUFFIX = ".blockidx";
+static const char BLOCK_INDEX_SIDECAR_MAGIC[8] = {'O', 'S', 'M', 'B', 'I', 'D', 'X', '\0'};
+static const uint32_t BLOCK_INDEX_SIDECAR_VERSION = 3;
+// BlobHeaders are tiny; the spec says they must not exceed 64 KiB.
+static const uint32_t MAX_BLOB_HEADER_SIZE = 64 * 1024;
+// How many blocks may be in flight while building. Each one is a few MiB once decoded.
+static const size_t BUILD_BLOCKS_IN_FLIGHT_PER_THREAD = 4;
+// Per-block Bloom filters over the object IDs let lookups of deleted/missing objects return without
+// touching the PBF at all. 8 bits and 5 hashes per object give roughly 2 % false positives.
+// That's about one byte per object in the sidecar (~10 GiB for the planet), so it's off (0) by default;
+// only turn it on for tools that do many point lookups of objects that may not exist.
+// Changing these rebuilds the sidecar.
+static const uint32_t BLOCK_INDEX_BLOOM_BITS_PER_OBJECT = 0;
+static const uint32_t BLOCK_INDEX_BLOOM_HASHES = 5;
+
+// Everything we know about a single OSMData block. This is written to disk as-is, so keep it POD.
+struct BlockMeta {
+    uint64_t file_offset; // Start of the Blob message, i.e. right after the BlobHeader.
+    uint32_t datasize; // Size of the Blob message, i.e. the compressed size.
+    uint16_t first_type; // osmium::item_type, or 0 if the block contains no objects.
+    uint16_t last_type;
+    int64_t first_id;
+    int64_t last_id;
+    uint64_t bloom_offset; // Relative to the start of the Bloom section.
+    uint32_t bloom_bytes; // 0 if there is no filter for this block.
+    uint32_t object_count;
+
+    osmium::item_type first_item_type() const {
+        return static_cast<osmium::item_type>(first_type);
+    }
+
+    osmium::item_type last_item_type() const {
+        return static_cast<osmium::item_type>(last_type);
+    }
+
+    bool empty() const {
+        return first_type == 0;
+    }
+};
+static_assert(sizeof(BlockMeta) == 48);
+
+struct SidecarHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_meta_size;
+    // The key: If any of these disagree with the PBF file, the sidecar is stale.
+    uint64_t pbf_file_size;
+    int64_t pbf_mtime_sec;
+    int64_t pbf_mtime_nsec;
+    uint64_t pbf_header_hash;
+    uint32_t bloom_bits_per_object;
+    uint32_t bloom_hashes;
+    // The payload: First the Bloom section, then the BlockMetas.
+    uint64_t bloom_section_bytes;
+    uint64_t block_count;
+};
+static_assert(sizeof(SidecarHeader) == 72);
+
+// Identifies the exact PBF file that some derived file was built from. Other sidecars embed this, too.
+struct PbfFileKey {
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t header_hash;
+
+    bool operator==(PbfFileKey const& other) const {
+        return file_size == other.file_size && mtime_sec == other.mtime_sec && mtime_nsec == other.mtime_nsec && header_hash == other.header_hash;
+    }
+};
+static_assert(sizeof(PbfFileKey) == 32);
+
+// Creates and opens '<filename>.XXXXXX' for writing, so that several runs building the same file at once
+// each get their own, and the last rename() wins. Returns nullptr (with errno set) on failure.
+static FILE* open_unique_temporary(std::string const& filename, std::string& tmp_filename) {
+    tmp_filename = filename + ".XXXXXX";
+    int fd = mkstemp(&tmp_filename[0]);
+    if (fd < 0) {
+        return nullptr;
+    }
+    // mkstemp() uses 0600, but the result should be as readable as a normally created file.
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    FILE* fp = fdopen(fd, "wb");
+    if (!fp) {
+        close(fd);
+        unlink(tmp_filename.c_str());
+    }
+    return fp;
+}
+
+// Planet IDs are positive, but files edited in JOSM, or written with osmium's negative ID support, have negative IDs
+// for new objects. osmium sorts those first, by absolute value: 0, -1, -2, …, then 1, 2, …
+// (see osmium/osm/object_comparisons.hpp), so that's the order within each type in a sorted PBF file.
+static bool object_id_less(osmium::object_id_type lhs, osmium::object_id_type rhs) {
+    if ((lhs > 0) != (rhs > 0)) {
+        return rhs > 0;
+    }
+    return lhs > 0 ? lhs < rhs : lhs > rhs;
+}
+
+// Packs type and ID into a single integer that sorts like the PBF file does, so that
+// range checks are plain integer comparisons. IDs take the low 55 bits, and bit 55 says whether they're positive.
+static const unsigned OBJECT_KEY_TYPE_SHIFT = 56;
+static const uint64_t OBJECT_KEY_POSITIVE_BIT = uint64_t{1} << (OBJECT_KEY_TYPE_SHIFT - 1);
+
+static uint64_t object_key(osmium::item_type type, osmium::object_id_type id) {
+    uint64_t magnitude = id < 0 ? 0 - static_cast<uint64_t>(id) : static_cast<uint64_t>(id);
+    if (magnitude >= OBJECT_KEY_POSITIVE_BIT) {
+        printf("Object %c%ld is out of range, IDs must stay below 2^%u in absolute value?!\n", osmium::item_type_to_char(type), id, OBJECT_KEY_TYPE_SHIFT - 1);
+        exit(1);
+    }
+    return (static_cast<uint64_t>(type) << OBJECT_KEY_TYPE_SHIFT) | (id > 0 ? OBJECT_KEY_POSITIVE_BIT : 0) | magnitude;
+}
+
+// Positions of the filter bits, by double hashing (Kirsch/Mitzenmacher) of a well-mixed key.
+template <typename TFunc>
+static void for_each_bloom_bit(uint64_t key, uint64_t filter_bits, uint32_t num_hashes, TFunc&& func) {
+    // splitmix64 finalizer:
+    uint64_t hash = key + 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    hash = hash ^ (hash >> 31);
+    uint64_t step = (hash >> 32) | 1;
+    for (uint32_t i = 0; i < num_hashes; ++i) {
+        func((hash + i * step) % filter_bits);
+    }
+}
+
+// PBF files are sorted by type first (nodes, then ways, then relations), and by ID second, see object_id_less().
+static bool object_key_less(osmium::item_type lhs_type, osmium::object_id_type lhs_id, osmium::item_type rhs_type, osmium::object_id_type rhs_id) {
+    if (lhs_type != rhs_type) {
+        return lhs_type < rhs_type;
+    }
+    return object_id_less(lhs_id, rhs_id);
+}
+
+class PbfBlockIndex {
+public:
+    explicit PbfBlockIndex(const char* const pbf_filename)
+        : m_pbf_filename(pbf_filename)
+        , m_sidecar_filename(std::string(pbf_filename) + BLOCK_INDEX_SIDECAR_SUFFIX)
+    {
+        m_fd = open(pbf_filename, O_RDONLY | O_CLOEXEC);
+        if (m_fd < 0) {
+            printf("Cannot open %s: %s\n", pbf_filename, strerror(errno));
+            exit(1);
+        }
+        struct stat pbf_stat;
+        if (fstat(m_fd, &pbf_stat) != 0) {
+            printf("Cannot stat %s: %s\n", pbf_filename, strerror(errno));
+            exit(1);
+        }
+        m_expected_header = {};
+        memcpy(m_expected_header.magic, BLOCK_INDEX_SIDECAR_MAGIC, sizeof(m_expected_header.magic));
+        m_expected_header.version = BLOCK_INDEX_SIDECAR_VERSION;
+        m_expected_header.block_meta_size = sizeof(BlockMeta);
+        m_expected_header.pbf_file_size = pbf_stat.st_size;
+        m_expected_header.pbf_mtime_sec = pbf_stat.st_mtim.tv_sec;
+        m_expected_header.pbf_mtime_nsec = pbf_stat.st_mtim.tv_nsec;
+        m_expected_header.pbf_header_hash = hash_first_blob();
+        m_expected_header.bloom_bits_per_object = BLOCK_INDEX_BLOOM_BITS_PER_OBJECT;
+        m_expected_header.bloom_hashes = BLOCK_INDEX_BLOOM_HASHES;
+
+        if (try_map_sidecar()) {
+            m_loaded_from_sidecar = true;
+        } else {
+            printf("# No usable block index at %s, scanning all blocks (this happens only once per file) …\n", m_sidecar_filename.c_str());
+            std::vector<BlockMeta> blocks;
+            if (!build_sidecar(blocks) || !try_map_sidecar()) {
+                printf("# Cannot write %s, keeping the block index (without Bloom filters) in memory only.\n", m_sidecar_filename.c_str());
+                for (BlockMeta& meta : blocks) {
+                    meta.bloom_bytes = 0;
+                }
+                m_owned_blocks = std::move(blocks);
+                m_blocks = m_owned_blocks.data();
+                m_block_count = m_owned_blocks.size();
+            }
+        }
+        build_key_ranges();
+    }
+    PbfBlockIndex(const PbfBlockIndex&) = delete;
+    PbfBlockIndex(PbfBlockIndex&&) = delete;
+    PbfBlockIndex& operator=(const PbfBlockIndex&) = delete;
+    PbfBlockIndex& operator=(PbfBlockIndex&&) = delete;
+
+    ~PbfBlockIndex() {
+        if (m_mapping != nullptr) {
+            munmap(m_mapping, m_mapping_size);
+            m_mapping = nullptr;
+        }
+        close(m_fd);
+        m_fd = -1;
+    }
+
+    size_t size() const {
+        return m_block_count;
+    }
+
+    BlockMeta const& block(size_t block_index) const {
+        assert(block_index < m_block_count);
+        return m_blocks[block_index];
+    }
+
+    BlockMeta const* begin() const {
+        return m_blocks;
+    }
+
+    BlockMeta const* end() const {
+        return m_blocks + m_block_count;
+    }
+
+    bool loaded_from_sidecar() const {
+        return m_loaded_from_sidecar;
+    }
+
+    std::string const& pbf_filename() const {
+        return m_pbf_filename;
+    }
+
+    PbfFileKey pbf_file_key() const {
+        return PbfFileKey{
+            m_expected_header.pbf_file_size,
+            m_expected_header.pbf_mtime_sec,
+            m_expected_header.pbf_mtime_nsec,
+            m_expected_header.pbf_header_hash,
+        };
+    }
+
+    // Returns the index of the only block that could contain the object, or size() if there is none,
+    // e.g. because the ID falls into the gap between two blocks. This only looks at the block ranges,
+    // so it's cheap enough for mapping millions of IDs to blocks. It never decodes anything, so the
+    // caller still has to check whether the object really exists in that block.
+    size_t find_block_range(osmium::item_type type, osmium::object_id_type id) const {
+        uint64_t key = object_key(type, id);
+        // Find the first block that starts strictly after the needle …
+        auto after = std::upper_bound(m_first_keys.begin(), m_first_keys.end(), key);
+        if (after == m_first_keys.begin()) {
+            return size();
+        }
+        // … so the needle can only be in the block before that, unless that block ends before the needle.
+        size_t block_index = (after - m_first_keys.begin()) - 1;
+        if (key > m_last_keys[block_index]) {
+            return size();
+        }
+        return block_index;
+    }
+
+    // Like find_block_range(), but also asks the block's Bloom filter (if any), which costs a page fault
+    // per lookup. Use this for point lookups that are about to read the block anyway.
+    size_t find_block(osmium::item_type type, osmium::object_id_type id) const {
+        size_t block_index = find_block_range(type, id);
+        if (block_index == size()) {
+            return size();
+        }
+        if (!bloom_may_contain(block_index, object_key(type, id))) {
+            m_bloom_rejections += 1;
+            return size();
+        }
+        return block_index;
+    }
+
+    // How often find_block() could prove that an object doesn't exist only because of the Bloom filters.
+    size_t bloom_rejections() const {
+        return m_bloom_rejections;
+    }
+
+    std::string read_blob(size_t block_index) const {
+        BlockMeta const& meta = block(block_index);
+        std::string blob(meta.datasize, '\0');
+        read_exact(&blob[0], meta.datasize, meta.file_offset);
+        return blob;
+    }
+
+    // Reads the blobs of blocks [first_block_index, last_block_index] with a single sequential read,
+    // including everything in between. Use blob_in_range() to get the individual blobs back out.
+    std::string read_blob_range(size_t first_block_index, size_t last_block_index) const {
+        BlockMeta const& first = block(first_block_index);
+        BlockMeta const& last = block(last_block_index);
+        size_t range_size = last.file_offset + last.datasize - first.file_offset;
+        std::string range(range_size, '\0');
+        read_exact(&range[0], range_size, first.file_offset);
+        return range;
+    }
+
+    // Same as read_blob(block_index), but cut out of a range that starts at first_block_index.
+    std::string blob_in_range(std::string const& range, size_t first_block_index, size_t block_index) const {
+        BlockMeta const& meta = block(block_index);
+        size_t offset_in_range = meta.file_offset - block(first_block_index).file_offset;
+        assert(offset_in_range + meta.datasize <= range.size());
+        return range.substr(offset_in_range, meta.datasize);
+    }
+
+    osmium::memory::Buffer decode_block(size_t block_index, osmium::io::read_meta read_metadata) const {
+        return decode_blob(read_blob(block_index), osmium::osm_entity_bits::all, read_metadata);
+    }
+
+    // Decompresses a blob as returned by read_blob(). The result may point into either blob or output.
+    static protozero::data_view decompress_blob(std::string const& blob, std::string& output) {
+        return osmium::io::detail::decode_blob(blob, output);
+    }
+
+    // Decompresses and parses a blob as returned by read_blob().
+    static osmium::memory::Buffer decode_blob(std::string const& blob, osmium::osm_entity_bits::type read_types, osmium::io::read_meta read_metadata) {
+        std::string output;
+        osmium::io::detail::PBFPrimitiveBlockDecoder decoder{decompress_blob(blob, output), read_types, read_metadata};
+        return decoder();
+    }
+
+private:
+    static uint64_t fnv1a(char const* data, size_t size) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    void read_exact(char* destination, size_t size, uint64_t file_offset) const {
+        while (size > 0) {
+            ssize_t got = pread(m_fd, destination, size, file_offset);
+            if (got <= 0) {
+                printf("Cannot read %lu bytes at offset %lu: %s\n", size, file_offset, got == 0 ? "unexpected EOF" : strerror(errno));
+                exit(1);
+            }
+            destination += got;
+            size -= got;
+            file_offset += got;
+        }
+    }
+
+    // Reads the BlobHeader at the given offset. Returns the offset of the Blob, and writes type and datasize.
+    uint64_t read_blob_header(uint64_t file_offset, std::string& type, uint32_t& datasize) const {
+        unsigned char size_bytes[4];
+        read_exact(reinterpret_cast<char*>(size_bytes), sizeof(size_bytes), file_offset);
+        uint32_t header_size = (uint32_t{size_bytes[0]} << 24) | (uint32_t{size_bytes[1]} << 16) | (uint32_t{size_bytes[2]} << 8) | uint32_t{size_bytes[3]};
+        if (header_size > MAX_BLOB_HEADER_SIZE) {
+            printf("BlobHeader at offset %lu claims to be %u bytes long, file is probably corrupt.\n", file_offset, header_size);
+            exit(1);
+        }
+        std::string header(header_size, '\0');
+        read_exact(&header[0], header_size, file_offset + sizeof(size_bytes));
+
+        type.clear();
+        datasize = 0;
+        protozero::pbf_message<FileFormat::BlobHeader> pbf_blob_header{header};
+        while (pbf_blob_header.next()) {
+            switch (pbf_blob_header.tag()) {
+            case FileFormat::BlobHeader::required_string_type:
+                type = pbf_blob_header.get_string();
+                break;
+            case FileFormat::BlobHeader::required_int32_datasize:
+                datasize = pbf_blob_header.get_int32();
+                break;
+            default:
+                pbf_blob_header.skip();
+            }
+        }
+        return file_offset + sizeof(size_bytes) + header_size;
+    }
+
+    // Hashing the OSMHeader blob is cheap and catches files that were replaced in-place with the same size and mtime.
+    uint64_t hash_first_blob() const {
+        std::string type;
+        uint32_t datasize;
+        uint64_t blob_offset = read_blob_header(0, type, datasize);
+        std::string blob(datasize, '\0');
+        read_exact(&blob[0], datasize, blob_offset);
+        return fnv1a(blob.data(), blob.size());
+    }
+
+    struct ScannedBlock {
+        BlockMeta meta;
+        std::vector<unsigned char> bloom;
+    };
+
+    // Scans all blocks and writes the sidecar, streaming the Bloom filters to disk as they come in.
+    // Returns false if the sidecar could not be written, in which case only the BlockMetas are usable.
+    bool build_sidecar(std::vector<BlockMeta>& blocks) {
+        // Write to a temporary file and rename it, so that concurrent runs never see a half-written sidecar.
+        std::string tmp_filename;
+        FILE* fp = open_unique_temporary(m_sidecar_filename, tmp_filename);
+        bool ok = fp != nullptr;
+        // The header is written again at the end, once the sizes are known.
+        ok = ok && fwrite(&m_expected_header, sizeof(m_expected_header), 1, fp) == 1;
+        uint64_t bloom_section_bytes = 0;
+        auto consume = [&](ScannedBlock&& scanned){
+            scanned.meta.bloom_offset = bloom_section_bytes;
+            ok = ok && fwrite(scanned.bloom.data(), 1, scanned.bloom.size(), fp) == scanned.bloom.size();
+            bloom_section_bytes += scanned.bloom.size();
+            blocks.push_back(scanned.meta);
+        };
+
+        // Decoding is by far the most expensive part, so do that on the pool, while this thread keeps walking the headers.
+        osmium::thread::Pool& pool = osmium::thread::Pool::default_instance();
+        size_t max_in_flight = pool.num_threads() * BUILD_BLOCKS_IN_FLIGHT_PER_THREAD;
+        std::deque<std::future<ScannedBlock>> in_flight;
+        uint64_t file_offset = 0;
+        while (file_offset < m_expected_header.pbf_file_size) {
+            std::string type;
+            uint32_t datasize;
+            uint64_t blob_offset = read_blob_header(file_offset, type, datasize);
+            file_offset = blob_offset + datasize;
+            if (type != "OSMData") {
+                // Most likely the "OSMHeader". Either way, there are no objects in here.
+                continue;
+            }
+            while (in_flight.size() >= max_in_flight) {
+                consume(in_flight.front().get());
+                in_flight.pop_front();
+            }
+            in_flight.push_back(pool.submit([this, blob_offset, datasize](){
+                return this->scan_block(blob_offset, datasize);
+            }));
+        }
+        for (auto& future : in_flight) {
+            consume(future.get());
+        }
+        if (!fp) {
+            return false;
+        }
+
+        // All filters are whole 8-byte words, so the BlockMetas behind them stay aligned.
+        m_expected_header.bloom_section_bytes = bloom_section_bytes;
+        m_expected_header.block_count = blocks.size();
+        ok = ok && fwrite(blocks.data(), sizeof(BlockMeta), blocks.size(), fp) == blocks.size();
+        ok = ok && fseek(fp, 0, SEEK_SET) == 0;
+        ok = ok && fwrite(&m_expected_header, sizeof(m_expected_header), 1, fp) == 1;
+        ok = (fclose(fp) == 0) && ok;
+        ok = ok && rename(tmp_filename.c_str(), m_sidecar_filename.c_str()) == 0;
+        if (!ok) {
+            unlink(tmp_filename.c_str());
+        }
+        return ok;
+    }
+
+    ScannedBlock scan_block(uint64_t blob_offset, uint32_t datasize) const {
+        ScannedBlock scanned {};
+        BlockMeta& meta = scanned.meta;
+        meta.file_offset = blob_offset;
+        meta.datasize = datasize;
+        std::string blob(datasize, '\0');
+        read_exact(&blob[0], datasize, blob_offset);
+        osmium::memory::Buffer buffer = decode_blob(blob, osmium::osm_entity_bits::all, osmium::io::read_meta::no);
+        std::vector<uint64_t> keys;
+        for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+            if (meta.empty()) {
+                meta.first_type = static_cast<uint16_t>(it->type());
+                meta.first_id = it->id();
+            }
+            meta.last_type = static_cast<uint16_t>(it->type());
+            meta.last_id = it->id();
+            keys.push_back(object_key(it->type(), it->id()));
+        }
+        meta.object_count = keys.size();
+
+        if (BLOCK_INDEX_BLOOM_BITS_PER_OBJECT > 0 && !keys.empty()) {
+            // Round up to whole 8-byte words, which also keeps the sidecar layout aligned.
+            size_t filter_bytes = (keys.size() * BLOCK_INDEX_BLOOM_BITS_PER_OBJECT + 63) / 64 * 8;
+            scanned.bloom.resize(filter_bytes);
+            for (uint64_t key : keys) {
+                for_each_bloom_bit(key, filter_bytes * 8, BLOCK_INDEX_BLOOM_HASHES, [&scanned](uint64_t bit){
+                    scanned.bloom[bit / 8] |= 1 << (bit % 8);
+                });
+            }
+            meta.bloom_bytes = filter_bytes;
+        }
+        return scanned;
+    }
+
+    bool bloom_may_contain(size_t block_index, uint64_t key) const {
+        BlockMeta const& meta = block(block_index);
+        if (meta.bloom_bytes == 0) {
+            return true;
+        }
+        unsigned char const* filter = m_bloom + meta.bloom_offset;
+        bool all_set = true;
+        for_each_bloom_bit(key, uint64_t{meta.bloom_bytes} * 8, m_expected_header.bloom_hashes, [filter, &all_set](uint64_t bit){
+            all_set = all_set && (filter[bit / 8] & (1 << (bit % 8)));
+        });
+        return all_set;
+    }
+
+    // Copies the key ranges into two compact arrays, so that lookups only touch 16 bytes per block
+    // instead of striding over the mapped BlockMetas.
+    void build_key_ranges() {
+        m_first_keys.reserve(m_block_count);
+        m_last_keys.reserve(m_block_count);
+        uint64_t previous_last_key = 0;
+        for (BlockMeta const& meta : *this) {
+            if (meta.empty()) {
+                // Must not break the ordering of m_first_keys, and must never match anything.
+                m_first_keys.push_back(previous_last_key + 1);
+                m_last_keys.push_back(0);
+                continue;
+            }
+            m_first_keys.push_back(object_key(meta.first_item_type(), meta.first_id));
+            m_last_keys.push_back(object_key(meta.last_item_type(), meta.last_id));
+            assert(m_first_keys.back() <= m_last_keys.back());
+            assert(m_first_keys.back() > previous_last_key || previous_last_key == 0);
+            previous_last_key = m_last_keys.back();
+        }
+    }
+
+    bool try_map_sidecar() {
+        int fd = open(m_sidecar_filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat sidecar_stat;
+        bool ok = fstat(fd, &sidecar_stat) == 0 && static_cast<size_t>(sidecar_stat.st_size) >= sizeof(SidecarHeader);
+        void* mapping = MAP_FAILED;
+        if (ok) {
+            mapping = mmap(nullptr, sidecar_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd); // The mapping stays valid.
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+        SidecarHeader const& header = *static_cast<SidecarHeader const*>(mapping);
+        // Compare everything except the sizes, which we don't know in advance:
+        SidecarHeader expected = m_expected_header;
+        expected.bloom_section_bytes = header.bloom_section_bytes;
+        expected.block_count = header.block_count;
+        if (memcmp(&header, &expected, sizeof(SidecarHeader)) != 0
+                || sidecar_stat.st_size != static_cast<off_t>(sizeof(SidecarHeader) + header.bloom_section_bytes + header.block_count * sizeof(BlockMeta))) {
+            munmap(mapping, sidecar_stat.st_size);
+            return false;
+        }
+        m_mapping = mapping;
+        m_mapping_size = sidecar_stat.st_size;
+        m_bloom = static_cast<unsigned char const*>(mapping) + sizeof(SidecarHeader);
+        m_blocks = reinterpret_cast<BlockMeta const*>(m_bloom + header.bloom_section_bytes);
+        m_block_count = header.block_count;
+        // The filters are probed at random, so don't let the kernel read ahead there. The block metadata
+        // after them is read front to back when loading.
+        if (header.bloom_section_bytes > 0) {
+            madvise(mapping, sizeof(SidecarHeader) + header.bloom_section_bytes, MADV_RANDOM);
+        }
+        return true;
+    }
+
+    std::string m_pbf_filename;
+    std::string m_sidecar_filename;
+    int m_fd {-1};
+    SidecarHeader m_expected_header;
+    void* m_mapping {nullptr};
+    size_t m_mapping_size {0};
+    std::vector<BlockMeta> m_owned_blocks;
+    BlockMeta const* m_blocks {nullptr};
+    unsigned char const* m_bloom {nullptr};
+    size_t m_block_count {0};
+    bool m_loaded_from_sidecar {false};
+    std::vector<uint64_t> m_first_keys;
+    std::vector<uint64_t> m_last_keys;
+    mutable std::atomic<size_t> m_bloom_rejections {0};
+};
+
+// The blocks that may contain the given node IDs, sorted and distinct. for_each_node_id(func) calls func(node_id) for
+// each ID; that's cheapest if they come in ascending order, because then each block only comes up once.
+template <typename TForEachNodeId>
+static std::vector<size_t> blocks_of_nodes(PbfBlockIndex const& index, TForEachNodeId&& for_each_node_id) {
+    std::vector<size_t> blocks;
+    bool ascending = true;
+    for_each_node_id([&index, &blocks, &ascending](osmium::object_id_type node_id){
+        size_t block_index = index.find_block_range(osmium::item_type::node, node_id);
+        if (block_index == index.size() || (!blocks.empty() && blocks.back() == block_index)) {
+            return;
+        }
+        ascending = ascending && (blocks.empty() || blocks.back() < block_index);
+        blocks.push_back(block_index);
+    });
+    if (!ascending) {
+        std::sort(blocks.begin(), blocks.end());
+        blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    }
+    return blocks;
+}
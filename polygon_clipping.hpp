@@ -0,0 +1,273 @@
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/location.hpp>
+
+// In degrees for locations, or whatever coordinates the points use.
+struct ClipRect {
+    double min_x;
+    double min_y;
+    double max_x;
+    double max_y;
+};
+
+struct ClipPoint {
+    double x;
+    double y;
+
+    bool operator==(ClipPoint const& other) const {
+        return x == other.x && y == other.y;
+    }
+
+    bool operator<(ClipPoint const& other) const {
+        return x < other.x || (x == other.x && y < other.y);
+    }
+};
+
+// One step of Sutherland-Hodgman: Keeps the part of the open ring on one side of the line where the coordinate
+// (x for axis 0, y for axis 1) equals bound, and connects the pieces along that line.
+static void clip_ring_against(std::vector<ClipPoint> const& input, int axis, double bound, bool keep_above, std::vector<ClipPoint>& output) {
+    output.clear();
+    if (input.empty()) {
+        return;
+    }
+    auto coordinate = [axis](ClipPoint const& point){
+        return axis == 0 ? point.x : point.y;
+    };
+    auto inside = [&coordinate, bound, keep_above](ClipPoint const& point){
+        return keep_above ? coordinate(point) >= bound : coordinate(point) <= bound;
+    };
+    ClipPoint previous = input.back();
+    for (ClipPoint const& current : input) {
+        bool current_inside = inside(current);
+        if (current_inside != inside(previous)) {
+            // Always interpolate from the same end, so that a border that two rings walk in opposite directions
+            // gets exactly the same crossing in both.
+            bool swap = current.x < previous.x || (current.x == previous.x && current.y < previous.y);
+            ClipPoint const& from = swap ? current : previous;
+            ClipPoint const& to = swap ? previous : current;
+            double t = (bound - coordinate(from)) / (coordinate(to) - coordinate(from));
+            ClipPoint crossing {from.x + t * (to.x - from.x), from.y + t * (to.y - from.y)};
+            (axis == 0 ? crossing.x : crossing.y) = bound;
+            output.push_back(crossing);
+        }
+        if (current_inside) {
+            output.push_back(current);
+        }
+        previous = current;
+    }
+}
+
+// Which edge of the rectangle the segment runs along (0 to 3), or -1 if it doesn't. Sutherland-Hodgman puts the points
+// on an edge exactly onto it, so this can compare exactly.
+static int clip_edge_of(ClipPoint const& a, ClipPoint const& b, ClipRect const& rect) {
+    if (a.x == rect.min_x && b.x == rect.min_x) {
+        return 0;
+    }
+    if (a.x == rect.max_x && b.x == rect.max_x) {
+        return 1;
+    }
+    if (a.y == rect.min_y && b.y == rect.min_y) {
+        return 2;
+    }
+    if (a.y == rect.max_y && b.y == rect.max_y) {
+        return 3;
+    }
+    return -1;
+}
+
+// Sutherland-Hodgman connects all pieces of a ring by runs along the edges. Where the ring leaves and comes back
+// several times, those runs overlap in opposite directions, which leaves zero-width spikes, and bridges between pieces
+// that should be separate rings. This cancels out the overlapping parts of the runs on each edge, and then links the
+// remaining segments into rings again, which fill exactly the same area, with the same orientation.
+// Appends the rings to output, without closing points.
+static void split_clipped_ring(std::vector<ClipPoint> const& points, ClipRect const& rect, std::vector<std::vector<ClipPoint>>& output) {
+    using Segment = std::pair<ClipPoint, ClipPoint>;
+    std::vector<Segment> segments;
+    // For each edge, the runs along it as (from, to), in the coordinate that changes along the edge.
+    std::vector<std::pair<double, double>> runs[4];
+    bool any_runs = false;
+    for (size_t i = 0; i < points.size(); ++i) {
+        ClipPoint const& a = points[i];
+        ClipPoint const& b = points[(i + 1) % points.size()];
+        if (a == b) {
+            continue;
+        }
+        int edge = clip_edge_of(a, b, rect);
+        if (edge < 0) {
+            segments.emplace_back(a, b);
+            continue;
+        }
+        runs[edge].emplace_back(edge < 2 ? a.y : a.x, edge < 2 ? b.y : b.x);
+        any_runs = true;
+    }
+    if (!any_runs) {
+        // Nothing to cancel, e.g. because the ring was inside all along.
+        if (points.size() >= 3) {
+            output.push_back(points);
+        }
+        return;
+    }
+
+    for (int edge = 0; edge < 4; ++edge) {
+        auto edge_point = [&rect, edge](double position){
+            switch (edge) {
+            case 0:
+                return ClipPoint{rect.min_x, position};
+            case 1:
+                return ClipPoint{rect.max_x, position};
+            case 2:
+                return ClipPoint{position, rect.min_y};
+            default:
+                return ClipPoint{position, rect.max_y};
+            }
+        };
+        std::vector<double> breaks;
+        for (auto const& run : runs[edge]) {
+            breaks.push_back(run.first);
+            breaks.push_back(run.second);
+        }
+        std::sort(breaks.begin(), breaks.end());
+        breaks.erase(std::unique(breaks.begin(), breaks.end()), breaks.end());
+        // How often the runs cover the interval from each break to the next one, forwards minus backwards.
+        std::vector<int> coverage(breaks.size(), 0);
+        for (auto const& run : runs[edge]) {
+            int direction = run.first < run.second ? 1 : -1;
+            coverage[std::lower_bound(breaks.begin(), breaks.end(), std::min(run.first, run.second)) - breaks.begin()] += direction;
+            coverage[std::lower_bound(breaks.begin(), breaks.end(), std::max(run.first, run.second)) - breaks.begin()] -= direction;
+        }
+        for (size_t i = 1; i < coverage.size(); ++i) {
+            coverage[i] += coverage[i - 1];
+        }
+        // What's left are the intervals with non-zero coverage. Neighbouring intervals with the same coverage become
+        // a single segment, because every point on the edge stays balanced either way.
+        size_t begin = 0;
+        while (begin + 1 < breaks.size()) {
+            size_t end = begin + 1;
+            while (end + 1 < breaks.size() && coverage[end] == coverage[begin]) {
+                ++end;
+            }
+            for (int i = 0; i < std::abs(coverage[begin]); ++i) {
+                if (coverage[begin] > 0) {
+                    segments.emplace_back(edge_point(breaks[begin]), edge_point(breaks[end]));
+                } else {
+                    segments.emplace_back(edge_point(breaks[end]), edge_point(breaks[begin]));
+                }
+            }
+            begin = end;
+        }
+    }
+
+    // Every point still has as many segments going in as going out, so following the segments from any start
+    // always leads back to it.
+    std::sort(segments.begin(), segments.end(), [](Segment const& a, Segment const& b){
+        return a.first < b.first;
+    });
+    std::vector<bool> used(segments.size(), false);
+    for (size_t first = 0; first < segments.size(); ++first) {
+        if (used[first]) {
+            continue;
+        }
+        std::vector<ClipPoint> ring;
+        size_t current = first;
+        while (true) {
+            used[current] = true;
+            ring.push_back(segments[current].first);
+            ClipPoint const& next_point = segments[current].second;
+            if (next_point == segments[first].first) {
+                break;
+            }
+            auto it = std::lower_bound(segments.begin(), segments.end(), next_point, [](Segment const& segment, ClipPoint const& point){
+                return segment.first < point;
+            });
+            size_t next = it - segments.begin();
+            while (next < segments.size() && segments[next].first == next_point && used[next]) {
+                ++next;
+            }
+            if (next == segments.size() || !(segments[next].first == next_point)) {
+                // Can't happen, see above. Better lose the ring than write garbage.
+                ring.clear();
+                break;
+            }
+            current = next;
+        }
+        if (ring.size() >= 3) {
+            output.push_back(std::move(ring));
+        }
+    }
+}
+
+// Clips the open ring (without a closing point) to the rectangle, and appends what's left to output, as open rings.
+// Wherever the ring leaves the rectangle, the part outside is replaced by a run along the edge. Where it leaves and
+// comes back several times, it may fall apart into several rings, see split_clipped_ring(). Together, they fill
+// exactly the same area inside the rectangle as the ring, and have the same orientation. Rings with fewer than 3 points
+// have no area, so they are left out.
+static void clip_open_ring(std::vector<ClipPoint> const& points, ClipRect const& rect, std::vector<std::vector<ClipPoint>>& output) {
+    std::vector<ClipPoint> clipped;
+    std::vector<ClipPoint> clipped_again;
+    clip_ring_against(points, 0, rect.min_x, true, clipped);
+    clip_ring_against(clipped, 0, rect.max_x, false, clipped_again);
+    clip_ring_against(clipped_again, 1, rect.min_y, true, clipped);
+    clip_ring_against(clipped, 1, rect.max_y, false, clipped_again);
+    split_clipped_ring(clipped_again, rect, output);
+}
+
+// Clips a closed ring (first location == last location) to the rectangle, see clip_open_ring(), and appends what's
+// left to output, as closed rings.
+static void clip_ring(std::vector<osmium::Location> const& ring, ClipRect const& rect, std::vector<std::vector<osmium::Location>>& output) {
+    if (ring.size() < 4) {
+        return;
+    }
+    ClipRect bbox {ring.front().lon(), ring.front().lat(), ring.front().lon(), ring.front().lat()};
+    for (osmium::Location const& location : ring) {
+        bbox.min_x = std::min(bbox.min_x, location.lon());
+        bbox.min_y = std::min(bbox.min_y, location.lat());
+        bbox.max_x = std::max(bbox.max_x, location.lon());
+        bbox.max_y = std::max(bbox.max_y, location.lat());
+    }
+    if (bbox.max_x < rect.min_x || bbox.min_x > rect.max_x || bbox.max_y < rect.min_y || bbox.min_y > rect.max_y) {
+        return;
+    }
+    if (bbox.min_x >= rect.min_x && bbox.max_x <= rect.max_x && bbox.min_y >= rect.min_y && bbox.max_y <= rect.max_y) {
+        output.push_back(ring);
+        return;
+    }
+    // Without the closing location, Sutherland-Hodgman closes implicitly.
+    std::vector<ClipPoint> points;
+    points.reserve(ring.size() - 1);
+    for (size_t i = 0; i + 1 < ring.size(); ++i) {
+        points.push_back(ClipPoint{ring[i].lon(), ring[i].lat()});
+    }
+    std::vector<std::vector<ClipPoint>> pieces;
+    clip_open_ring(points, rect, pieces);
+    for (auto const& piece : pieces) {
+        std::vector<osmium::Location> closed;
+        closed.reserve(piece.size() + 1);
+        for (ClipPoint const& point : piece) {
+            closed.push_back(osmium::Location{point.x, point.y});
+        }
+        closed.push_back(closed.front());
+        output.push_back(std::move(closed));
+    }
+}
+
+// Whether the point lies inside the ring, by counting crossings. The ring may be closed or not. Points on the boundary
+// may go either way. Works for any point type with x and y, e.g. ClipPoint.
+template <typename TPoint>
+static bool ring_contains(std::vector<TPoint> const& ring, TPoint const& point) {
+    bool inside = false;
+    for (size_t i = 0; i < ring.size(); ++i) {
+        TPoint const& a = ring[i];
+        TPoint const& b = ring[(i + 1) % ring.size()];
+        if ((a.y > point.y) != (b.y > point.y)) {
+            double crossing_x = a.x + static_cast<double>(point.y - a.y) / static_cast<double>(b.y - a.y) * static_cast<double>(b.x - a.x);
+            if (point.x < crossing_x) {
+                inside = !inside;
+            }
+        }
+    }
+    return inside;
+}
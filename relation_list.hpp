@@ -1,3 +1,7 @@
+#include <iterator>
+
+#include "selection.hpp"
+
 const osmium::object_id_type EXPORT_RELATIONS[] = {
     62611, // D BaWü
     2145268, // D Bay
@@ -34,14 +38,10 @@ const osmium::object_id_type THICK_STROKE[] = {
     16239, // AT Gesamt
 };
 
+static const IdSet RELEVANT_RELATIONS {std::begin(EXPORT_RELATIONS), std::end(EXPORT_RELATIONS)};
+
 static bool is_relevant_relation(osmium::object_id_type relation_id) {
-    // TODO: Linear scan with 27 items … dunno if that's efficient or not.
-    for (auto interesting_relation : EXPORT_RELATIONS) {
-        if (interesting_relation == relation_id) {
-            return true;
-        }
-    }
-    return false;
+    return RELEVANT_RELATIONS.contains(relation_id);
 }
 static bool is_thick_stroke_relation(osmium::object_id_type relation_id) {
     for (auto interesting_relation : THICK_STROKE) {
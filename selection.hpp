@@ -0,0 +1,295 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <osmium/handler.hpp>
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/entity_bits.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "pbf_block_index.hpp"
+
+// What the extract tools select. Each predicate answers three questions, from cheapest to most expensive:
+//   may_match_block(meta): Can any object in this block match? Only uses the block index, so nothing gets decoded.
+//   matches_id(type, id): Does the object match, judging only by its type and ID?
+//   matches(object): Everything else, i.e. tags and locations. Only asked if matches_id() said yes.
+// Predicates are plain values, and AllOf<…> combines them at compile time, so a handler's check inlines
+// to a handful of comparisons instead of calls through function pointers.
+// Use is_selected(selection, object) in handlers, and selected_blocks(index, selection) to skip whole blocks.
+
+// Calls func(type, first_id, last_id) for each type in the block, with the ID range that this type may use
+// in it, and returns whether any call returned true. The range is numeric, i.e. first_id <= last_id.
+template <typename TFunc>
+static bool any_block_id_range(BlockMeta const& meta, TFunc&& func) {
+    if (meta.empty()) {
+        return false;
+    }
+    for (auto type : {osmium::item_type::node, osmium::item_type::way, osmium::item_type::relation}) {
+        if (type < meta.first_item_type() || type > meta.last_item_type()) {
+            continue;
+        }
+        osmium::object_id_type first_id = type == meta.first_item_type() ? meta.first_id : 0;
+        osmium::object_id_type last_id = type == meta.last_item_type() ? meta.last_id : std::numeric_limits<osmium::object_id_type>::max();
+        // The block is in file order, where 0 and the negative IDs come first, by absolute value (see
+        // object_id_less()). So a range that starts there can contain any negative ID, unless it also ends there.
+        if (first_id <= 0) {
+            if (last_id > 0) {
+                first_id = std::numeric_limits<osmium::object_id_type>::min();
+            } else {
+                std::swap(first_id, last_id);
+            }
+        }
+        if (func(type, first_id, last_id)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct AnyObject {
+    static constexpr osmium::osm_entity_bits::type entity_bits = osmium::osm_entity_bits::nwr;
+
+    bool may_match_block(BlockMeta const& meta) const {
+        return !meta.empty();
+    }
+
+    bool matches_id(osmium::item_type, osmium::object_id_type) const {
+        return true;
+    }
+
+    bool matches(osmium::OSMObject const&) const {
+        return true;
+    }
+};
+
+template <osmium::item_type TType>
+struct OfType {
+    // Same as osmium::osm_entity_bits::from_item_type(), which isn't constexpr.
+    static constexpr osmium::osm_entity_bits::type entity_bits = static_cast<osmium::osm_entity_bits::type>(1U << (static_cast<unsigned>(TType) - 1U));
+
+    bool may_match_block(BlockMeta const& meta) const {
+        return !meta.empty() && meta.first_item_type() <= TType && TType <= meta.last_item_type();
+    }
+
+    bool matches_id(osmium::item_type type, osmium::object_id_type) const {
+        return type == TType;
+    }
+
+    bool matches(osmium::OSMObject const&) const {
+        return true;
+    }
+};
+
+// Every modulo-th ID, like the benchmark selection. A block is only worth decoding if its ID range
+// contains a multiple, which for large moduli is true for very few blocks.
+struct IdModulo {
+    static constexpr osmium::osm_entity_bits::type entity_bits = osmium::osm_entity_bits::nwr;
+
+    osmium::object_id_type modulo;
+
+    bool may_match_block(BlockMeta const& meta) const {
+        return any_block_id_range(meta, [this](osmium::item_type, osmium::object_id_type first_id, osmium::object_id_type last_id){
+            // The largest multiple that is <= last_id. For negative IDs, the division rounds up instead, which can
+            // only keep a block too many.
+            return last_id / modulo * modulo >= first_id;
+        });
+    }
+
+    bool matches_id(osmium::item_type, osmium::object_id_type id) const {
+        return id % modulo == 0;
+    }
+
+    bool matches(osmium::OSMObject const&) const {
+        return true;
+    }
+};
+
+// An explicit list of IDs, kept sorted so that both single lookups and block ranges are binary searches.
+// Note that the IDs apply to every type; combine with OfType<…> to restrict that.
+class IdSet {
+public:
+    static constexpr osmium::osm_entity_bits::type entity_bits = osmium::osm_entity_bits::nwr;
+
+    template <typename TIterator>
+    IdSet(TIterator begin, TIterator end)
+        : m_ids(begin, end)
+    {
+        std::sort(m_ids.begin(), m_ids.end());
+        m_ids.erase(std::unique(m_ids.begin(), m_ids.end()), m_ids.end());
+    }
+
+    bool contains(osmium::object_id_type id) const {
+        return std::binary_search(m_ids.begin(), m_ids.end(), id);
+    }
+
+    size_t size() const {
+        return m_ids.size();
+    }
+
+    // Sorted and unique.
+    std::vector<osmium::object_id_type> const& ids() const {
+        return m_ids;
+    }
+
+    bool may_match_block(BlockMeta const& meta) const {
+        return any_block_id_range(meta, [this](osmium::item_type, osmium::object_id_type first_id, osmium::object_id_type last_id){
+            auto it = std::lower_bound(m_ids.begin(), m_ids.end(), first_id);
+            return it != m_ids.end() && *it <= last_id;
+        });
+    }
+
+    bool matches_id(osmium::item_type, osmium::object_id_type id) const {
+        return contains(id);
+    }
+
+    bool matches(osmium::OSMObject const&) const {
+        return true;
+    }
+
+private:
+    std::vector<osmium::object_id_type> m_ids;
+};
+
+// Objects with the tag key, and optionally also the given value. The strings must outlive the predicate.
+struct HasTag {
+    static constexpr osmium::osm_entity_bits::type entity_bits = osmium::osm_entity_bits::nwr;
+
+    const char* key;
+    const char* value {nullptr};
+
+    bool may_match_block(BlockMeta const& meta) const {
+        return !meta.empty();
+    }
+
+    bool matches_id(osmium::item_type, osmium::object_id_type) const {
+        return true;
+    }
+
+    bool matches(osmium::OSMObject const& object) const {
+        const char* found = object.tags().get_value_by_key(key);
+        return found && (!value || strcmp(found, value) == 0);
+    }
+};
+
+// Nodes inside the box. Ways and relations have no location of their own until they are resolved,
+// so they always pass here; the tools that resolve them have to check the result themselves.
+struct InBox {
+    static constexpr osmium::osm_entity_bits::type entity_bits = osmium::osm_entity_bits::nwr;
+
+    osmium::Box box;
+
+    bool may_match_block(BlockMeta const& meta) const {
+        return !meta.empty();
+    }
+
+    bool matches_id(osmium::item_type, osmium::object_id_type) const {
+        return true;
+    }
+
+    bool matches(osmium::OSMObject const& object) const {
+        if (object.type() != osmium::item_type::node) {
+            return true;
+        }
+        return box.contains(static_cast<osmium::Node const&>(object).location());
+    }
+};
+
+// Conjunction of all the predicates. Each stage short-circuits, and all ID checks run before any full check.
+template <typename... TPredicates>
+class AllOf {
+public:
+    static constexpr osmium::osm_entity_bits::type entity_bits = static_cast<osmium::osm_entity_bits::type>((static_cast<unsigned>(TPredicates::entity_bits) & ... & unsigned{osmium::osm_entity_bits::nwr}));
+
+    explicit AllOf(TPredicates... predicates)
+        : m_predicates(std::move(predicates)...)
+    {
+    }
+
+    bool may_match_block(BlockMeta const& meta) const {
+        return std::apply([&meta](auto const&... predicate){
+            return (predicate.may_match_block(meta) && ...);
+        }, m_predicates);
+    }
+
+    bool matches_id(osmium::item_type type, osmium::object_id_type id) const {
+        return std::apply([type, id](auto const&... predicate){
+            return (predicate.matches_id(type, id) && ...);
+        }, m_predicates);
+    }
+
+    bool matches(osmium::OSMObject const& object) const {
+        return std::apply([&object](auto const&... predicate){
+            return (predicate.matches(object) && ...);
+        }, m_predicates);
+    }
+
+private:
+    std::tuple<TPredicates...> m_predicates;
+};
+
+template <typename TSelection>
+static bool is_selected(TSelection const& selection, osmium::OSMObject const& object) {
+    return selection.matches_id(object.type(), object.id()) && selection.matches(object);
+}
+
+// Hands only the selected objects on to the wrapped handler.
+template <typename TSelection, typename THandler>
+class SelectingHandler : public osmium::handler::Handler {
+public:
+    SelectingHandler(TSelection const& selection, THandler& handler)
+        : m_selection(selection)
+        , m_handler(handler)
+    {
+    }
+
+    void node(const osmium::Node& node) {
+        if (is_selected(m_selection, node))
+            m_handler.node(node);
+    }
+
+    void way(const osmium::Way& way) {
+        if (is_selected(m_selection, way))
+            m_handler.way(way);
+    }
+
+    void relation(const osmium::Relation& relation) {
+        if (is_selected(m_selection, relation))
+            m_handler.relation(relation);
+    }
+
+private:
+    TSelection const& m_selection;
+    THandler& m_handler;
+};
+
+// The blocks that may contain selected objects, in file order. Everything else never needs to be read.
+template <typename TSelection>
+static std::vector<size_t> selected_blocks(PbfBlockIndex const& index, TSelection const& selection) {
+    std::vector<size_t> blocks;
+    for (size_t block_index = 0; block_index < index.size(); ++block_index) {
+        if (selection.may_match_block(index.block(block_index))) {
+            blocks.push_back(block_index);
+        }
+    }
+    return blocks;
+}
+
+// The benchmark selection of the extract_some_* tools: Every modulo-th object of the given type.
+template <osmium::item_type TType>
+using TypeModuloSelection = AllOf<OfType<TType>, IdModulo>;
+
+template <osmium::item_type TType>
+static TypeModuloSelection<TType> type_modulo_selection(osmium::object_id_type modulo) {
+    return TypeModuloSelection<TType>{OfType<TType>{}, IdModulo{modulo}};
+}
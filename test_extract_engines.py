@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+
+# Runs every engine of extract_some_ways, and the random access and linear scan tools, on the same input, and checks
+# that they all print exactly the same ways and locations. Usually called through the build: ctest --test-dir build
+# Or directly: ./test_extract_engines.py --build-dir build --input germany.osm.pbf
+
+import argparse
+import os
+import subprocess
+import sys
+
+ENGINE_VARIABLE = "EXTRACT_SOME_WAYS_ENGINE"  # See ENGINE_ENVIRONMENT_VARIABLE in extract_some_ways.cpp
+RUNS = [
+    # (name, executable, engine)
+    ("scan", "extract_some_ways", "scan"),
+    ("lookup", "extract_some_ways", "lookup"),
+    ("coalesced", "extract_some_ways", "coalesced"),
+    ("random_access", "extract_some_ways_random_access", None),
+    ("linear_scan", "extract_some_ways_linear_scan", None),
+]
+DEFAULT_MODULO = 10_007
+
+
+def run_once(executable, engine, input_filename, modulo):
+    env = dict(os.environ)
+    env.pop(ENGINE_VARIABLE, None)
+    if engine:
+        env[ENGINE_VARIABLE] = engine
+    proc = subprocess.run([executable, input_filename, str(modulo)], stdout=subprocess.PIPE, stderr=subprocess.STDOUT, env=env, text=True)
+    lines = proc.stdout.splitlines()
+    if proc.returncode != 0:
+        print(f"{executable} failed with exit code {proc.returncode}, last output:", file=sys.stderr)
+        print("\n".join(lines[-10:]), file=sys.stderr)
+        sys.exit(1)
+    return [line for line in lines if line and not line.startswith("#")]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Check that all ways to extract ways agree.")
+    parser.add_argument("--build-dir", default="build", help="Where the executables are")
+    parser.add_argument("--input", required=True, help="PBF file that everything runs on")
+    parser.add_argument("--modulo", type=int, default=DEFAULT_MODULO, help="Every n-th way ID is selected")
+    args = parser.parse_args()
+
+    reference_name = None
+    reference = None
+    for name, executable_name, engine in RUNS:
+        print(f"# Running {name} …", file=sys.stderr)
+        output = run_once(os.path.join(args.build_dir, executable_name), engine, args.input, args.modulo)
+        if reference is None:
+            reference_name = name
+            reference = output
+            print(f"#   {len(output)} ways", file=sys.stderr)
+            continue
+        if output != reference:
+            differing = [(a, b) for a, b in zip(reference, output) if a != b]
+            print(f"{name} disagrees with {reference_name}: {len(output)} vs. {len(reference)} ways, {len(differing)} lines differ, e.g.:", file=sys.stderr)
+            for a, b in differing[:10]:
+                print(f"  {reference_name}: {a}    {name}: {b}", file=sys.stderr)
+            sys.exit(1)
+    print(f"# All {len(RUNS)} runs agree.", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <osmium/handler.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+
+#include "output_buffer.hpp"
+#include "way_node_merge.hpp"
+
+// Full geometries of the collected ways: Every node ref gets its location, in way order. The locations live
+// in one flat array in the same order as the node refs of the WayNodeList. To fill them, the refs are sorted by
+// node ID once, and then merged against any sorted stream of nodes: A whole node pass (node()), or individual
+// decoded blocks (merge_block(), which may be called concurrently for different blocks). Or they are just looked
+// up (resolve_all()).
+class WayGeometries : public osmium::handler::Handler {
+public:
+    explicit WayGeometries(WayNodeList const& ways)
+        : m_ways(ways)
+    {
+        m_first_position.reserve(ways.size() + 1);
+        m_refs.reserve(ways.total_nodes());
+        size_t position = 0;
+        for (size_t way_index = 0; way_index < ways.size(); ++way_index) {
+            m_first_position.push_back(position);
+            ways.for_each_node(way_index, [this, &position](osmium::object_id_type node_id){
+                m_refs.emplace_back(node_id, position++);
+            });
+        }
+        m_first_position.push_back(position);
+        // In file order, which only differs from plain numeric order for negative IDs.
+        std::sort(m_refs.begin(), m_refs.end(), [](std::pair<osmium::object_id_type, size_t> const& lhs, std::pair<osmium::object_id_type, size_t> const& rhs){
+            return object_id_less(lhs.first, rhs.first) || (lhs.first == rhs.first && lhs.second < rhs.second);
+        });
+        m_locations.resize(position);
+    }
+    WayGeometries(const WayGeometries&) = delete;
+    WayGeometries(WayGeometries&&) = delete;
+    WayGeometries& operator=(const WayGeometries&) = delete;
+    WayGeometries& operator=(WayGeometries&&) = delete;
+
+    // All node refs, sorted by node ID, as (node ID, position).
+    std::vector<std::pair<osmium::object_id_type, size_t>> const& sorted_refs() const {
+        return m_refs;
+    }
+
+    void node(const osmium::Node& node) {
+        merge_node(node, m_next, m_refs.size());
+    }
+
+    // Merges one decoded block against the refs [begin, end), which must be the ones that fall into this block.
+    void merge_block(osmium::memory::Buffer const& buffer, size_t begin, size_t end) {
+        for (auto it = buffer.begin<osmium::Node>(); it != buffer.end<osmium::Node>() && begin < end; ++it) {
+            merge_node(*it, begin, end);
+        }
+    }
+
+    // Instead of merging nodes: Looks up every ref, e.g. with NodeLocationStore::get(), in ascending node order.
+    template <typename TGetLocation>
+    void resolve_all(TGetLocation&& get_location) {
+        for (auto const& ref : m_refs) {
+            m_locations[ref.second] = get_location(ref.first);
+        }
+    }
+
+    WayNodeList const& ways() const {
+        return m_ways;
+    }
+
+    size_t node_count(size_t way_index) const {
+        return m_first_position[way_index + 1] - m_first_position[way_index];
+    }
+
+    osmium::Location const* locations(size_t way_index) const {
+        return m_locations.data() + m_first_position[way_index];
+    }
+
+    size_t unresolved() const {
+        return std::count_if(m_locations.begin(), m_locations.end(), [](osmium::Location const& loc){
+            return !loc;
+        });
+    }
+
+private:
+    void merge_node(const osmium::Node& node, size_t& next, size_t end) {
+        // Refs before this node are not in the dataset, so they stay undefined.
+        while (next < end && object_id_less(m_refs[next].first, node.id())) {
+            ++next;
+        }
+        // Several refs (of the same or different ways) may point to this node.
+        while (next < end && m_refs[next].first == node.id()) {
+            m_locations[m_refs[next].second] = node.location();
+            ++next;
+        }
+    }
+
+    WayNodeList const& m_ways;
+    std::vector<size_t> m_first_position;
+    std::vector<std::pair<osmium::object_id_type, size_t>> m_refs;
+    size_t m_next {0};
+    std::vector<osmium::Location> m_locations;
+};
+
+// Compact binary geometry file. All integers are little-endian, as written by x86:
+//     char magic[8] = "OSMWGEO\0"; uint32_t version; uint32_t reserved; uint64_t way_count;
+//     way_count times: int64_t way_id; uint32_t node_count; node_count times: int32_t x, int32_t y.
+// Coordinates are osmium's fixed-point 1e-7 degrees. Unresolved nodes are written as osmium's undefined Location.
+static const char WAY_GEOMETRY_MAGIC[8] = {'O', 'S', 'M', 'W', 'G', 'E', 'O', '\0'};
+static const uint32_t WAY_GEOMETRY_VERSION = 1;
+
+static void write_way_geometries_binary(WayGeometries const& geometries, const char* const output_filename) {
+    FILE* fp = fopen(output_filename, "wb");
+    if (!fp) {
+        printf("Cannot write %s: %s\n", output_filename, strerror(errno));
+        exit(1);
+    }
+    WayNodeList const& ways = geometries.ways();
+    uint32_t version_and_reserved[2] = {WAY_GEOMETRY_VERSION, 0};
+    uint64_t way_count = ways.size();
+    bool ok = fwrite(WAY_GEOMETRY_MAGIC, sizeof(WAY_GEOMETRY_MAGIC), 1, fp) == 1
+        && fwrite(version_and_reserved, sizeof(version_and_reserved), 1, fp) == 1
+        && fwrite(&way_count, sizeof(way_count), 1, fp) == 1;
+    for (size_t way_index = 0; ok && way_index < ways.size(); ++way_index) {
+        int64_t way_id = ways.way_id(way_index);
+        uint32_t node_count = geometries.node_count(way_index);
+        osmium::Location const* locations = geometries.locations(way_index);
+        ok = fwrite(&way_id, sizeof(way_id), 1, fp) == 1
+            && fwrite(&node_count, sizeof(node_count), 1, fp) == 1
+            && fwrite(locations, sizeof(osmium::Location), node_count, fp) == node_count;
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+        printf("Cannot write %s, disk full?!\n", output_filename);
+        exit(1);
+    }
+}
+
+// One LineString feature per way, skipping unresolved nodes. Ways with fewer than two resolved nodes get a null geometry.
+static void write_way_geometries_geojson(WayGeometries const& geometries, const char* const output_filename) {
+    OutputBuffer out {output_filename, false};
+    WayNodeList const& ways = geometries.ways();
+    out.write("{\"type\": \"FeatureCollection\", \"features\": [\n");
+    for (size_t way_index = 0; way_index < ways.size(); ++way_index) {
+        osmium::Location const* locations = geometries.locations(way_index);
+        size_t node_count = geometries.node_count(way_index);
+        size_t resolved = std::count_if(locations, locations + node_count, [](osmium::Location const& loc){
+            return static_cast<bool>(loc);
+        });
+        out.write(way_index ? ",\n{\"type\":\"Feature\",\"geometry\":" : "{\"type\":\"Feature\",\"geometry\":");
+        if (resolved < 2) {
+            out.write("null");
+        } else {
+            out.write("{\"type\":\"LineString\",\"coordinates\":[");
+            bool first_point = true;
+            for (size_t i = 0; i < node_count; ++i) {
+                if (!locations[i]) {
+                    continue;
+                }
+                if (!first_point) {
+                    out.write(',');
+                }
+                // 7 digits is what osmium stores, i.e. about 1 cm.
+                out.write('[');
+                out.write_fixed(locations[i].lon(), 7);
+                out.write(',');
+                out.write_fixed(locations[i].lat(), 7);
+                out.write(']');
+                first_point = false;
+            }
+            out.write("]}");
+        }
+        out.write_format(",\"properties\":{\"way_id\":\"%ld\"}}", ways.way_id(way_index));
+    }
+    out.write("\n]}\n");
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <protozero/varint.hpp>
+
+#include <osmium/handler.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "selection.hpp"
+
+// The linear-scan engine: Collect the selected ways in a first pass, then merge their node IDs
+// against the sorted node stream of a second pass.
+
+// One node ref of a selected way, as the merge needs it. The position within the way lets the merge pick the first
+// resolvable node in way order, just like the lookup engines do, instead of the one with the lowest ID.
+struct MergeEntry {
+    osmium::object_id_type node_id;
+    uint32_t way_index;
+    uint32_t position;
+
+    bool operator<(MergeEntry const& other) const {
+        return object_id_less(node_id, other.node_id) || (node_id == other.node_id && way_index < other.way_index);
+    }
+};
+static_assert(sizeof(MergeEntry) == 16);
+static const size_t MERGE_MAX_WAYS = size_t{1} << 32;
+static const uint32_t MERGE_NO_POSITION = UINT32_MAX;
+
+// The node lists of many ways, in compressed sparse row layout: One array of all node IDs, and where each way
+// starts in it. That's 8 bytes per node, instead of a separately allocated vector per way. Optionally, each way
+// is stored as zigzag varint deltas instead, which is typically 2-3 bytes per node, because consecutive nodes
+// of a way tend to have similar IDs. Then node() has to decode from the start of the way, though.
+class WayNodeList {
+public:
+    explicit WayNodeList(bool compress = false)
+        : m_compress(compress)
+    {
+        m_offsets.push_back(0);
+    }
+
+    void add(osmium::Way const& way) {
+        m_way_ids.push_back(way.id());
+        if (m_compress) {
+            protozero::add_varint_to_buffer(&m_packed, way.nodes().size());
+            osmium::object_id_type previous = 0;
+            for (auto const& noderef : way.nodes()) {
+                protozero::add_varint_to_buffer(&m_packed, protozero::encode_zigzag64(noderef.ref() - previous));
+                previous = noderef.ref();
+            }
+            m_offsets.push_back(m_packed.size());
+        } else {
+            for (auto const& noderef : way.nodes()) {
+                m_node_ids.push_back(noderef.ref());
+            }
+            m_offsets.push_back(m_node_ids.size());
+        }
+        m_total_nodes += way.nodes().size();
+    }
+
+    size_t size() const {
+        return m_way_ids.size();
+    }
+
+    size_t total_nodes() const {
+        return m_total_nodes;
+    }
+
+    size_t used_bytes() const {
+        return m_way_ids.capacity() * sizeof(m_way_ids[0]) + m_offsets.capacity() * sizeof(m_offsets[0])
+            + m_node_ids.capacity() * sizeof(m_node_ids[0]) + m_packed.capacity();
+    }
+
+    osmium::object_id_type way_id(size_t way_index) const {
+        return m_way_ids[way_index];
+    }
+
+    size_t node_count(size_t way_index) const {
+        if (!m_compress) {
+            return m_offsets[way_index + 1] - m_offsets[way_index];
+        }
+        char const* data = m_packed.data() + m_offsets[way_index];
+        return protozero::decode_varint(&data, m_packed.data() + m_offsets[way_index + 1]);
+    }
+
+    osmium::object_id_type node(size_t way_index, size_t node_index) const {
+        assert(node_index < node_count(way_index));
+        if (!m_compress) {
+            return m_node_ids[m_offsets[way_index] + node_index];
+        }
+        osmium::object_id_type found = 0;
+        size_t current = 0;
+        for_each_node(way_index, [&found, &current, node_index](osmium::object_id_type node_id){
+            if (current++ == node_index) {
+                found = node_id;
+            }
+        });
+        return found;
+    }
+
+    template <typename TFunc>
+    void for_each_node(size_t way_index, TFunc&& func) const {
+        if (!m_compress) {
+            for (size_t i = m_offsets[way_index]; i < m_offsets[way_index + 1]; ++i) {
+                func(m_node_ids[i]);
+            }
+            return;
+        }
+        char const* data = m_packed.data() + m_offsets[way_index];
+        char const* end = m_packed.data() + m_offsets[way_index + 1];
+        size_t count = protozero::decode_varint(&data, end);
+        osmium::object_id_type node_id = 0;
+        for (size_t i = 0; i < count; ++i) {
+            node_id += protozero::decode_zigzag64(protozero::decode_varint(&data, end));
+            func(node_id);
+        }
+    }
+
+    // Turns the node lists into merge entries, sorted by node ID, which is the order in which the second pass needs
+    // them. The node lists are freed before sorting, so the peak is the lists plus 16 bytes per node.
+    // Only the way IDs stay.
+    std::vector<MergeEntry> take_merge_entries() {
+        if (size() > MERGE_MAX_WAYS) {
+            printf("Can't merge %lu ways, at most %lu are supported. Select fewer?!\n", size(), MERGE_MAX_WAYS);
+            exit(1);
+        }
+        std::vector<MergeEntry> entries;
+        entries.reserve(m_total_nodes);
+        for (size_t way_index = 0; way_index < size(); ++way_index) {
+            uint32_t position = 0;
+            for_each_node(way_index, [&entries, &position, way_index](osmium::object_id_type node_id){
+                entries.push_back(MergeEntry{node_id, static_cast<uint32_t>(way_index), position++});
+            });
+        }
+        m_node_ids = std::vector<osmium::object_id_type>();
+        m_packed = std::string();
+        m_offsets = std::vector<size_t>(1, 0);
+        m_total_nodes = 0;
+        std::sort(entries.begin(), entries.end());
+        return entries;
+    }
+
+private:
+    bool m_compress;
+    std::vector<osmium::object_id_type> m_way_ids;
+    // Into m_node_ids, or into m_packed when compressed. One more than there are ways.
+    std::vector<size_t> m_offsets;
+    std::vector<osmium::object_id_type> m_node_ids;
+    std::string m_packed;
+    size_t m_total_nodes {0};
+};
+
+// Collects the ways of a selection, see selection.hpp.
+template <typename TSelection>
+class WayNodesExtractor : public osmium::handler::Handler {
+public:
+    explicit WayNodesExtractor(TSelection const& selection, bool compress = false)
+        : m_selection(selection)
+        , m_ways(compress)
+    {
+    }
+
+    void way(const osmium::Way& way) {
+        if (!is_selected(m_selection, way))
+            return;
+        m_ways.add(way);
+    }
+
+    //void relation(const osmium::Relation& relation) {
+    //    ???
+    //    Note that resolving relations this way will take at
+    //    least three passes, and potentially dozens.
+    //}
+
+    WayNodeList const& ways() const {
+        return m_ways;
+    }
+
+    WayNodeList take_ways() {
+        return std::move(m_ways);
+    }
+
+private:
+    TSelection const& m_selection;
+    WayNodeList m_ways;
+};
+
+// Resolves each way to the location of its first resolvable node, in way order, by merging the sorted node refs
+// against the nodes in ascending order. Nothing is printed before print_locations(), because a later node of the
+// pass may still turn out to be earlier in its way.
+class FirstLocationExtractor : public osmium::handler::Handler {
+public:
+    explicit FirstLocationExtractor(WayNodeList&& ways)
+        : m_ways(std::move(ways))
+        , m_entries(m_ways.take_merge_entries())
+        , m_locs(m_ways.size())
+        , m_positions(m_ways.size(), MERGE_NO_POSITION)
+    {
+    }
+
+    // Calls func(node_id) for every node that is still wanted, in ascending order, i.e. the order in which node() expects them.
+    // Nodes that are shared by several ways are reported once per way.
+    template <typename TFunc>
+    void for_each_interesting_node_id(TFunc&& func) const {
+        for (size_t i = m_next; i < m_entries.size(); ++i) {
+            func(m_entries[i].node_id);
+        }
+    }
+
+    void node(const osmium::Node& node) {
+        merge_location(node.id(), node.location());
+    }
+
+    // Instead of a node pass: Looks up every interesting node, e.g. with NodeLocationStore::get(), in ascending order.
+    // An undefined Location means that the node doesn't exist.
+    template <typename TGetLocation>
+    void resolve_all(TGetLocation&& get_location) {
+        while (m_next < m_entries.size()) {
+            osmium::object_id_type node_id = m_entries[m_next].node_id;
+            osmium::Location loc = get_location(node_id);
+            if (loc) {
+                merge_location(node_id, loc);
+            } else {
+                while (m_next < m_entries.size() && m_entries[m_next].node_id == node_id) {
+                    ++m_next;
+                }
+            }
+        }
+    }
+
+    // Call once the node pass is done. Prints every way in the order of the first pass, like the lookup engines,
+    // with an undefined location if none of its nodes exist.
+    void print_locations() const {
+        for (size_t way_index = 0; way_index < m_ways.size(); ++way_index) {
+            printf("w%lu x%d y%d\n", m_ways.way_id(way_index), m_locs[way_index].x(), m_locs[way_index].y());
+        }
+    }
+
+private:
+    void merge_location(osmium::object_id_type node_id, osmium::Location loc) {
+        // Interesting nodes before this one are not in the dataset, so skip them.
+        while (m_next < m_entries.size() && object_id_less(m_entries[m_next].node_id, node_id)) {
+            ++m_next;
+        }
+        // Several ways may share this node. Keep it for each of them where it comes before the best node so far.
+        while (m_next < m_entries.size() && m_entries[m_next].node_id == node_id) {
+            MergeEntry const& entry = m_entries[m_next];
+            if (entry.position < m_positions[entry.way_index]) {
+                m_positions[entry.way_index] = entry.position;
+                m_locs[entry.way_index] = loc;
+            }
+            ++m_next;
+        }
+    }
+
+    WayNodeList m_ways;
+    // Sorted by node ID, see WayNodeList::take_merge_entries().
+    std::vector<MergeEntry> m_entries;
+    size_t m_next {0};
+    std::vector<osmium::Location> m_locs;
+    // Of the node that m_locs came from, within its way.
+    std::vector<uint32_t> m_positions;
+};